@@ -0,0 +1,961 @@
+#include "cuckoo_map.h"
+#include "map.h"
+#include "multi_map.h"
+#include "shared_map.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace cmap;
+
+// Small self contained benchmark driver: each benchmark prints one line with
+// the throughput in million operations per second.
+// Usage: benchmark [threads] [keys]
+//        benchmark stress [repeats] [threads]
+// The stress mode instead runs the resize scenarios of the multi-threaded
+// unit tests over and over, and reports latencies rather than throughput.
+
+size_t THREADS = std::thread::hardware_concurrency();
+size_t KEYS = 1 << 20;
+
+// The cpus belonging to each online NUMA node, read from sysfs. On a
+// machine without NUMA info this is a single node holding every cpu.
+std::vector<std::vector<int>> cpusPerNode() {
+    std::vector<std::vector<int>> nodes;
+    for (int const node : onlineNumaNodes()) {
+        std::ifstream file("/sys/devices/system/node/node" +
+                           std::to_string(node) + "/cpulist");
+        std::string list;
+        std::vector<int> cpus;
+        // Same list format as the online nodes.
+        if (file >> list) cpus = parseNumaNodeList(list);
+        nodes.push_back(cpus);
+    }
+    if (nodes.empty() || nodes[0].empty()) {
+        nodes = {{}};
+        for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+            nodes[0].push_back(cpu);
+    }
+    return nodes;
+}
+
+void pinToCpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// Runs fn(threadIdx) on nThreads threads and returns the wall time in
+// seconds. If cpus isn't empty thread i is pinned to cpus[i % cpus.size()].
+double runThreads(size_t nThreads, std::function<void(size_t)> const& fn,
+                  std::vector<int> const& cpus = {}) {
+    std::vector<std::thread> threads;
+    auto const start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nThreads; i++) {
+        threads.emplace_back([&, i] {
+            if (!cpus.empty()) pinToCpu(cpus[i % cpus.size()]);
+            fn(i);
+        });
+    }
+    for (auto& t : threads) t.join();
+    std::chrono::duration<double> const elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+void report(std::string const& name, size_t ops, double seconds) {
+    std::printf("%-48s %10.2f Mops/s\n", name.c_str(), ops / seconds / 1e6);
+}
+
+std::vector<int> shuffledKeys(size_t n) {
+    std::vector<int> keys(n);
+    for (size_t i = 0; i < n; i++) keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(0));
+    return keys;
+}
+
+// Inserts then reads KEYS keys with every thread pinned to the cpus of the
+// given node, so on a multi socket host the threads of one run all sit on
+// one socket while the table is either local (DEFAULT placement by the
+// resizing thread) or spread over all nodes (INTERLEAVE).
+void benchNumaPlacement(NumaPolicy policy, std::string const& policyName,
+                        int node, std::vector<int> const& cpus) {
+    auto const keys = shuffledKeys(KEYS);
+    ConcurrentUnorderedMap<int, int> map(5, DEFAULT_MAX_LOAD_RATIO, policy);
+    auto const perThread = KEYS / THREADS;
+
+    auto const insertTime = runThreads(
+        THREADS,
+        [&](size_t t) {
+            for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+                map.insert({keys[i], keys[i]});
+        },
+        cpus);
+    auto const suffix = policyName + " node " + std::to_string(node);
+    report("insert " + suffix, perThread * THREADS, insertTime);
+
+    auto const atTime = runThreads(
+        THREADS,
+        [&](size_t t) {
+            volatile int sink = 0;
+            (void)sink;
+            for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+                sink = map.at(keys[i]);
+        },
+        cpus);
+    report("at " + suffix, perThread * THREADS, atTime);
+}
+
+// Compares read throughput of the concurrent map with its frozen copy.
+void benchFrozenLookup() {
+    auto const keys = shuffledKeys(KEYS);
+    ConcurrentUnorderedMap<int, int> map;
+    for (auto const key : keys) map.insert({key, key});
+    auto const frozen = map.freeze();
+    auto const perThread = KEYS / THREADS;
+
+    auto const atTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.at(keys[i]);
+    });
+    report("at concurrent", perThread * THREADS, atTime);
+
+    auto const frozenTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = frozen.at(keys[i]);
+    });
+    report("at frozen", perThread * THREADS, frozenTime);
+}
+
+// Write path of a single writer thread with the default MultiWriter policy
+// against the SingleWriter one, where every CAS is a release store.
+template <typename Policy>
+void benchWriter(std::string const& name) {
+    auto const keys = shuffledKeys(KEYS);
+    ConcurrentUnorderedMap<int, int, Policy> map;
+    auto const insertTime = runThreads(1, [&](size_t) {
+        for (auto const key : keys) map.insert({key, key});
+    });
+    report("insert (1 writer) " + name, KEYS, insertTime);
+
+    auto const updateTime = runThreads(1, [&](size_t) {
+        for (auto const key : keys) map.insert({key, -key});
+    });
+    report("update (1 writer) " + name, KEYS, updateTime);
+
+    auto const eraseTime = runThreads(1, [&](size_t) {
+        for (auto const key : keys) map.erase(key);
+    });
+    report("erase (1 writer) " + name, KEYS, eraseTime);
+}
+
+// Keys drawn from a Zipfian distribution over [0, n) with exponent s, so a
+// handful of keys get most of the traffic.
+std::vector<int> zipfianKeys(size_t count, size_t n, double s) {
+    std::vector<double> cdf(n);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += 1.0 / std::pow(i + 1, s);
+        cdf[i] = sum;
+    }
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> uniform(0, sum);
+    std::vector<int> keys(count);
+    for (auto& key : keys) {
+        key = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) -
+              cdf.begin();
+    }
+    return keys;
+}
+
+// Every thread overwrites hot keys as fast as it can, the worst case for
+// the CAS retry loops.
+void benchHotKeyUpdates(BackoffStrategy strategy, std::string const& name) {
+    auto const keys = zipfianKeys(KEYS, 1024, 0.99);
+    ConcurrentUnorderedMap<int, int> map(12, DEFAULT_MAX_LOAD_RATIO,
+                                         NumaPolicy::DEFAULT, strategy);
+    auto const perThread = KEYS / THREADS;
+    auto const time = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            map.insert({keys[i], int(i)});
+    });
+    report("zipfian update backoff " + name, perThread * THREADS, time);
+}
+
+// Counter increments on zipfian keys, with the hottest keys combined after
+// hotKeyCasFailures lost CASes, or never. Run on 1, 2, 4, ... THREADS
+// threads, to show how the two scale.
+void benchHotKeyAdds(size_t hotKeyCasFailures, std::string const& name) {
+    auto const keys = zipfianKeys(KEYS, 1024, 0.99);
+    std::vector<size_t> threadCounts;
+    for (size_t n = 1; n < THREADS; n *= 2) threadCounts.push_back(n);
+    threadCounts.push_back(THREADS);
+    for (auto const nThreads : threadCounts) {
+        KvsConfig config;
+        config.hotKeyCasFailures = hotKeyCasFailures;
+        ConcurrentUnorderedMap<int, int> map(4096, config);
+        auto const perThread = KEYS / nThreads;
+        auto const time = runThreads(nThreads, [&](size_t t) {
+            for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+                map.add(keys[i], 1);
+        });
+        report("zipfian add " + name + " " + std::to_string(nThreads) +
+                   " threads",
+               perThread * nThreads, time);
+    }
+}
+
+// Lookups of keys that aren't there, with and without miss filters, once
+// on a single kvs and once with a resize just started, so every miss goes
+// through both kvs of the chain. Also prints the filter's false positive
+// rate for the same keys.
+void benchMissFilter(bool missFilter, std::string const& name) {
+    KvsConfig config;
+    config.missFilter = missFilter;
+    // Exactly full, the next insert starts a resize.
+    size_t const slots = KEYS / DEFAULT_MAX_LOAD_RATIO;
+    ConcurrentUnorderedMap<int, int> map(slots, config);
+    for (size_t key = 0; key < KEYS; key++) map.insert({key, key});
+    auto const perThread = KEYS / THREADS;
+    auto const misses = [&](size_t t) {
+        volatile bool sink = false;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.contains(KEYS + i);
+    };
+    auto const missTime = runThreads(THREADS, misses);
+    report("miss " + name, perThread * THREADS, missTime);
+    std::printf("%-48s %10.1f ns/miss\n", ("miss latency " + name).c_str(),
+                missTime * THREADS / (perThread * THREADS) * 1e9);
+
+    map.insert({-1, -1});
+    auto const chainTime = runThreads(THREADS, misses);
+    report("miss during resize " + name, perThread * THREADS, chainTime);
+
+    auto const hitTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.at(i);
+    });
+    report("hit " + name, perThread * THREADS, hitTime);
+
+    if (missFilter) {
+        KeyValueStore<int, int> kvs(slots, config);
+        for (size_t key = 0; key < KEYS; key++) kvs.insert({key, key});
+        // Random keys, consecutive ones hash too evenly to be typical.
+        std::mt19937 rng(0);
+        std::uniform_int_distribution<int> absent(KEYS, INT32_MAX);
+        size_t falsePositives = 0;
+        for (size_t i = 0; i < KEYS; i++)
+            falsePositives += kvs.mayContain(absent(rng));
+        std::printf("%-48s %10.3f %%\n", "miss filter false positives",
+                    100.0 * falsePositives / KEYS);
+    }
+}
+
+// Moves between two of 1024 counters, as an atomic batch or as two
+// inserts under one global mutex.
+void benchAtomicBatch() {
+    size_t const nKeys = 1024;
+    ConcurrentUnorderedMap<int, int> map(12);
+    for (size_t key = 0; key < nKeys; key++) map.insert({key, 0});
+    auto const perThread = KEYS / THREADS;
+    std::mutex mutex;
+    auto const lockedTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++) {
+            int const from = i % nKeys;
+            int const to = (i * 7 + 1) % nKeys;
+            std::lock_guard<std::mutex> lock(mutex);
+            map.insert({from, map.at(from) - 1});
+            map.insert({to, map.at(to) + 1});
+        }
+    });
+    report("move under mutex", perThread * THREADS, lockedTime);
+
+    auto const batchTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++) {
+            int const from = i % nKeys;
+            int const to = (i * 7 + 1) % nKeys;
+            while (true) {
+                int const fromValue = map.at(from);
+                int const toValue = map.at(to);
+                if (map.atomic_batch(
+                        {{BatchOpType::INSERT, from, fromValue - 1, fromValue},
+                         {BatchOpType::INSERT, to, toValue + 1, toValue}})) {
+                    break;
+                }
+            }
+        }
+    });
+    report("move atomic_batch", perThread * THREADS, batchTime);
+}
+
+// Dumping the map sorted by key, the way it's done without an export: at()
+// for every key of a separately kept key list, which is then sorted. Against
+// to_sorted_vector, to_unordered_map and operator==.
+void benchExport() {
+    auto const keys = shuffledKeys(KEYS);
+    ConcurrentUnorderedMap<int, int> map;
+    for (auto const key : keys) map.insert({key, key});
+
+    auto const lookupTime = runThreads(1, [&](size_t) {
+        std::vector<std::pair<int, int>> entries;
+        entries.reserve(keys.size());
+        for (auto const key : keys) entries.emplace_back(key, map.at(key));
+        std::sort(entries.begin(), entries.end());
+    });
+    report("sorted dump at() per key", KEYS, lookupTime);
+    auto const sortedTime = runThreads(1, [&](size_t) {
+        volatile size_t sink = map.to_sorted_vector(THREADS).size();
+        (void)sink;
+    });
+    report("sorted dump to_sorted_vector", KEYS, sortedTime);
+    std::unordered_map<int, int> copy;
+    auto const convertTime = runThreads(1, [&](size_t) {
+        copy = map.to_unordered_map(THREADS);
+    });
+    report("to_unordered_map", KEYS, convertTime);
+    auto const compareTime = runThreads(1, [&](size_t) {
+        volatile bool sink = map == copy;
+        (void)sink;
+    });
+    report("operator== scan", KEYS, compareTime);
+}
+
+// Short string keys stored as std::string (a key allocation plus the
+// string's own buffer) or InlineString (inside the slot), looked up through
+// string_views so no lookup builds a key.
+template <typename Key>
+void benchStringKeys(std::string const& name) {
+    std::vector<std::string> keys;
+    for (auto const key : shuffledKeys(KEYS))
+        keys.push_back("user:" + std::to_string(key) + ":session");
+    ConcurrentUnorderedMap<Key, int, MultiWriter, StringHash, StringEqual> map;
+    auto const insertTime = runThreads(1, [&](size_t) {
+        for (size_t i = 0; i < keys.size(); i++) map.insert({keys[i], int(i)});
+    });
+    report("insert string keys " + name, KEYS, insertTime);
+
+    auto const perThread = KEYS / THREADS;
+    auto const atTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.at(std::string_view(keys[i]));
+    });
+    report("at string_view " + name, perThread * THREADS, atTime);
+}
+
+// Expiring half the entries with erase one key at a time, against one
+// erase_if sweep over the slot arrays.
+void benchEraseIf() {
+    auto const keys = shuffledKeys(KEYS);
+    auto const expired = [](int const& key, int const&) { return key % 2; };
+
+    ConcurrentUnorderedMap<int, int> map;
+    for (auto const key : keys) map.insert({key, key});
+    auto const eraseTime = runThreads(1, [&](size_t) {
+        for (auto const key : keys) {
+            if (expired(key, key)) map.erase(key);
+        }
+    });
+    report("expire half with erase", KEYS, eraseTime);
+
+    ConcurrentUnorderedMap<int, int> sweptMap;
+    for (auto const key : keys) sweptMap.insert({key, key});
+    auto const sweepTime = runThreads(
+        1, [&](size_t) { sweptMap.erase_if(expired, THREADS); });
+    report("expire half with erase_if", KEYS, sweepTime);
+}
+
+// Emptying a full map by erasing every key against clear(), reported per
+// key the map held.
+void benchClear() {
+    auto const keys = shuffledKeys(KEYS);
+    ConcurrentUnorderedMap<int, int> map;
+    for (auto const key : keys) map.insert({key, key});
+    auto const eraseTime = runThreads(1, [&](size_t) {
+        for (auto const key : keys) map.erase(key);
+    });
+    report("empty with erase", KEYS, eraseTime);
+
+    for (auto const key : keys) map.insert({key, key});
+    auto const clearTime = runThreads(1, [&](size_t) { map.clear(); });
+    report("empty with clear", KEYS, clearTime);
+}
+
+// Throughput and final slot count for a growth factor and load ratio.
+void benchGrowth(float growthFactor, float maxLoadRatio) {
+    auto const keys = shuffledKeys(KEYS);
+    KvsConfig config;
+    config.growthFactor = growthFactor;
+    config.maxLoadRatio = maxLoadRatio;
+    ConcurrentUnorderedMap<int, int> map(32, config);
+    auto const insertTime = runThreads(1, [&](size_t) {
+        for (auto const key : keys) map.insert({key, key});
+    });
+    auto const name = "growth " + std::to_string(growthFactor).substr(0, 3) +
+                      " load " + std::to_string(maxLoadRatio).substr(0, 4);
+    report("insert " + name, KEYS, insertTime);
+
+    auto const perThread = KEYS / THREADS;
+    auto const atTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.at(keys[i]);
+    });
+    report("at " + name, perThread * THREADS, atTime);
+    std::printf("%-48s %10zu slots\n", name.c_str(),
+                map.bucket_count());
+}
+
+// Calls through the map against calls through a per-thread Handle.
+void benchHandle() {
+    auto const keys = shuffledKeys(KEYS);
+    auto const perThread = KEYS / THREADS;
+
+    ConcurrentUnorderedMap<int, int> map;
+    auto const insertTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            map.insert({keys[i], keys[i]});
+    });
+    report("insert map", perThread * THREADS, insertTime);
+    auto const atTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.at(keys[i]);
+    });
+    report("at map", perThread * THREADS, atTime);
+
+    ConcurrentUnorderedMap<int, int> handleMap;
+    auto const handleInsertTime = runThreads(THREADS, [&](size_t t) {
+        auto handle = handleMap.handle();
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            handle.insert({keys[i], keys[i]});
+    });
+    report("insert handle", perThread * THREADS, handleInsertTime);
+    auto const handleAtTime = runThreads(THREADS, [&](size_t t) {
+        auto handle = handleMap.handle();
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = handle.at(keys[i]);
+    });
+    report("at handle", perThread * THREADS, handleAtTime);
+}
+
+// The shared memory map against the in process map, same keys and threads.
+void benchSharedMap() {
+    auto const keys = shuffledKeys(KEYS);
+    auto const perThread = KEYS / THREADS;
+    auto const name = "/cmap_bench_" + std::to_string(getpid());
+    SharedUnorderedMap<int, int> map(name, 2 * KEYS);
+    SharedUnorderedMap<int, int>::remove(name);
+
+    auto const insertTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            map.insert({keys[i], keys[i]});
+    });
+    report("insert shared map", perThread * THREADS, insertTime);
+    auto const atTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.at(keys[i]);
+    });
+    report("at shared map", perThread * THREADS, atTime);
+}
+
+// Overwrites of 1024 keys, then reads of them. 64 byte records are stored
+// inline (StoreValueInline) and updated in place; the 8 byte ones are heap
+// wrapped, one allocation and free per update.
+template <typename Value>
+void benchOverwrites(std::string const& name) {
+    size_t const nKeys = 1024;
+    ConcurrentUnorderedMap<int, Value> map(12);
+    for (size_t key = 0; key < nKeys; key++) map.insert({key, Value()});
+    auto const perThread = KEYS / THREADS;
+    auto const updateTime = runThreads(THREADS, [&](size_t t) {
+        Value value{};
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++) {
+            // A new value every time, rewriting the same one is a no-op.
+            value.fill(i);
+            map.insert({i % nKeys, value});
+        }
+    });
+    report("overwrite " + name, perThread * THREADS, updateTime);
+    auto const atTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++) {
+            volatile auto sink = map.at(i % nKeys);
+            (void)sink;
+        }
+    });
+    report("at " + name, perThread * THREADS, atTime);
+}
+
+// CuckooUnorderedMap against ConcurrentUnorderedMap with the same memory
+// budget: both start with as many bytes of table as the map needs slots for
+// KEYS keys at the default load ratio, so neither resizes.
+void benchCuckoo() {
+    auto const keys = shuffledKeys(KEYS);
+    auto const perThread = KEYS / THREADS;
+    size_t const slots = KEYS / DEFAULT_MAX_LOAD_RATIO;
+    size_t const budget = slots * sizeof(Slot<int, int>);
+
+    ConcurrentUnorderedMap<int, int> map(slots, KvsConfig());
+    typedef CuckooUnorderedMap<int, int> Cuckoo;
+    Cuckoo cuckoo(budget / CUCKOO_BUCKET_BYTES * Cuckoo::SLOTS_PER_BUCKET);
+
+    auto const mapInsertTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            map.insert({keys[i], keys[i]});
+    });
+    report("insert map", perThread * THREADS, mapInsertTime);
+    auto const cuckooInsertTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            cuckoo.insert({keys[i], keys[i]});
+    });
+    report("insert cuckoo", perThread * THREADS, cuckooInsertTime);
+
+    auto const mapAtTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = map.at(keys[i]);
+    });
+    report("at map", perThread * THREADS, mapAtTime);
+    auto const cuckooAtTime = runThreads(THREADS, [&](size_t t) {
+        volatile int sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = cuckoo.at(keys[i]);
+    });
+    report("at cuckoo", perThread * THREADS, cuckooAtTime);
+
+    size_t const mapBytes = map.bucket_count() * sizeof(Slot<int, int>) +
+                            map.size() * sizeof(DataWrapper<int>);
+    std::printf("%-48s %10.1f bytes/key\n", "map",
+                double(mapBytes) / map.size());
+    std::printf("%-48s %10.1f bytes/key %5.2f load\n", "cuckoo",
+                double(cuckoo.tableBytes()) / cuckoo.size(),
+                double(cuckoo.size()) / cuckoo.bucket_count());
+
+    // How full the cuckoo table gets before its first grow.
+    Cuckoo full(budget / CUCKOO_BUCKET_BYTES * Cuckoo::SLOTS_PER_BUCKET);
+    auto const bucketCount = full.bucket_count();
+    size_t inserted = 0;
+    auto const fillTime = runThreads(1, [&](size_t) {
+        for (int key = 0; full.bucket_count() == bucketCount; key++) {
+            full.insert({key, key});
+            inserted++;
+        }
+    });
+    report("insert cuckoo to full", inserted, fillTime);
+    std::printf("%-48s %10.3f load\n", "cuckoo full",
+                double(inserted - 1) / bucketCount);
+}
+
+// ConcurrentUnorderedMultiMap against the map-of-locked-vectors index it
+// replaces, KEYS ids spread over KEYS / 8 keys.
+void benchMultiMap() {
+    size_t const fanOut = 8;
+    auto const ids = shuffledKeys(KEYS);
+    auto const perThread = KEYS / THREADS;
+    size_t const nKeys = KEYS / fanOut;
+
+    struct LockedIds {
+        std::mutex mutex;
+        std::vector<int> ids;
+    };
+    std::vector<LockedIds> lists(nKeys);
+    ConcurrentUnorderedMap<int, int> listOfKey;
+    for (size_t key = 0; key < nKeys; key++) listOfKey.insert({key, key});
+    auto const lockedInsertTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++) {
+            auto& list = lists[listOfKey.at(ids[i] / fanOut)];
+            std::lock_guard<std::mutex> lock(list.mutex);
+            list.ids.push_back(ids[i]);
+        }
+    });
+    report("insert locked vectors", perThread * THREADS, lockedInsertTime);
+    auto const lockedCountTime = runThreads(THREADS, [&](size_t t) {
+        volatile size_t sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++) {
+            auto& list = lists[listOfKey.at(ids[i] / fanOut)];
+            std::lock_guard<std::mutex> lock(list.mutex);
+            sink = list.ids.size();
+        }
+    });
+    report("count locked vectors", perThread * THREADS, lockedCountTime);
+
+    ConcurrentUnorderedMultiMap<int, int> index;
+    auto const insertTime = runThreads(THREADS, [&](size_t t) {
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            index.insert({ids[i] / fanOut, ids[i]});
+    });
+    report("insert multimap", perThread * THREADS, insertTime);
+    auto const countTime = runThreads(THREADS, [&](size_t t) {
+        volatile size_t sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = index.count(ids[i] / fanOut);
+    });
+    report("count multimap", perThread * THREADS, countTime);
+
+    // A few keys with thousands of values each among keys with one: the
+    // light keys shouldn't pay for their heavy neighbours.
+    int const heavyKeys = 4;
+    int const heavyValues = 4000;
+    ConcurrentUnorderedMultiMap<int, int> skewed;
+    for (int value = 0; value < heavyValues; value++) {
+        for (int key = 0; key < heavyKeys; key++) skewed.insert({key, value});
+    }
+    for (size_t i = 0; i < nKeys; i++) skewed.insert({heavyKeys + ids[i], 0});
+    auto const lightTime = runThreads(THREADS, [&](size_t t) {
+        volatile size_t sink = 0;
+        (void)sink;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = skewed.count(heavyKeys + ids[i % nKeys]);
+    });
+    report("count multimap light keys beside heavy", perThread * THREADS,
+           lightTime);
+}
+
+#ifdef CMAP_ENABLE_COROUTINES
+LookupTask asyncSum(ConcurrentUnorderedMap<int, int> const& map, int key,
+                    long& sum) {
+    auto const value = co_await map.async_find(key);
+    if (value) sum += *value;
+}
+
+// Plain at() against async_find with inFlight lookups interleaved on
+// every thread, over a map much bigger than the caches.
+void benchAsyncFind(size_t inFlight) {
+    auto const keys = shuffledKeys(KEYS);
+    ConcurrentUnorderedMap<int, int> map;
+    for (auto const key : keys) map.insert({key, key});
+    auto const perThread = KEYS / THREADS;
+
+    auto const atTime = runThreads(THREADS, [&](size_t t) {
+        volatile long sink = 0;
+        for (size_t i = t * perThread; i < (t + 1) * perThread; i++)
+            sink = sink + map.at(keys[i]);
+    });
+    report("at", perThread * THREADS, atTime);
+
+    auto const asyncTime = runThreads(THREADS, [&](size_t t) {
+        long sum = 0;
+        LookupScheduler scheduler;
+        auto const end = (t + 1) * perThread;
+        for (size_t i = t * perThread; i < end; i += inFlight) {
+            for (size_t j = i; j < std::min(end, i + inFlight); j++)
+                scheduler.spawn(asyncSum(map, keys[j], sum));
+            scheduler.run();
+        }
+        volatile long sink = sum;
+        (void)sink;
+    });
+    report("async_find " + std::to_string(inFlight) + " in flight",
+           perThread * THREADS, asyncTime);
+}
+#endif
+
+// Latencies in nanoseconds of the operations of one stress scenario, split
+// by whether the map had a resize under way when they started or ended.
+struct StressLog {
+    std::vector<std::uint64_t> during;
+    std::vector<std::uint64_t> outside;
+    size_t peakDepth = 0;
+
+    void append(StressLog const& other) {
+        during.insert(during.end(), other.during.begin(), other.during.end());
+        outside.insert(outside.end(), other.outside.begin(),
+                       other.outside.end());
+        peakDepth = std::max(peakDepth, other.peakDepth);
+    }
+};
+
+template <typename Map, typename Op>
+void timeOp(Map const& map, StressLog& log, Op&& op) {
+    bool resizing = map.depth() != 0;
+    auto const start = std::chrono::steady_clock::now();
+    op();
+    auto const nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    size_t const depth = map.depth();
+    resizing = resizing || depth != 0;
+    log.peakDepth = std::max(log.peakDepth, depth);
+    (resizing ? log.during : log.outside).push_back(nanos);
+}
+
+// Bytes allocated through operator new while gCountHeap was set and not
+// freed since, whichever thread did either. Counting in operator new sees
+// every allocation, where malloc statistics only cover the arena of the
+// thread asking.
+std::atomic<long long> gHeapBytes{};
+std::atomic<bool> gCountHeap{};
+
+// Every allocation keeps the size it counted in front of it, 0 if it went
+// uncounted, so its delete takes off just that.
+void* countedNew(std::size_t size, std::size_t align) {
+    std::size_t const header = std::max(align, alignof(std::max_align_t));
+    std::size_t const total = (header + size + header - 1) / header * header;
+    auto* const raw = static_cast<char*>(std::aligned_alloc(header, total));
+    if (raw == nullptr) throw std::bad_alloc();
+    std::size_t const counted =
+        gCountHeap.load(std::memory_order_relaxed) ? size : 0;
+    reinterpret_cast<std::size_t*>(raw + header)[-1] = counted;
+    if (counted != 0) gHeapBytes.fetch_add(counted, std::memory_order_relaxed);
+    return raw + header;
+}
+
+void countedDelete(void* ptr, std::size_t align) {
+    if (ptr == nullptr) return;
+    std::size_t const header = std::max(align, alignof(std::max_align_t));
+    auto* const data = static_cast<char*>(ptr);
+    auto const counted = reinterpret_cast<std::size_t*>(data)[-1];
+    if (counted != 0) gHeapBytes.fetch_sub(counted, std::memory_order_relaxed);
+    std::free(data - header);
+}
+
+long long heapBytesInUse() { return gHeapBytes.load(); }
+
+// Runs scenario(map, logs) repeats times, scenario filling one log per
+// thread, and prints the tail latencies during and outside resizes, how long
+// the copies took, the deepest chain seen, the bytes the retired kvs held on
+// to and the heap bytes still in use once each map was gone.
+template <typename Scenario>
+void benchStress(std::string const& name, size_t repeats, size_t nThreads,
+                 Scenario&& scenario) {
+    StressLog total;
+    typename ConcurrentUnorderedMap<int, int>::ResizeStats resizes;
+    size_t maxRetainedBytes = 0;
+    long long leakedBytes = 0;
+    gCountHeap = true;
+    for (size_t r = 0; r < repeats; r++) {
+        // Reserved for more operations than any scenario does, so the logs
+        // don't allocate while the heap is being measured.
+        std::vector<StressLog> logs(nThreads);
+        for (auto& log : logs) {
+            log.during.reserve(1 << 12);
+            log.outside.reserve(1 << 12);
+        }
+        long long const heapBefore = heapBytesInUse();
+        {
+            auto const stats = scenario(logs);
+            resizes.resizes += stats.resizes;
+            resizes.copying += stats.copying;
+            resizes.totalCopyNanos += stats.totalCopyNanos;
+            resizes.maxCopyNanos =
+                std::max(resizes.maxCopyNanos, stats.maxCopyNanos);
+            maxRetainedBytes = std::max(maxRetainedBytes, stats.retainedBytes);
+        }
+        leakedBytes += heapBytesInUse() - heapBefore;
+        for (auto const& log : logs) total.append(log);
+    }
+    gCountHeap = false;
+
+    auto const print = [&](char const* when, std::vector<std::uint64_t>& ns) {
+        if (ns.empty()) {
+            std::printf("%-48s %10s\n", (name + " " + when).c_str(), "no ops");
+            return;
+        }
+        std::sort(ns.begin(), ns.end());
+        auto const at = [&](double q) {
+            return ns[size_t(q * (ns.size() - 1))];
+        };
+        std::printf(
+            "%-48s p50 %llu p99 %llu p99.9 %llu max %llu ns (%zu ops)\n",
+            (name + " " + when).c_str(), (unsigned long long)at(0.5),
+            (unsigned long long)at(0.99), (unsigned long long)at(0.999),
+            (unsigned long long)ns.back(), ns.size());
+    };
+    print("during resize", total.during);
+    print("outside resize", total.outside);
+    std::printf(
+        "%-48s %zu resizes, mean %.1f us max %.1f us from newKvs to copied, "
+        "%zu left copying\n",
+        name.c_str(), resizes.resizes,
+        resizes.resizes == 0
+            ? 0.0
+            : resizes.totalCopyNanos / 1e3 / resizes.resizes,
+        resizes.maxCopyNanos / 1e3, resizes.copying);
+    std::printf("%-48s peak depth %zu, retained %zu bytes, leaked %lld bytes\n",
+                name.c_str(), total.peakDepth, maxRetainedBytes,
+                leakedBytes / (long long)repeats);
+}
+
+// Test_DoubleResize: every thread inserts the same bucket_count() + 1 keys
+// into a default map, so several threads trigger its first resize at once.
+void stressDoubleResize(size_t repeats, size_t nThreads) {
+    benchStress("double resize", repeats, nThreads, [&](auto& logs) {
+        ConcurrentUnorderedMap<int, int> map;
+        auto const keys = shuffledKeys(map.bucket_count() + 1);
+        runThreads(nThreads, [&](size_t t) {
+            for (auto const key : keys) {
+                timeOp(map, logs[t], [&] { map.insert({key, key}); });
+            }
+        });
+        return map.resize_stats();
+    });
+}
+
+// Test_StragglerInsertOnOldKvs: a small map that's full at its maximum load
+// ratio, so the inserts of threads still on the old kvs race the copy.
+void stressStragglerInsert(size_t repeats, size_t nThreads) {
+    benchStress("straggler insert", repeats, nThreads, [&](auto& logs) {
+        ConcurrentUnorderedMap<int, int> map(5, 1.0);
+        auto const keys = shuffledKeys(map.bucket_count() + 10);
+        runThreads(nThreads, [&](size_t t) {
+            for (auto const key : keys) {
+                timeOp(map, logs[t], [&] { map.insert({key, key}); });
+            }
+        });
+        return map.resize_stats();
+    });
+}
+
+// Test_EraseDuringResize: fills a map to just below its resize threshold,
+// then one more insert resizes it while the threads erase every key.
+void stressEraseDuringResize(size_t repeats, size_t nThreads) {
+    benchStress("resize then erase", repeats, nThreads, [&](auto& logs) {
+        ConcurrentUnorderedMap<int, int> map(9, 0.5);
+        size_t const n = 256;
+        runThreads(nThreads, [&](size_t t) {
+            for (size_t i = t; i < n; i += nThreads) {
+                int const key = i + 1;
+                timeOp(map, logs[t], [&] { map.insert({key, key}); });
+            }
+        });
+        runThreads(nThreads, [&](size_t t) {
+            if (t == 0) {
+                timeOp(map, logs[t], [&] { map.insert({0, 0}); });
+            }
+            for (size_t i = t; i < n; i += nThreads) {
+                int const key = i + 1;
+                timeOp(map, logs[t], [&] { map.erase(key); });
+            }
+        });
+        return map.resize_stats();
+    });
+}
+
+int stressMain(int argc, char** argv) {
+    size_t repeats = 1000;
+    size_t nThreads = 25;
+    if (argc > 2) repeats = std::strtoul(argv[2], nullptr, 10);
+    if (argc > 3) nThreads = std::strtoul(argv[3], nullptr, 10);
+    if (repeats == 0) repeats = 1;
+    if (nThreads == 0) nThreads = 1;
+
+    std::printf("stress repeats: %zu threads: %zu\n", repeats, nThreads);
+    stressDoubleResize(repeats, nThreads);
+    stressStragglerInsert(repeats, nThreads);
+    stressEraseDuringResize(repeats, nThreads);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string_view(argv[1]) == "stress") {
+        return stressMain(argc, argv);
+    }
+    if (argc > 1) THREADS = std::strtoul(argv[1], nullptr, 10);
+    if (argc > 2) KEYS = std::strtoul(argv[2], nullptr, 10);
+    if (THREADS == 0) THREADS = 1;
+
+    std::printf("threads: %zu keys: %zu numa nodes: %d\n", THREADS, KEYS,
+                numaNodeCount());
+
+    auto const nodes = cpusPerNode();
+    for (size_t node = 0; node < nodes.size(); node++) {
+        benchNumaPlacement(NumaPolicy::DEFAULT, "DEFAULT", node, nodes[node]);
+        benchNumaPlacement(NumaPolicy::INTERLEAVE, "INTERLEAVE", node,
+                           nodes[node]);
+    }
+    benchFrozenLookup();
+    benchWriter<MultiWriter>("MultiWriter");
+    benchWriter<SingleWriter>("SingleWriter");
+    benchHotKeyUpdates(BackoffStrategy::NONE, "NONE");
+    benchHotKeyUpdates(BackoffStrategy::PAUSE, "PAUSE");
+    benchHotKeyUpdates(BackoffStrategy::EXPONENTIAL, "EXPONENTIAL");
+    benchHotKeyUpdates(BackoffStrategy::YIELD, "YIELD");
+    benchHotKeyAdds(COMBINE_HOT_CAS_FAILURES, "combined");
+    benchHotKeyAdds(SIZE_MAX, "not combined");
+    benchMissFilter(false, "unfiltered");
+    benchMissFilter(true, "filtered");
+    benchAtomicBatch();
+    benchExport();
+    benchStringKeys<std::string>("std::string");
+    benchStringKeys<InlineString<23>>("InlineString<23>");
+    benchEraseIf();
+    benchClear();
+    benchGrowth(2, 0.5);
+    benchGrowth(1.5, 0.5);
+    benchGrowth(1.5, 0.75);
+    benchHandle();
+    benchSharedMap();
+    benchMultiMap();
+    benchCuckoo();
+    benchOverwrites<std::array<float, 2>>("8 byte record (heap)");
+    benchOverwrites<std::array<float, 16>>("64 byte record (inline)");
+#ifdef CMAP_ENABLE_COROUTINES
+    benchAsyncFind(8);
+    benchAsyncFind(32);
+#endif
+    return 0;
+}
+
+// The new and delete everything else goes through: the library's array and
+// nothrow forms call these, and the sized deletes are replaced as well.
+void* operator new(std::size_t size) {
+    return countedNew(size, alignof(std::max_align_t));
+}
+void* operator new(std::size_t size, std::align_val_t align) {
+    return countedNew(size, static_cast<std::size_t>(align));
+}
+void operator delete(void* ptr) noexcept {
+    countedDelete(ptr, alignof(std::max_align_t));
+}
+void operator delete(void* ptr, std::align_val_t align) noexcept {
+    countedDelete(ptr, static_cast<std::size_t>(align));
+}
+void operator delete(void* ptr, std::size_t) noexcept {
+    countedDelete(ptr, alignof(std::max_align_t));
+}
+void operator delete(void* ptr, std::size_t, std::align_val_t align) noexcept {
+    countedDelete(ptr, static_cast<std::size_t>(align));
+}
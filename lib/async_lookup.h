@@ -0,0 +1,212 @@
+#ifdef CMAP_ENABLE_COROUTINES
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+#endif
+
+#ifndef ASYNC_LOOKUP_H
+#define ASYNC_LOOKUP_H
+
+// Coroutine lookups that hide cache misses by interleaving: a lookup asks
+// the cpu to prefetch the memory it's about to touch and suspends, and
+// the other lookups run while the load is in flight.
+// Needs C++20, so it's only built with the CMake option
+// CMAP_ENABLE_COROUTINES.
+//
+//     LookupTask find(ConcurrentUnorderedMap<int, int> const& map, int key,
+//                     std::optional<int>& result) {
+//         result = co_await map.async_find(key);
+//     }
+//
+//     LookupScheduler scheduler;
+//     for (...) scheduler.spawn(find(map, key, results[i]));
+//     scheduler.run();
+#ifdef CMAP_ENABLE_COROUTINES
+
+namespace cmap {
+
+class LookupScheduler;
+
+// Lookup coroutines are short lived and allocate their frame every time,
+// which would cost about as much as the cache miss they hide. So frames
+// are recycled through per thread free lists, one per 64 byte size class.
+class FrameCache {
+   public:
+    static void* allocate(std::size_t size) {
+        auto const sizeClass = (size + 63) / 64;
+        if (sizeClass >= NUM_SIZE_CLASSES) return ::operator new(size);
+        auto& freeList = instance().mFree[sizeClass];
+        if (freeList.empty()) return ::operator new(sizeClass * 64);
+        void* frame = freeList.back();
+        freeList.pop_back();
+        return frame;
+    }
+
+    static void deallocate(void* frame, std::size_t size) {
+        auto const sizeClass = (size + 63) / 64;
+        if (sizeClass >= NUM_SIZE_CLASSES) return ::operator delete(frame);
+        instance().mFree[sizeClass].push_back(frame);
+    }
+
+   private:
+    static std::size_t const NUM_SIZE_CLASSES = 16;
+
+    ~FrameCache() {
+        for (auto& freeList : mFree) {
+            for (void* frame : freeList) ::operator delete(frame);
+        }
+    }
+
+    static FrameCache& instance() {
+        thread_local FrameCache cache;
+        return cache;
+    }
+
+    std::vector<void*> mFree[NUM_SIZE_CLASSES];
+};
+
+// Coroutine type for functions that co_await async_find. A task does
+// nothing until it's handed to a LookupScheduler.
+class LookupTask {
+   public:
+    struct promise_type {
+        LookupTask get_return_object() {
+            return LookupTask(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { mException = std::current_exception(); }
+
+        static void* operator new(std::size_t size) {
+            return FrameCache::allocate(size);
+        }
+        static void operator delete(void* frame, std::size_t size) {
+            FrameCache::deallocate(frame, size);
+        }
+
+        LookupScheduler* mScheduler = nullptr;
+        std::exception_ptr mException;
+    };
+
+    LookupTask(LookupTask&& other)
+        : mHandle(std::exchange(other.mHandle, nullptr)) {}
+    LookupTask(LookupTask const&) = delete;
+    LookupTask& operator=(LookupTask const&) = delete;
+    ~LookupTask() {
+        if (mHandle) mHandle.destroy();
+    }
+
+    // Gives up ownership of the coroutine.
+    std::coroutine_handle<promise_type> release() {
+        return std::exchange(mHandle, nullptr);
+    }
+
+   private:
+    explicit LookupTask(std::coroutine_handle<promise_type> handle)
+        : mHandle(handle) {}
+
+    std::coroutine_handle<promise_type> mHandle;
+};
+
+// A lookup suspended while its memory is prefetched.
+class PendingLookup {
+   public:
+    virtual ~PendingLookup() = default;
+    // Issues the next prefetch. Returns false once everything the lookup
+    // needs has been asked for, and the lookup can go ahead.
+    virtual bool prefetchNext() = 0;
+};
+
+// Runs LookupTasks on the calling thread, round robin: every time a lookup
+// suspends the next task in line gets to run. A scheduler isn't thread
+// safe, use one per thread.
+class LookupScheduler {
+   public:
+    typedef std::coroutine_handle<LookupTask::promise_type> Handle;
+
+    ~LookupScheduler() {
+        for (auto const& ready : mReady) ready.handle.destroy();
+    }
+
+    void spawn(LookupTask task) {
+        auto const handle = task.release();
+        handle.promise().mScheduler = this;
+        mReady.push_back({handle, nullptr});
+    }
+
+    void schedule(Handle handle, PendingLookup* lookup) {
+        mReady.push_back({handle, lookup});
+    }
+
+    // Runs every spawned task to completion, then rethrows the first
+    // exception a task threw, if any.
+    void run() {
+        std::exception_ptr exception;
+        while (!mReady.empty()) {
+            auto const ready = mReady.front();
+            mReady.pop_front();
+            if (ready.lookup != nullptr && ready.lookup->prefetchNext()) {
+                mReady.push_back(ready);
+                continue;
+            }
+            ready.handle.resume();
+            if (ready.handle.done()) {
+                if (!exception) exception = ready.handle.promise().mException;
+                ready.handle.destroy();
+            }
+        }
+        if (exception) std::rethrow_exception(exception);
+    }
+
+   private:
+    struct Ready {
+        Handle handle;
+        PendingLookup* lookup;
+    };
+
+    std::deque<Ready> mReady;
+};
+
+// What ConcurrentUnorderedMap::async_find returns. Before suspending it
+// prefetches the slot the key hashes to, and the next time round the key
+// and value that slot points at. The value is std::nullopt if the key isn't
+// in the map.
+template <typename Map>
+class AsyncFind : public PendingLookup {
+   public:
+    AsyncFind(Map const& map, typename Map::Lookup key)
+        : mMap(map), mKey(std::move(key)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<LookupTask::promise_type> handle) {
+        mMap.prefetchSlot(mKey);
+        handle.promise().mScheduler->schedule(handle, this);
+    }
+
+    std::optional<typename Map::mapped_type> await_resume() const {
+        return mMap.find(mKey);
+    }
+
+    bool prefetchNext() override {
+        if (mDataPrefetched) return false;
+        mMap.prefetchData(mKey);
+        mDataPrefetched = true;
+        return true;
+    }
+
+   private:
+    Map const& mMap;
+    typename Map::Lookup const mKey;
+    bool mDataPrefetched = false;
+};
+}  // namespace cmap
+
+#endif  // CMAP_ENABLE_COROUTINES
+#endif  // ASYNC_LOOKUP_H
@@ -0,0 +1,73 @@
+#include "consts.h"
+#include <cstddef>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+// What a thread does after losing a CAS race (or finding a slot half
+// written) before it tries again.
+enum class BackoffStrategy {
+    NONE,         // Retry straight away.
+    PAUSE,        // One pause instruction per retry.
+    EXPONENTIAL,  // 1, 2, 4, ... pauses per retry, then yield.
+    YIELD,        // Give up the cpu on every retry.
+};
+
+BackoffStrategy const DEFAULT_BACKOFF_STRATEGY = BackoffStrategy::EXPONENTIAL;
+
+// Tells the cpu we're spinning: on x86 this stops the spin loop flooding
+// the memory pipeline and frees execution resources for the sibling
+// hyperthread, which may well be the thread we're waiting on.
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Backoff state for one retry loop. Create it on the stack before the loop
+// and call pause() every time an attempt fails.
+class Backoff {
+   public:
+    explicit Backoff(BackoffStrategy strategy) : mStrategy(strategy) {}
+
+    void pause() {
+        mAttempts++;
+        switch (mStrategy) {
+            case BackoffStrategy::NONE:
+                return;
+            case BackoffStrategy::PAUSE:
+                cpuRelax();
+                return;
+            case BackoffStrategy::YIELD:
+                std::this_thread::yield();
+                return;
+            case BackoffStrategy::EXPONENTIAL:
+                // Past the limit we're likely waiting on a thread that's
+                // been descheduled, so spinning any longer is pointless.
+                if (mPauses > BACKOFF_MAX_PAUSES) {
+                    std::this_thread::yield();
+                    return;
+                }
+                for (std::size_t i = 0; i < mPauses; i++) cpuRelax();
+                mPauses *= 2;
+                return;
+        }
+    }
+
+    // How many times pause() has been called.
+    std::size_t attempts() const { return mAttempts; }
+
+   private:
+    BackoffStrategy const mStrategy;
+    std::size_t mAttempts = 0;
+    std::size_t mPauses = 1;
+};
+
+#endif  // BACKOFF_H
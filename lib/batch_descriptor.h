@@ -0,0 +1,146 @@
+#include "data_wrapper.h"
+#include "epoch.h"
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#ifndef BATCH_DESCRIPTOR_H
+#define BATCH_DESCRIPTOR_H
+
+// A multi-word CAS over the value words of heap stored slots, for
+// KeyValueStore::applyBatch, after Harris, Fraser and Pratt's MCAS.
+//
+// The batch first installs a marker, a DataWrapper in state BATCH pointing
+// back at the descriptor, in each of its words, in address order, as long
+// as the word still holds the value it expects. Once every word is marked
+// the batch has succeeded; if a word holds anything else it has failed.
+// Either way the words are then set to the new values, or back to the old
+// ones. A thread that loads a marker (SlotValue::value does) doesn't wait
+// for the batch's owner: it runs the same steps itself, so a batch whose
+// thread stalls is finished by whoever needs its words, and no thread ever
+// blocks on another. Markers of another batch met while installing are
+// helped out of the way the same way; the address order keeps that from
+// going round in circles.
+//
+// Everything here is only touched inside an EpochGuard. The descriptor,
+// its marker and the wrappers that lost are retired by whichever of the
+// owner and the helpers finishes last.
+template <typename V>
+class BatchDescriptor {
+   public:
+    typedef std::atomic<DataWrapper<V> const*> Word;
+
+    BatchDescriptor() = default;
+    BatchDescriptor(BatchDescriptor const&) = delete;
+    BatchDescriptor& operator=(BatchDescriptor const&) = delete;
+
+    ~BatchDescriptor() {
+        bool const succeeded = mStatus.load() == SUCCEEDED;
+        for (auto const& entry : mEntries) {
+            delete (succeeded ? entry.expected : entry.desired);
+        }
+    }
+
+    // Words have to be added in ascending address order. desired is owned
+    // by the batch from here on.
+    void add(Word* word, DataWrapper<V> const* expected,
+             DataWrapper<V> const* desired) {
+        mEntries.push_back({word, expected, desired});
+    }
+
+    // Runs the batch, which mustn't be touched afterwards, and returns
+    // whether it succeeded.
+    bool run() {
+        help();
+        bool const succeeded = mStatus.load() == SUCCEEDED;
+        release();
+        return succeeded;
+    }
+
+    // Finishes the batch whose marker a word was found holding.
+    static void helpMarker(DataWrapper<V> const* marker) {
+        auto* batch = static_cast<Marker const*>(marker)->batch;
+        // Once nobody holds the batch any more its words are all set, the
+        // word only needs loading again.
+        if (!batch->acquire()) return;
+        batch->help();
+        batch->release();
+    }
+
+   private:
+    enum Status { UNDECIDED, SUCCEEDED, FAILED };
+
+    class Marker : public DataWrapper<V> {
+       public:
+        explicit Marker(BatchDescriptor* batch)
+            : DataWrapper<V>(V(), BATCH), batch(batch) {}
+
+        BatchDescriptor* const batch;
+    };
+
+    struct Entry {
+        Word* word;
+        DataWrapper<V> const* expected;
+        DataWrapper<V> const* desired;
+    };
+
+    void help() {
+        if (mStatus.load() == UNDECIDED) {
+            auto const outcome = install() ? SUCCEEDED : FAILED;
+            int undecided = UNDECIDED;
+            mStatus.compare_exchange_strong(undecided, outcome);
+        }
+        // A helper that marked a word after the outcome was decided puts it
+        // right here too, it still holds the batch so nothing's retired yet.
+        bool const succeeded = mStatus.load() == SUCCEEDED;
+        for (auto const& entry : mEntries) {
+            DataWrapper<V> const* marker = &mMarker;
+            entry.word->compare_exchange_strong(
+                marker, succeeded ? entry.desired : entry.expected);
+        }
+    }
+
+    // Marks every word, unless one of them has changed or another thread
+    // decides the outcome first.
+    bool install() {
+        for (auto const& entry : mEntries) {
+            while (true) {
+                if (mStatus.load() != UNDECIDED) return false;
+                auto const* current = entry.word->load();
+                if (current == &mMarker) break;
+                if (current->state() == BATCH) {
+                    helpMarker(current);
+                    continue;
+                }
+                if (current != entry.expected) return false;
+                if (entry.word->compare_exchange_strong(current, &mMarker)) {
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    // The owner holds the batch from the start, helpers only while it's
+    // still held by someone.
+    bool acquire() {
+        auto holders = mHolders.load();
+        while (holders > 0) {
+            if (mHolders.compare_exchange_weak(holders, holders + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void release() {
+        if (mHolders.fetch_sub(1) == 1) retireLater(this);
+    }
+
+    std::atomic<int> mStatus{UNDECIDED};
+    std::atomic<int> mHolders{1};
+    Marker const mMarker{this};
+    std::vector<Entry> mEntries;
+};
+
+#endif  // BATCH_DESCRIPTOR_H
@@ -0,0 +1,82 @@
+#include "consts.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+// Concurrent blocked Bloom filter over already mixed 64 bit hashes. A key
+// sets one bit in each of the 8 words of a single cache line block, so
+// answering a lookup touches one cache line whatever the outcome. Bits are
+// only ever set, any number of threads can add and query at the same time.
+// A filter built with no bits is disabled: it answers "maybe" to
+// everything and add() does nothing.
+class BlockedBloomFilter {
+   public:
+    explicit BlockedBloomFilter(std::size_t bits)
+        : mBlocks(bits == 0 ? 0 : (bits + BLOCK_BITS - 1) / BLOCK_BITS) {}
+
+    bool enabled() const { return !mBlocks.empty(); }
+
+    void add(std::uint64_t hash) {
+        if (!enabled()) return;
+        auto& block = blockOf(hash);
+        for (std::size_t i = 0; i < WORDS; i++) {
+            auto const bit = bitOf(hash, i);
+            // Most adds are for keys whose bits are already set, e.g.
+            // updates, and a load doesn't take the cache line exclusive.
+            if ((block.words[i].load(std::memory_order_relaxed) & bit) == 0) {
+                block.words[i].fetch_or(bit);
+            }
+        }
+    }
+
+    // False only if hash was never added.
+    bool mayContain(std::uint64_t hash) const {
+        if (!enabled()) return true;
+        auto const& block = blockOf(hash);
+        for (std::size_t i = 0; i < WORDS; i++) {
+            auto const bit = bitOf(hash, i);
+            if ((block.words[i].load(std::memory_order_acquire) & bit) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::size_t bytes() const { return mBlocks.size() * sizeof(Block); }
+
+   private:
+    static std::size_t const WORDS = BLOOM_BLOCK_BYTES / sizeof(std::uint64_t);
+    static std::size_t const BLOCK_BITS = BLOOM_BLOCK_BYTES * 8;
+
+    struct alignas(BLOOM_BLOCK_BYTES) Block {
+        std::atomic<std::uint64_t> words[WORDS]{};
+    };
+
+    // The high half of the hash picks the block, multiply-shift like the
+    // slot index, the low half the bits within it.
+    Block const& blockOf(std::uint64_t hash) const {
+        return mBlocks[(hash >> 32) * mBlocks.size() >> 32];
+    }
+    Block& blockOf(std::uint64_t hash) {
+        return mBlocks[(hash >> 32) * mBlocks.size() >> 32];
+    }
+
+    // One bit per word, from the low half of the hash multiplied by a
+    // different odd constant for each word (the salts of Parquet's split
+    // block Bloom filter).
+    static std::uint64_t bitOf(std::uint64_t hash, std::size_t word) {
+        static std::uint32_t const SALTS[] = {
+            0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+            0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+        std::uint32_t const salted = std::uint32_t(hash) * SALTS[word];
+        return std::uint64_t(1) << (salted >> 26);
+    }
+
+    std::vector<Block> mBlocks;
+};
+
+#endif  // BLOOM_FILTER_H
@@ -0,0 +1,49 @@
+#include <atomic>
+
+#ifndef CONCURRENCY_POLICY_H
+#define CONCURRENCY_POLICY_H
+
+// Policies for how the writers of a map synchronise with each other, picked
+// with the last template argument of ConcurrentUnorderedMap.
+// Readers are unaffected by the policy, they are always lock free.
+
+// Any number of threads may insert and erase at the same time, so every
+// update of shared state is a CAS.
+struct MultiWriter {
+    static constexpr bool singleWriter = false;
+};
+
+// At most one thread modifies the map at any time (any number may read).
+// With no other writer to race, all the CAS loops collapse into release
+// stores.
+struct SingleWriter {
+    static constexpr bool singleWriter = true;
+};
+
+// CAS for MultiWriter. For SingleWriter expected is always the current value
+// (only the writer ever changes it), so a release store does the same job.
+template <typename Policy, typename T>
+bool casOrStore(std::atomic<T>& atomic,
+                typename std::atomic<T>::value_type expected,
+                typename std::atomic<T>::value_type desired) {
+    if constexpr (Policy::singleWriter) {
+        atomic.store(desired, std::memory_order_release);
+        return true;
+    } else {
+        return atomic.compare_exchange_strong(expected, desired);
+    }
+}
+
+// fetch_add for MultiWriter, a plain load and store for SingleWriter.
+template <typename Policy, typename T>
+void addOrStore(std::atomic<T>& atomic,
+                typename std::atomic<T>::value_type delta) {
+    if constexpr (Policy::singleWriter) {
+        atomic.store(atomic.load(std::memory_order_relaxed) + delta,
+                     std::memory_order_release);
+    } else {
+        atomic.fetch_add(delta);
+    }
+}
+
+#endif  // CONCURRENCY_POLICY_H
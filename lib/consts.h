@@ -3,8 +3,48 @@
 #ifndef CONSTS_H
 #define CONSTS_H
 
+#include <cstdint>
+
 float const DEFAULT_MAX_LOAD_RATIO = 0.5;
+// How much bigger each kvs is than the one it replaces.
+float const DEFAULT_GROWTH_FACTOR = 2;
+// Fibonacci hashing multiplier (2^64 / golden ratio). std::hash is the
+// identity for integers, so the hash is multiplied by this to spread its
+// bits into the high ones that pick the slot.
+std::uint64_t const HASH_MIX_MULTIPLIER = 0x9E3779B97F4A7C15;
 std::size_t const COPY_CHUNK_SIZE = 8;
+// Slot arrays smaller than this aren't worth spreading over NUMA nodes.
+std::size_t const NUMA_INTERLEAVE_MIN_BYTES = 2 * 1024 * 1024;
+// Exponential backoff stops doubling and starts yielding past this many
+// pauses.
+std::size_t const BACKOFF_MAX_PAUSES = 64;
+// How many times a reader or copier backs off waiting for the value of a
+// slot whose key is already set, before giving up on the inserter.
+std::size_t const EMPTY_VALUE_MAX_WAITS = 16;
+// Slots a thread claims at a time when erase_if sweeps a kvs.
+std::size_t const SWEEP_CHUNK_SIZE = 16 * 1024;
+// CuckooUnorderedMap sizes its buckets to fill one cache line.
+std::size_t const CUCKOO_BUCKET_BYTES = 64;
+// How many buckets the search for a cuckoo path may visit before the
+// table counts as full and is grown.
+std::size_t const CUCKOO_MAX_BFS_NODES = 1024;
+// Upper bound on the version counters (lock stripes) of a cuckoo table.
+std::size_t const CUCKOO_MAX_STRIPES = 4096;
+// An add() that loses this many CASes switches its key to combining, see
+// ConcurrentUnorderedMap::add.
+std::size_t const COMBINE_HOT_CAS_FAILURES = 4;
+// Delta cells per combined key, threads take them round robin.
+std::size_t const COMBINE_DELTA_CELLS = 16;
+// How many keys a map can combine at most.
+std::size_t const COMBINE_HOT_KEY_SLOTS = 64;
+// A miss filter block is one cache line.
+std::size_t const BLOOM_BLOCK_BYTES = 64;
+// Miss filter bits per slot of a kvs, so twice that per key at the default
+// load ratio.
+std::size_t const BLOOM_BITS_PER_SLOT = 8;
+// A thread tries to free the memory it retired (see epoch.h) every this
+// many retires.
+std::size_t const EPOCH_RETIRE_BATCH = 64;
 
 
 #endif //CONSTS_H
@@ -0,0 +1,419 @@
+#include "cuckoo_map.h"
+#include <stdexcept>
+
+namespace cmap {
+
+typedef std::size_t size_t;
+
+namespace {
+
+// Odd multiplier for the offset between a key's two buckets. Deriving the
+// other bucket from the tag alone means an entry can be moved without
+// hashing its key again.
+std::uint64_t const ALT_BUCKET_MULTIPLIER = 0xc6a4a7935bd1e995;
+
+size_t roundUpToPowerOf2(size_t n) {
+    size_t result = 1;
+    while (result < n) result *= 2;
+    return result;
+}
+}  // namespace
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+CuckooUnorderedMap<K, V, Hash, KeyEqual>::Table::Table(size_t nBuckets)
+    : mask(nBuckets - 1),
+      buckets(nBuckets),
+      stripeMask(std::min(nBuckets, CUCKOO_MAX_STRIPES) - 1),
+      versions(std::make_unique<std::atomic<std::uint64_t>[]>(stripeMask +
+                                                                 1)) {}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+CuckooUnorderedMap<K, V, Hash, KeyEqual>::CuckooUnorderedMap(
+    size_t capacity, BackoffStrategy backoff)
+    : mTable(new Table(roundUpToPowerOf2(std::max<size_t>(
+          2, (capacity + SLOTS_PER_BUCKET - 1) / SLOTS_PER_BUCKET)))),
+      mBackoff(backoff) {}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+CuckooUnorderedMap<K, V, Hash, KeyEqual>::~CuckooUnorderedMap() {
+    delete mTable.load();
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+typename CuckooUnorderedMap<K, V, Hash, KeyEqual>::Position
+CuckooUnorderedMap<K, V, Hash, KeyEqual>::position(Table const& table,
+                                                   K const& key) const {
+    std::uint64_t const mixed =
+        static_cast<std::uint64_t>(mHash(key)) * HASH_MIX_MULTIPLIER;
+    // The top byte is the tag, 0 is taken by free slots.
+    auto tag = static_cast<std::uint8_t>(mixed >> 56);
+    if (tag == 0) tag = 1;
+    size_t const bucket = (mixed >> 8) & table.mask;
+    return {bucket, altBucket(table, bucket, tag), tag};
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t CuckooUnorderedMap<K, V, Hash, KeyEqual>::altBucket(
+    Table const& table, size_t bucket, std::uint8_t tag) {
+    // An xor, so the alternative of the alternative is the bucket again.
+    return (bucket ^ (tag * ALT_BUCKET_MULTIPLIER)) & table.mask;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void CuckooUnorderedMap<K, V, Hash, KeyEqual>::lock(Table& table,
+                                                    size_t bucket1,
+                                                    size_t bucket2) const {
+    size_t stripe1 = bucket1 & table.stripeMask;
+    size_t stripe2 = bucket2 & table.stripeMask;
+    // Always in the same order, so two writers can't deadlock.
+    if (stripe1 > stripe2) std::swap(stripe1, stripe2);
+    for (size_t stripe = stripe1;; stripe = stripe2) {
+        auto& version = table.versions[stripe];
+        Backoff backoff(mBackoff);
+        while (true) {
+            auto current = version.load(std::memory_order_relaxed);
+            if (current % 2 == 0 &&
+                version.compare_exchange_weak(current, current + 1,
+                                              std::memory_order_acquire)) {
+                break;
+            }
+            backoff.pause();
+        }
+        if (stripe == stripe2) break;
+    }
+    // Readers that see the writes below must see the odd version too.
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void CuckooUnorderedMap<K, V, Hash, KeyEqual>::unlock(Table& table,
+                                                      size_t bucket1,
+                                                      size_t bucket2) const {
+    size_t const stripe1 = bucket1 & table.stripeMask;
+    size_t const stripe2 = bucket2 & table.stripeMask;
+    table.versions[stripe1].fetch_add(1, std::memory_order_release);
+    if (stripe2 != stripe1) {
+        table.versions[stripe2].fetch_add(1, std::memory_order_release);
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t CuckooUnorderedMap<K, V, Hash, KeyEqual>::findSlot(
+    Bucket const& bucket, K const& key, std::uint8_t tag) const {
+    for (size_t i = 0; i < SLOTS_PER_BUCKET; i++) {
+        if (bucket.tags[i] == tag && mKeyEqual(bucket.keys[i], key)) return i;
+    }
+    return SLOTS_PER_BUCKET;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t CuckooUnorderedMap<K, V, Hash, KeyEqual>::freeSlot(
+    Bucket const& bucket) {
+    for (size_t i = 0; i < SLOTS_PER_BUCKET; i++) {
+        if (bucket.tags[i] == 0) return i;
+    }
+    return SLOTS_PER_BUCKET;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool CuckooUnorderedMap<K, V, Hash, KeyEqual>::read(K const& key,
+                                                    V& value) const {
+    EpochGuard guard;
+    Backoff backoff(mBackoff);
+    while (true) {
+        auto const epoch = mEpoch.load(std::memory_order_acquire);
+        if (epoch % 2 == 1) {
+            backoff.pause();
+            continue;
+        }
+        auto const& table = *mTable.load(std::memory_order_acquire);
+        auto const pos = position(table, key);
+        auto const& version1 = table.versions[pos.bucket1 & table.stripeMask];
+        auto const& version2 = table.versions[pos.bucket2 & table.stripeMask];
+        auto const before1 = version1.load(std::memory_order_acquire);
+        auto const before2 = version2.load(std::memory_order_acquire);
+        if (before1 % 2 == 1 || before2 % 2 == 1) {
+            backoff.pause();
+            continue;
+        }
+
+        bool found = false;
+        for (size_t bucket : {pos.bucket1, pos.bucket2}) {
+            auto const& b = table.buckets[bucket];
+            auto const slot = findSlot(b, key, pos.tag);
+            if (slot < SLOTS_PER_BUCKET) {
+                value = b.values[slot];
+                found = true;
+                break;
+            }
+        }
+
+        // The reads above may have raced with a writer, they only count if
+        // nobody locked either stripe or replaced the table meanwhile.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version1.load(std::memory_order_relaxed) == before1 &&
+            version2.load(std::memory_order_relaxed) == before2 &&
+            mEpoch.load(std::memory_order_relaxed) == epoch) {
+            return found;
+        }
+        backoff.pause();
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+V CuckooUnorderedMap<K, V, Hash, KeyEqual>::insert(
+    std::pair<K, V> const& val) {
+    auto const& [key, value] = val;
+    EpochGuard guard;
+    while (true) {
+        auto* table = mTable.load(std::memory_order_acquire);
+        auto const pos = position(*table, key);
+        lock(*table, pos.bucket1, pos.bucket2);
+        if (mTable.load(std::memory_order_acquire) != table) {
+            // Grown while we waited for the lock.
+            unlock(*table, pos.bucket1, pos.bucket2);
+            continue;
+        }
+
+        for (size_t bucket : {pos.bucket1, pos.bucket2}) {
+            auto& b = table->buckets[bucket];
+            auto const slot = findSlot(b, key, pos.tag);
+            if (slot < SLOTS_PER_BUCKET) {
+                b.values[slot] = value;
+                unlock(*table, pos.bucket1, pos.bucket2);
+                return value;
+            }
+        }
+        for (size_t bucket : {pos.bucket1, pos.bucket2}) {
+            auto& b = table->buckets[bucket];
+            auto const slot = freeSlot(b);
+            if (slot < SLOTS_PER_BUCKET) {
+                b.keys[slot] = key;
+                b.values[slot] = value;
+                b.tags[slot] = pos.tag;
+                mSize.fetch_add(1, std::memory_order_relaxed);
+                unlock(*table, pos.bucket1, pos.bucket2);
+                return value;
+            }
+        }
+        unlock(*table, pos.bucket1, pos.bucket2);
+
+        if (!makeRoom(*table, pos.bucket1, pos.bucket2, true)) grow(table);
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool CuckooUnorderedMap<K, V, Hash, KeyEqual>::makeRoom(Table& table,
+                                                        size_t bucket1,
+                                                        size_t bucket2,
+                                                        bool shared) {
+    // Breadth first search from both buckets for one with a free slot. Every
+    // step goes from a bucket to the other bucket of one of its entries.
+    // The search reads buckets without locking them, so the path it finds
+    // is checked again step by step while it's moved along.
+    struct Node {
+        size_t bucket;
+        // Index of the node we came from, and the slot in its bucket whose
+        // entry would move here.
+        size_t parent;
+        size_t slot;
+    };
+    std::vector<Node> nodes;
+    nodes.reserve(CUCKOO_MAX_BFS_NODES);
+    nodes.push_back({bucket1, 0, 0});
+    if (bucket2 != bucket1) nodes.push_back({bucket2, 1, 0});
+    size_t const roots = nodes.size();
+
+    size_t found = 0;
+    bool hasPath = false;
+    for (size_t i = 0; i < nodes.size() && !hasPath; i++) {
+        auto const& b = table.buckets[nodes[i].bucket];
+        if (freeSlot(b) < SLOTS_PER_BUCKET) {
+            found = i;
+            hasPath = true;
+            break;
+        }
+        for (size_t slot = 0; slot < SLOTS_PER_BUCKET &&
+                              nodes.size() < CUCKOO_MAX_BFS_NODES;
+             slot++) {
+            nodes.push_back(
+                {altBucket(table, nodes[i].bucket, b.tags[slot]), i, slot});
+        }
+    }
+    if (!hasPath) return false;
+
+    // Move entries along the path from its free end backwards, so every
+    // step frees the slot the step before it needs.
+    for (size_t i = found; i >= roots; i = nodes[i].parent) {
+        auto const& node = nodes[i];
+        auto const from = nodes[node.parent].bucket;
+        lock(table, from, node.bucket);
+        auto& src = table.buckets[from];
+        auto& dst = table.buckets[node.bucket];
+        auto const free = freeSlot(dst);
+        auto const tag = src.tags[node.slot];
+        bool const valid =
+            (!shared || mTable.load(std::memory_order_acquire) == &table) &&
+            free < SLOTS_PER_BUCKET && tag != 0 &&
+            altBucket(table, from, tag) == node.bucket;
+        if (valid) {
+            dst.keys[free] = src.keys[node.slot];
+            dst.values[free] = src.values[node.slot];
+            dst.tags[free] = tag;
+            src.tags[node.slot] = 0;
+        }
+        unlock(table, from, node.bucket);
+        // Somebody changed the path under us. Let the caller look again,
+        // the table isn't necessarily full.
+        if (!valid) return true;
+    }
+    return true;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool CuckooUnorderedMap<K, V, Hash, KeyEqual>::insertUnshared(Table& table,
+                                                              K const& key,
+                                                              V const& value) {
+    auto const pos = position(table, key);
+    do {
+        for (size_t bucket : {pos.bucket1, pos.bucket2}) {
+            auto& b = table.buckets[bucket];
+            auto const slot = freeSlot(b);
+            if (slot < SLOTS_PER_BUCKET) {
+                b.keys[slot] = key;
+                b.values[slot] = value;
+                b.tags[slot] = pos.tag;
+                return true;
+            }
+        }
+    } while (makeRoom(table, pos.bucket1, pos.bucket2, false));
+    return false;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void CuckooUnorderedMap<K, V, Hash, KeyEqual>::grow(Table* table) {
+    Backoff backoff(mBackoff);
+    auto epoch = mEpoch.load();
+    while (true) {
+        if (mTable.load() != table) return;
+        if (epoch % 2 == 0 && mEpoch.compare_exchange_weak(epoch, epoch + 1)) {
+            break;
+        }
+        backoff.pause();
+        epoch = mEpoch.load();
+    }
+    if (mTable.load() != table) {
+        // Somebody else grew it between our check and the CAS.
+        mEpoch.store(epoch + 2);
+        return;
+    }
+
+    // Stop the writers, the table doesn't change from here on.
+    for (size_t stripe = 0; stripe <= table->stripeMask; stripe++) {
+        lock(*table, stripe, stripe);
+    }
+    size_t nBuckets = (table->mask + 1) * 2;
+    Table* grown = nullptr;
+    while (grown == nullptr) {
+        grown = new Table(nBuckets);
+        for (auto const& b : table->buckets) {
+            for (size_t i = 0; i < SLOTS_PER_BUCKET && grown != nullptr; i++) {
+                if (b.tags[i] != 0 &&
+                    !insertUnshared(*grown, b.keys[i], b.values[i])) {
+                    // Unlucky hashing, go bigger still.
+                    delete grown;
+                    grown = nullptr;
+                    nBuckets *= 2;
+                }
+            }
+            if (grown == nullptr) break;
+        }
+    }
+    mTable.store(grown, std::memory_order_release);
+    // Writers waiting on the old table's stripes see it was replaced once
+    // they get them and move on to the new one.
+    for (size_t stripe = 0; stripe <= table->stripeMask; stripe++) {
+        unlock(*table, stripe, stripe);
+    }
+    mEpoch.store(epoch + 2, std::memory_order_release);
+    retireLater(table);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+V CuckooUnorderedMap<K, V, Hash, KeyEqual>::at(K const& key) const {
+    V value;
+    if (!read(key, value)) throw std::out_of_range("Unable to find key");
+    return value;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool CuckooUnorderedMap<K, V, Hash, KeyEqual>::contains(K const& key) const {
+    V value;
+    return read(key, value);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void CuckooUnorderedMap<K, V, Hash, KeyEqual>::erase(K const& key) {
+    EpochGuard guard;
+    while (true) {
+        auto* table = mTable.load(std::memory_order_acquire);
+        auto const pos = position(*table, key);
+        lock(*table, pos.bucket1, pos.bucket2);
+        if (mTable.load(std::memory_order_acquire) != table) {
+            unlock(*table, pos.bucket1, pos.bucket2);
+            continue;
+        }
+        for (size_t bucket : {pos.bucket1, pos.bucket2}) {
+            auto& b = table->buckets[bucket];
+            auto const slot = findSlot(b, key, pos.tag);
+            if (slot < SLOTS_PER_BUCKET) {
+                b.tags[slot] = 0;
+                mSize.fetch_sub(1, std::memory_order_relaxed);
+                break;
+            }
+        }
+        unlock(*table, pos.bucket1, pos.bucket2);
+        return;
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t CuckooUnorderedMap<K, V, Hash, KeyEqual>::bucket_count() const {
+    EpochGuard guard;
+    return (mTable.load()->mask + 1) * SLOTS_PER_BUCKET;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t CuckooUnorderedMap<K, V, Hash, KeyEqual>::size() const {
+    return mSize.load();
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool CuckooUnorderedMap<K, V, Hash, KeyEqual>::empty() const {
+    return size() == 0;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t CuckooUnorderedMap<K, V, Hash, KeyEqual>::tableBytes() const {
+    EpochGuard guard;
+    auto const* table = mTable.load();
+    return table->buckets.size() * sizeof(Bucket) +
+           (table->stripeMask + 1) * sizeof(std::atomic<std::uint64_t>);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool CuckooUnorderedMap<K, V, Hash, KeyEqual>::operator==(
+    std::unordered_map<K, V> const& other) const {
+    if (size() != other.size()) return false;
+    for (auto const& [key, value] : other) {
+        V found;
+        if (!read(key, found) || !(found == value)) return false;
+    }
+    return true;
+}
+
+template class CuckooUnorderedMap<int, int>;
+template class CuckooUnorderedMap<int, float>;
+template class CuckooUnorderedMap<float, float>;
+template class CuckooUnorderedMap<float, int>;
+}  // namespace cmap
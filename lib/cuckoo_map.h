@@ -0,0 +1,150 @@
+#include "backoff.h"
+#include "consts.h"
+#include "epoch.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef CUCKOO_MAP_H
+#define CUCKOO_MAP_H
+
+namespace cmap {
+
+// Alternative to ConcurrentUnorderedMap for big tables of small keys and
+// values that runs at 90%+ load instead of 50%. It only offers the basic
+// operations: insert, at, contains, erase and size.
+// Bucketized cuckoo hashing: every key lives in one of two buckets, each a
+// cache line holding 4 to 8 entries and a one byte tag per entry. A lookup
+// reads at most those two cache lines, plus the version counters of their
+// lock stripes and the table's epoch, and only compares the keys whose tag
+// matches.
+// A full bucket makes room by moving entries along a cuckoo path to their
+// other bucket, found with a breadth first search.
+//
+// Readers never write: they're optimistic, checking the version counters
+// of the buckets' lock stripes before and after reading, and retry if a
+// writer got in between. Writers lock the stripes of the two buckets they
+// touch. Growing locks every stripe, so unlike ConcurrentUnorderedMap's
+// resize it stops all other operations until the table has been rehashed.
+//
+// Readers copy entries that may be changing under them, so K and V have to
+// be trivially copyable. A bucket never spans more than one cache line and
+// needs at least 4 entries to reach a 90% load, so an entry (tag, key and
+// value) can take up at most a quarter of one.
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>>
+class CuckooUnorderedMap {
+    static_assert(std::is_trivially_copyable_v<K> &&
+                      std::is_trivially_copyable_v<V>,
+                  "Optimistic readers can only copy trivially copyable types");
+
+   public:
+    typedef K key_type;
+    typedef V mapped_type;
+
+    // Entries per bucket: as many as fit in CUCKOO_BUCKET_BYTES with their
+    // tags, at most 8.
+    static constexpr std::size_t SLOTS_PER_BUCKET = std::min<std::size_t>(
+        CUCKOO_BUCKET_BYTES / (1 + sizeof(K) + sizeof(V)), 8);
+    static_assert(SLOTS_PER_BUCKET >= 4,
+                  "Entries too big for 4 to a cache line can't reach a 90% "
+                  "load");
+
+    // Starts with enough buckets for capacity entries at full load.
+    explicit CuckooUnorderedMap(std::size_t capacity = 64,
+                                BackoffStrategy backoff =
+                                    DEFAULT_BACKOFF_STRATEGY);
+    ~CuckooUnorderedMap();
+
+    CuckooUnorderedMap(CuckooUnorderedMap const&) = delete;
+    CuckooUnorderedMap& operator=(CuckooUnorderedMap const&) = delete;
+
+    V insert(std::pair<K, V> const& val);
+    V at(K const& key) const;
+    bool contains(K const& key) const;
+    void erase(K const& key);
+
+    // Number of entry slots.
+    std::size_t bucket_count() const;
+    std::size_t size() const;
+    bool empty() const;
+    // Bytes taken by the current table, buckets and version counters.
+    std::size_t tableBytes() const;
+
+    bool operator==(std::unordered_map<K, V> const& other) const;
+
+   private:
+    struct alignas(CUCKOO_BUCKET_BYTES) Bucket {
+        // 0 marks a free slot.
+        std::uint8_t tags[SLOTS_PER_BUCKET];
+        K keys[SLOTS_PER_BUCKET];
+        V values[SLOTS_PER_BUCKET];
+    };
+    static_assert(sizeof(Bucket) == CUCKOO_BUCKET_BYTES,
+                  "A lookup should read at most two cache lines");
+
+    struct Table {
+        explicit Table(std::size_t nBuckets);
+
+        std::size_t const mask;
+        std::vector<Bucket> buckets;
+        // One seqlock per stripe of buckets: odd while a writer holds it.
+        std::size_t const stripeMask;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> versions;
+    };
+
+    // Where a key goes: its two buckets and its tag.
+    struct Position {
+        std::size_t bucket1;
+        std::size_t bucket2;
+        std::uint8_t tag;
+    };
+
+    Position position(Table const& table, K const& key) const;
+    static std::size_t altBucket(Table const& table, std::size_t bucket,
+                                 std::uint8_t tag);
+
+    void lock(Table& table, std::size_t bucket1, std::size_t bucket2) const;
+    void unlock(Table& table, std::size_t bucket1, std::size_t bucket2) const;
+
+    // The slot of key in bucket, or SLOTS_PER_BUCKET if it's not there.
+    std::size_t findSlot(Bucket const& bucket, K const& key,
+                         std::uint8_t tag) const;
+    static std::size_t freeSlot(Bucket const& bucket);
+
+    // Looks key up without taking any locks. Returns whether it's there
+    // and if so copies its value into value.
+    bool read(K const& key, V& value) const;
+
+    // Tries to free a slot in bucket1 or bucket2 by moving entries along a
+    // cuckoo path. Returns false if there's no path, i.e. the table needs to
+    // grow. A shared table may have been replaced meanwhile, moves into it
+    // are checked against mTable.
+    bool makeRoom(Table& table, std::size_t bucket1, std::size_t bucket2,
+                  bool shared);
+    // Places an entry in a table nobody else can see yet. Returns false if
+    // it doesn't fit.
+    bool insertUnshared(Table& table, K const& key, V const& value);
+    void grow(Table* table);
+
+    // Operations run inside an EpochGuard, and a replaced table is retired
+    // (see epoch.h) as readers and writers may still be looking at it.
+    std::atomic<Table*> mTable;
+    // Odd while the table grows. Readers check it like a version counter,
+    // so they never trust a read of a table that was replaced meanwhile.
+    std::atomic<std::uint64_t> mEpoch{};
+    std::atomic<std::size_t> mSize{};
+    BackoffStrategy const mBackoff;
+    Hash mHash;
+    KeyEqual mKeyEqual;
+};
+}  // namespace cmap
+
+#endif  // CUCKOO_MAP_H
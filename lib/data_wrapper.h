@@ -7,7 +7,11 @@ enum DataState {
     ALIVE,         // The data is to be used.
     TOMB_STONE,    // The data has been removed.
     COPIED_DEAD,   // The data has been copied from the current location
+    COPIED_EMPTY,  // The copy passed the value while it was still EMPTY:
+                   // nothing was copied, its late write goes to the next kvs.
     COPIED_ALIVE,  // The copy has been copied into the current location.
+    BATCH,         // Only for heap values: the slot is part of a batch in
+                   // progress, see BatchDescriptor.
 };
 
 template <typename T>
@@ -20,14 +24,21 @@ public:
                  mState == COPIED_ALIVE);
     }
     bool fromPrevKvs() const { return mState == COPIED_ALIVE; }
-    bool dead() const { return mState == COPIED_DEAD || mState == TOMB_STONE; }
+    bool dead() const {
+        return mState == COPIED_DEAD || mState == COPIED_EMPTY ||
+               mState == TOMB_STONE;
+    }
+    // Moved on to the next kvs, with a value or without.
+    bool copied() const {
+        return mState == COPIED_DEAD || mState == COPIED_EMPTY;
+    }
     bool eval(T val) const {
         if (mState == ALIVE || mState == COPIED_ALIVE) return val == mData;
         return false;
     }
 
     // getters
-    T data() const { return mData; }
+    T const& data() const { return mData; }
     DataState state() const { return mState; }
 
 private:
@@ -0,0 +1,172 @@
+#include "epoch.h"
+#include "consts.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace {
+
+struct Retired {
+    void* ptr;
+    void (*deleter)(void*);
+    std::uint64_t epoch;
+};
+
+// A thread's announcement. Records are never freed, a thread that exits
+// gives its record up for the next thread to take.
+struct alignas(64) EpochRecord {
+    // While the thread is inside a guard, the epoch it entered at shifted
+    // left, with the low bit set. 0 outside.
+    std::atomic<std::uint64_t> announced{};
+    std::atomic<bool> inUse{true};
+    EpochRecord* next = nullptr;
+
+    // Only touched by the thread owning the record.
+    std::size_t nesting = 0;
+    std::vector<Retired> limbo;
+};
+
+struct EpochDomain {
+    std::atomic<std::uint64_t> epoch{1};
+    std::atomic<EpochRecord*> records{};
+    // What exited threads left behind.
+    std::mutex orphansLock;
+    std::vector<Retired> orphans;
+};
+
+// Never freed: threads can still be retiring memory while statics are
+// being destroyed.
+EpochDomain& domain() {
+    static auto* const instance = new EpochDomain;
+    return *instance;
+}
+
+EpochRecord* acquireRecord() {
+    auto& d = domain();
+    for (auto* r = d.records.load(std::memory_order_acquire); r != nullptr;
+         r = r->next) {
+        bool inUse = false;
+        if (!r->inUse.load(std::memory_order_relaxed) &&
+            r->inUse.compare_exchange_strong(inUse, true,
+                                             std::memory_order_acquire)) {
+            return r;
+        }
+    }
+    auto* record = new EpochRecord;
+    record->next = d.records.load(std::memory_order_relaxed);
+    while (!d.records.compare_exchange_weak(record->next, record,
+                                            std::memory_order_release)) {
+    }
+    return record;
+}
+
+class RecordOwner {
+   public:
+    RecordOwner() : record(acquireRecord()) {}
+
+    ~RecordOwner() {
+        auto& d = domain();
+        if (!record->limbo.empty()) {
+            std::lock_guard<std::mutex> lock(d.orphansLock);
+            d.orphans.insert(d.orphans.end(), record->limbo.begin(),
+                             record->limbo.end());
+        }
+        record->limbo.clear();
+        record->announced.store(0, std::memory_order_release);
+        record->inUse.store(false, std::memory_order_release);
+    }
+
+    EpochRecord* const record;
+};
+
+EpochRecord& localRecord() {
+    thread_local RecordOwner owner;
+    return *owner.record;
+}
+
+// Moves the epoch on if every thread inside a guard has announced the
+// current one.
+void tryAdvance() {
+    auto& d = domain();
+    // Pairs with the fence in EpochGuard: a thread whose announcement we
+    // miss here does all of its reads after the epoch we advance from.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto epoch = d.epoch.load();
+    for (auto* r = d.records.load(std::memory_order_acquire); r != nullptr;
+         r = r->next) {
+        auto const announced = r->announced.load();
+        if (announced % 2 == 1 && announced / 2 != epoch) return;
+    }
+    d.epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+std::uint64_t currentEpoch() {
+    // Sequentially consistent, so it's read after whatever unlinked the
+    // memory being tagged.
+    return domain().epoch.load();
+}
+
+// Frees the entries of retired that no thread can still be using.
+void freePassed(std::vector<Retired>& retired) {
+    auto const epoch = domain().epoch.load();
+    auto const passed = std::stable_partition(
+        retired.begin(), retired.end(),
+        [&](Retired const& r) { return r.epoch + 2 > epoch; });
+    // Out of the list before any deleter runs, a deleter may retire more.
+    std::vector<Retired> const free(passed, retired.end());
+    retired.erase(passed, retired.end());
+    for (auto const& r : free) r.deleter(r.ptr);
+}
+
+// Frees what exited threads left behind, unless another thread is at it.
+void freePassedOrphans() {
+    auto& d = domain();
+    std::unique_lock<std::mutex> lock(d.orphansLock, std::try_to_lock);
+    if (lock.owns_lock() && !d.orphans.empty()) {
+        std::vector<Retired> orphans;
+        orphans.swap(d.orphans);
+        lock.unlock();
+        freePassed(orphans);
+        lock.lock();
+        d.orphans.insert(d.orphans.end(), orphans.begin(), orphans.end());
+    }
+}
+}  // namespace
+
+EpochGuard::EpochGuard() {
+    auto& record = localRecord();
+    if (record.nesting++ > 0) return;
+    auto const epoch = domain().epoch.load(std::memory_order_relaxed);
+    record.announced.store(epoch * 2 + 1, std::memory_order_relaxed);
+    // The announcement has to be visible before anything the guard
+    // protects is read.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+EpochGuard::~EpochGuard() {
+    auto& record = localRecord();
+    if (--record.nesting > 0) return;
+    record.announced.store(0, std::memory_order_release);
+}
+
+void retireLater(void* ptr, void (*deleter)(void*)) {
+    auto& record = localRecord();
+    record.limbo.push_back({ptr, deleter, currentEpoch()});
+    if (record.limbo.size() < EPOCH_RETIRE_BATCH) return;
+
+    tryAdvance();
+    freePassed(record.limbo);
+    freePassedOrphans();
+}
+
+void reclaimRetired() {
+    // Two moves are enough when no thread is inside a guard.
+    tryAdvance();
+    tryAdvance();
+    freePassed(localRecord().limbo);
+    freePassedOrphans();
+}
+
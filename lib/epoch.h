@@ -0,0 +1,53 @@
+#include <cstdint>
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// Epoch based reclamation, for memory that has been unlinked from a shared
+// structure but that threads which loaded a pointer to it earlier may still
+// be reading: replaced kvs chains, value wrappers, cuckoo tables.
+//
+// A thread does its reads inside an EpochGuard, which announces the global
+// epoch it started in. Whatever is unlinked is tagged with the epoch at the
+// time, and the epoch only moves on once every thread inside a guard has
+// announced the current one. So two epochs later no guard that could have
+// seen the memory is left, and it can be freed.
+//
+//     {
+//         EpochGuard guard;
+//         auto* old = head.exchange(fresh);
+//         retireLater(old);
+//     }
+//
+// Guards nest, only the outermost one announces anything. Keep them short:
+// a thread that stays inside one holds up freeing everything retired since.
+
+class EpochGuard {
+   public:
+    EpochGuard();
+    ~EpochGuard();
+
+    EpochGuard(EpochGuard const&) = delete;
+    EpochGuard& operator=(EpochGuard const&) = delete;
+};
+
+// Calls deleter(ptr) once no thread can be using ptr any more, ptr having
+// already been unlinked. Retired memory goes to a list of the calling
+// thread's, which is freed what it can every EPOCH_RETIRE_BATCH retires.
+// A thread that exits hands what's left on it to the next one to free.
+void retireLater(void* ptr, void (*deleter)(void*));
+
+template <typename T>
+void retireLater(T const* ptr) {
+    retireLater(const_cast<T*>(ptr),
+                [](void* p) { delete static_cast<T*>(p); });
+}
+
+// Frees what the calling thread has retired that no thread can be using any
+// more, trying to move the epoch on first, rather than waiting for its next
+// EPOCH_RETIRE_BATCH retires. For callers that retire something big and
+// want it gone promptly. Inside a guard of its own the calling thread holds
+// up what it retired since it entered, so it's best called outside.
+void reclaimRetired();
+
+#endif  // EPOCH_H
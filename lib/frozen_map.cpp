@@ -0,0 +1,134 @@
+#include "frozen_map.h"
+#include "map.h"
+#include "multi_map.h"
+#include <array>
+#include <cmath>
+#include <stdexcept>
+
+namespace cmap {
+
+typedef std::size_t size_t;
+
+// The entry position has to fit in the lower half of an index word.
+size_t const MAX_FROZEN_ENTRIES = (std::uint64_t(1) << 32) - 1;
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+FrozenUnorderedMap<K, V, Hash, KeyEqual>::FrozenUnorderedMap(
+    std::vector<std::pair<K, V>> entries, float maxLoadRatio)
+    : mEntries(std::move(entries)) {
+    if (mEntries.size() > MAX_FROZEN_ENTRIES) {
+        throw std::length_error("Too many entries to freeze");
+    }
+    // Otherwise the index could never get big enough.
+    if (!(maxLoadRatio > 0 && maxLoadRatio <= 1)) {
+        throw std::invalid_argument("maxLoadRatio must be in (0, 1]");
+    }
+
+    size_t capacity = 1;
+    while (mEntries.size() >= capacity * maxLoadRatio) capacity *= 2;
+    mIndex.assign(capacity, 0);
+    mMask = capacity - 1;
+
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        std::uint64_t const mixed = mixedHash(mEntries[i].first);
+        size_t idx = indexSlot(mixed);
+        while (mIndex[idx] != 0) idx = (idx + 1) & mMask;
+        mIndex[idx] = (mixed << 32) | (i + 1);
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+std::uint64_t FrozenUnorderedMap<K, V, Hash, KeyEqual>::mixedHash(
+    Lookup const& key) const {
+    return std::uint64_t(mHash(key)) * HASH_MIX_MULTIPLIER;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t FrozenUnorderedMap<K, V, Hash, KeyEqual>::indexSlot(
+    std::uint64_t mixed) const {
+    // Multiply-shift like KeyValueStore::slotIndex.
+    return (unsigned __int128)mixed * mIndex.size() >> 64;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+std::int64_t FrozenUnorderedMap<K, V, Hash, KeyEqual>::find(
+    Lookup const& key) const {
+    std::uint64_t const mixed = mixedHash(key);
+    std::uint64_t const tag = mixed << 32;
+    size_t idx = indexSlot(mixed);
+    while (true) {
+        std::uint64_t const word = mIndex[idx];
+        if (word == 0) return -1;
+        if ((word & ~std::uint64_t(MAX_FROZEN_ENTRIES)) == tag) {
+            size_t const entry = (word & MAX_FROZEN_ENTRIES) - 1;
+            if (mKeyEqual(mEntries[entry].first, key)) return entry;
+        }
+        idx = (idx + 1) & mMask;
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+V FrozenUnorderedMap<K, V, Hash, KeyEqual>::at(Lookup const& key) const {
+    auto const entry = find(key);
+    if (entry < 0) throw std::out_of_range("Unable to find key");
+    return mEntries[entry].second;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool FrozenUnorderedMap<K, V, Hash, KeyEqual>::contains(
+    Lookup const& key) const {
+    return find(key) >= 0;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t FrozenUnorderedMap<K, V, Hash, KeyEqual>::bucket_count() const {
+    return mIndex.size();
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t FrozenUnorderedMap<K, V, Hash, KeyEqual>::size() const {
+    return mEntries.size();
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool FrozenUnorderedMap<K, V, Hash, KeyEqual>::empty() const {
+    return mEntries.empty();
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool FrozenUnorderedMap<K, V, Hash, KeyEqual>::operator==(
+    std::unordered_map<K, V> const& other) const {
+    if (size() != other.size()) return false;
+    for (auto const& pair : mEntries) {
+        auto const it = other.find(pair.first);
+        if (it == other.end() || it->second != pair.second) return false;
+    }
+    return true;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+std::unique_ptr<ConcurrentUnorderedMap<K, V, MultiWriter, Hash, KeyEqual>>
+FrozenUnorderedMap<K, V, Hash, KeyEqual>::thaw(float maxLoadRatio) const {
+    int exp = 5;
+    while (mEntries.size() >= std::pow(2, exp) * maxLoadRatio) exp++;
+    auto map = std::make_unique<
+        ConcurrentUnorderedMap<K, V, MultiWriter, Hash, KeyEqual>>(
+        exp, maxLoadRatio);
+    for (auto const& pair : mEntries) map->insert(pair);
+    return map;
+}
+
+template class FrozenUnorderedMap<float, float>;
+template class FrozenUnorderedMap<int, int>;
+template class FrozenUnorderedMap<int, float>;
+template class FrozenUnorderedMap<float, int>;
+template class FrozenUnorderedMap<std::vector<bool>, float>;
+template class FrozenUnorderedMap<std::string, int>;
+template class FrozenUnorderedMap<std::string, int, StringHash, StringEqual>;
+template class FrozenUnorderedMap<InlineString<23>, int>;
+template class FrozenUnorderedMap<InlineString<23>, int, StringHash,
+                                  StringEqual>;
+template class FrozenUnorderedMap<int, MultiMapNode<int>*>;
+template class FrozenUnorderedMap<int, std::array<float, 16>>;
+template class FrozenUnorderedMap<int, std::array<float, 2>>;
+}  // namespace cmap
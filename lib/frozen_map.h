@@ -0,0 +1,75 @@
+#include "concurrency_policy.h"
+#include "consts.h"
+#include "key_traits.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef FROZEN_MAP_H
+#define FROZEN_MAP_H
+
+namespace cmap {
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+class ConcurrentUnorderedMap;
+
+// Immutable snapshot of a ConcurrentUnorderedMap for read mostly phases,
+// created with ConcurrentUnorderedMap::freeze().
+// The entries are packed densely into one array and found through an open
+// addressing index of (hash tag, entry) words. A lookup is plain loads from
+// plain arrays: no atomics, no reader counts and no writes of any kind, so
+// readers on different cores never fight over a cache line.
+// Hash and KeyEqual are the source map's, so lookups hash keys the same way
+// and take the same Lookup type (see LookupKey in key_traits.h).
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>>
+class FrozenUnorderedMap {
+   public:
+    typedef typename LookupKey<K, Hash, KeyEqual>::type Lookup;
+
+    // Throws std::invalid_argument unless 0 < maxLoadRatio <= 1.
+    explicit FrozenUnorderedMap(
+        std::vector<std::pair<K, V>> entries,
+        float maxLoadRatio = DEFAULT_MAX_LOAD_RATIO);
+
+    V at(Lookup const& key) const;
+    bool contains(Lookup const& key) const;
+    std::size_t bucket_count() const;
+    std::size_t size() const;
+    bool empty() const;
+
+    bool operator==(std::unordered_map<K, V> const& other) const;
+
+    // Builds a new concurrent map holding the same entries. The map is
+    // created big enough to not need any resizes.
+    std::unique_ptr<ConcurrentUnorderedMap<K, V, MultiWriter, Hash, KeyEqual>>
+    thaw(float maxLoadRatio = DEFAULT_MAX_LOAD_RATIO) const;
+
+   private:
+    // The hash of key, mixed like the kvs does so that integer keys, whose
+    // std::hash is the identity, spread over the whole word.
+    std::uint64_t mixedHash(Lookup const& key) const;
+    // The index slot a key with the given mixed hash starts probing at,
+    // from its high bits.
+    std::size_t indexSlot(std::uint64_t mixed) const;
+
+    // Index of the entry with the given key or -1 if there's none.
+    std::int64_t find(Lookup const& key) const;
+
+    std::vector<std::pair<K, V>> mEntries;
+    // Each index word is a tag, the low 32 bits of the mixed hash (the high
+    // ones pick the index slot), followed by the position in mEntries + 1.
+    // So 0 marks an empty index slot, and most probes past a different key
+    // are rejected without touching mEntries.
+    std::vector<std::uint64_t> mIndex;
+    std::size_t mMask;
+    Hash mHash;
+    KeyEqual mKeyEqual;
+};
+}  // namespace cmap
+
+#endif  // FROZEN_MAP_H
@@ -0,0 +1,56 @@
+#include <array>
+#include <cstddef>
+#include <type_traits>
+
+#ifndef KEY_TRAITS_H
+#define KEY_TRAITS_H
+
+// Customisation points for key and value types, specialise them next to
+// your type (see string_key.h for the string ones).
+
+// A cheap, non owning view of a key that can be hashed and compared
+// against the key itself, e.g. std::string_view for std::string. Only used
+// when the Hash and KeyEqual of a map are transparent.
+template <typename K>
+struct KeyView {
+    typedef K type;
+};
+
+// Whether a Slot stores the key inline, in the slot itself, instead of
+// behind its own heap allocation. Only worth it for small trivially
+// copyable keys.
+template <typename K>
+struct StoreKeyInline : std::false_type {};
+
+// Whether a Slot stores the value inline, guarded by a sequence counter,
+// instead of allocating a new wrapper for every write. Writers then update
+// the value in place and readers copy it, retrying if a write got in
+// between, so overwriting a value allocates nothing. Worth it for large
+// trivially copyable values that are updated often; small ones are cheap
+// to allocate and a reader has to copy the whole value on every attempt.
+template <typename V>
+struct StoreValueInline : std::false_type {};
+
+// Fixed size arrays of plain data, e.g. feature vectors, bigger than a
+// pointer.
+template <typename T, std::size_t N>
+struct StoreValueInline<std::array<T, N>>
+    : std::bool_constant<std::is_trivially_copyable_v<T> &&
+                         (sizeof(T) * N > sizeof(void*))> {};
+
+// The type lookups (at, erase, contains) take. When both Hash and KeyEqual
+// are transparent (declare is_transparent) this is the KeyView of K, so
+// looking up a string key doesn't need a std::string. Otherwise it's K.
+template <typename K, typename Hash, typename KeyEqual, typename = void>
+struct LookupKey {
+    typedef K type;
+};
+
+template <typename K, typename Hash, typename KeyEqual>
+struct LookupKey<K, Hash, KeyEqual,
+                 std::void_t<typename Hash::is_transparent,
+                             typename KeyEqual::is_transparent>> {
+    typedef typename KeyView<K>::type type;
+};
+
+#endif  // KEY_TRAITS_H
@@ -1,11 +1,30 @@
 #include "kvs.h"
-
-template <typename K, typename V>
-KeyValueStore<K, V>::KeyValueStore(size_t size, float maxLoadRatio)
-    : mKvs(std::vector<Slot<K, V>>(size)), mMaxLoadRatio(maxLoadRatio) {}
-
-template <typename K, typename V>
-size_t KeyValueStore<K, V>::size() const {
+#include "multi_map.h"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+
+namespace {
+std::int64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+}  // namespace
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+KeyValueStore<K, V, Policy, Hash, KeyEqual>::KeyValueStore(
+    size_t size, KvsConfig const& config)
+    : mKvs(size, NumaAllocator<Slot<K, V, Policy>>(config.numaPolicy)),
+      mConfig(config),
+      mMissFilter(config.missFilter ? size * BLOOM_BITS_PER_SLOT : 0) {}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::size() const {
     size_t s = mSize;
     if (mNextKvs != nullptr) {
         s += nextKvs()->size();
@@ -13,8 +32,9 @@ size_t KeyValueStore<K, V>::size() const {
     return s;
 }
 
-template <typename K, typename V>
-bool KeyValueStore<K, V>::empty() const {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::empty() const {
     auto empty = mSize == 0;
     auto next_empty = true;
     if (mNextKvs != nullptr) {
@@ -23,38 +43,55 @@ bool KeyValueStore<K, V>::empty() const {
     return empty && next_empty;
 }
 
-template <typename K, typename V>
-size_t KeyValueStore<K, V>::bucket_count() const {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::bucket_count() const {
     if (mNextKvs != nullptr) {
         return nextKvs()->bucket_count();
     }
     return mKvs.size();
 }
 
-template <typename K, typename V>
-V KeyValueStore<K, V>::insert(std::pair<K, V> const& val) {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V KeyValueStore<K, V, Policy, Hash, KeyEqual>::insert(
+    std::pair<K, V> const& val) {
     return insert(val, ALIVE);
 }
 
-template <typename K, typename V>
-void KeyValueStore<K, V>::erase(K const key) {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::erase(Lookup const& key) {
     if (eraseKvs(key)) {
         return;
     }
     if (mNextKvs.load() != nullptr) mNextKvs.load()->erase(key);
 }
 
-template <typename K, typename V>
-V KeyValueStore<K, V>::atKvs(K const key) {
-    int idx = hash(key);
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V KeyValueStore<K, V, Policy, Hash, KeyEqual>::atKvs(Lookup const& key) {
+    auto const mixed = mixedHash(key);
+    if (!mMissFilter.mayContain(mixed)) {
+        if (mNextKvs == nullptr) throw std::out_of_range("Unable to find key");
+        return nextKvs()->at(key);
+    }
+    size_t idx = slotIndex(mixed);
+    Backoff backoff(mConfig.backoff);
     while (true) {
         auto const& slot = mKvs[idx];
         auto const currentKeyValue = slot.key();
-        if (currentKeyValue->eval(key)) {
+        if (keyEquals(currentKeyValue, key)) {
             auto value = slot.value();
+            if (value->state() == COPIED_DEAD) {
+                // The copy may still be on its way to the next kvs, until it
+                // or a newer write turns up there the marker's value holds.
+                auto const found = nextKvs()->findFrom(key, value->data());
+                if (!found) throw std::out_of_range("Unable to find key");
+                return *found;
+            }
             if (value->dead()) {
                 if (mNextKvs == nullptr) {
-                    mNumReaders--;
                     throw std::out_of_range("Unable to find key");
                 } else {
                     return nextKvs()->at(key);
@@ -64,7 +101,19 @@ V KeyValueStore<K, V>::atKvs(K const key) {
             // only partially set ie the key is set but not yet the value.
             // So we need to start again until we can see the value or it's
             // killed.
-            if (value->empty()) continue;
+            // If the inserter takes too long (it's probably been
+            // descheduled) we stop waiting: its insert hasn't happened yet
+            // as far as anybody can tell, so the key isn't in this kvs.
+            if (value->empty()) {
+                if (backoff.attempts() < EMPTY_VALUE_MAX_WAITS) {
+                    backoff.pause();
+                    continue;
+                }
+                if (mNextKvs == nullptr) {
+                    throw std::out_of_range("Unable to find key");
+                }
+                return nextKvs()->at(key);
+            }
             // Value found, let's return.
             return value->data();
         }
@@ -81,77 +130,109 @@ V KeyValueStore<K, V>::atKvs(K const key) {
     assert(false);
 }
 
-template <typename K, typename V>
-KeyValueStore<K, V>* KeyValueStore<K, V>::nextKvs() const {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+KeyValueStore<K, V, Policy, Hash, KeyEqual>*
+KeyValueStore<K, V, Policy, Hash, KeyEqual>::nextKvs() const {
     return mNextKvs.load();
 }
 
-template <typename K, typename V>
-bool KeyValueStore<K, V>::copied() const {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::copied() const {
     return mCopied;
 }
 
-template <typename K, typename V>
-bool KeyValueStore<K, V>::hasActiveReaders() const {
-    return mNumReaders != 0;
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::uint64_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::mixedHash(
+    Lookup const& key) const {
+    return std::uint64_t(mHash(key)) * HASH_MIX_MULTIPLIER;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::slotIndex(
+    std::uint64_t mixed) const {
+    // Multiply-shift range reduction (fastrange): the high 64 bits of
+    // hash * size are spread evenly over [0, size) for any size, without
+    // the division of a modulo.
+    return (unsigned __int128)mixed * mKvs.size() >> 64;
 }
 
-template <typename K, typename V>
-size_t KeyValueStore<K, V>::hash(K const key) const {
-    return clip(mHash(key));
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::hash(
+    Lookup const& key) const {
+    return slotIndex(mixedHash(key));
 }
 
-template <typename K, typename V>
-void KeyValueStore<K, V>::newKvs() {
-    // You could check here if anybody else has already started a resize and
-    // if so not allocate memory.
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::keyEquals(
+    DataWrapper<K> const* slotKey, Lookup const& key) const {
+    if (slotKey->state() != ALIVE && slotKey->state() != COPIED_ALIVE) {
+        return false;
+    }
+    return mKeyEqual(slotKey->data(), key);
+}
 
-    auto* ptr = new KeyValueStore(mKvs.size() * 2, mMaxLoadRatio);
-    KeyValueStore<K, V>* null_lvalue = nullptr;
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::newKvs() {
+    // If somebody else has already started a resize don't allocate memory,
+    // with interleaved placement that would be an mmap + mbind + munmap on
+    // every insert until the copy is done.
+    if (mNextKvs.load() != nullptr) return;
+
+    // Whoever gets here first starts the clock, see copyNanos().
+    std::int64_t notStarted = 0;
+    mCopyStart.compare_exchange_strong(notStarted, nowNanos());
+
+    size_t const size = mKvs.size();
+    size_t const grownSize =
+        std::max<size_t>(size + 1, size * mConfig.growthFactor);
+    auto* ptr = new KeyValueStore(grownSize, mConfig);
     // Only thread should win the race and put the newKvs into place.
-    if (!mNextKvs.compare_exchange_strong(null_lvalue, ptr)) {
+    if (!casOrStore<Policy>(mNextKvs, nullptr, ptr)) {
         // Allocated for nothing, some other thread beat us,
         // so cleanup our mess.
         delete ptr;
     }
 }
 
-template <typename K, typename V>
-
-size_t KeyValueStore<K, V>::getCopyBatchIdx() {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::getCopyBatchIdx() {
     auto startIdx = mCopyIdx.load();
     if (startIdx >= mKvs.size()) {
         return mKvs.size();
     }
 
     size_t endIdx = startIdx + COPY_CHUNK_SIZE;
-    if (!mCopyIdx.compare_exchange_strong(startIdx, endIdx)) {
+    if (!casOrStore<Policy>(mCopyIdx, startIdx, endIdx)) {
         // Another thread claimed this work before us.
         return mKvs.size();
     }
     return startIdx;
 }
-template <typename K, typename V>
-
-void KeyValueStore<K, V>::copySlot(size_t idx) {
-    DataWrapper<K>* keyCopiedMarker = new DataWrapper<K>(K(), COPIED_DEAD);
-
-    Slot<K, V>* slot = &mKvs[idx];
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::copySlot(size_t idx) {
+    Slot<K, V, Policy>* slot = &mKvs[idx];
     auto key = slot->key();
     assert(!key->dead());
 
     // Let's see if we can put a COPIED state into an EMPTY key:
     if (key->empty()) {
-        if (slot->casKey(key, keyCopiedMarker)) return;
+        if (slot->markKeyCopied(key)) return;
         // Key was EMPTY when we last checked, but not by the time the
         // cas was attempted so we need to copy the value into the new
         // kvs.
     }
 
-    delete keyCopiedMarker;
-    DataWrapper<V>* valueCopiedMarker = new DataWrapper<V>(V(), COPIED_DEAD);
-
     // key wasn't EMPTY so we need to forward the value into the new table.
+    Backoff backoff(mConfig.backoff);
     while (true) {
         auto value = slot->value();
         auto data = value->data();
@@ -159,13 +240,10 @@ void KeyValueStore<K, V>::copySlot(size_t idx) {
         // Some assertions for my sanity.
         assert(!slot->key()->empty());
         assert(!slot->key()->dead());
-        assert(value->state() != COPIED_DEAD);
+        assert(!value->copied());
         assert(mNextKvs != nullptr);
 
-        if (value->state() == TOMB_STONE) {
-            delete valueCopiedMarker;
-            return;
-        }
+        if (value->state() == TOMB_STONE) return;
 
         if (value->empty()) {
             // We got here so the key wasn't empty, but the value is empty.
@@ -173,76 +251,122 @@ void KeyValueStore<K, V>::copySlot(size_t idx) {
             // the key but not yet the value.
             // So we need to wait until the value is visible before we can
             // do the cas below.
+            if (backoff.attempts() < EMPTY_VALUE_MAX_WAITS) {
+                backoff.pause();
+                continue;
+            }
+            // The inserter is taking too long, instead of waiting for it
+            // mark the value as copied. There's nothing to copy, and when
+            // the inserter finds the marker it moves on to the next kvs.
+            if (slot->casValue(value, V(), COPIED_EMPTY)) {
+                addOrStore<Policy>(mSize, -1);
+                return;
+            }
             continue;
         }
 
-        if (slot->casValue(value, valueCopiedMarker)) {
+        // The marker keeps the value, so fetchAdd can finish the copy
+        // itself if it gets to the next kvs first.
+        if (slot->casValue(value, data, COPIED_DEAD)) {
             nextKvs()->insert({key->data(), data}, COPIED_ALIVE);
-            mSize--;
+            addOrStore<Policy>(mSize, -1);
             return;
         }
+        backoff.pause();
     }
     assert(false);
 }
-template <typename K, typename V>
-
-void KeyValueStore<K, V>::copyBatch() {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::copyBatch() {
     auto const startIdx = getCopyBatchIdx();
     if (startIdx == mKvs.size()) {
         // Either the copy is done or another thread got the work.
         return;
     }
 
-    size_t const endIdx = startIdx + COPY_CHUNK_SIZE;
+    // The last batch is short unless the size is a multiple of
+    // COPY_CHUNK_SIZE.
+    size_t const endIdx = std::min(startIdx + COPY_CHUNK_SIZE, mKvs.size());
 
     for (auto i = startIdx; i < endIdx; i++) copySlot(i);
 
-    if (endIdx == mKvs.size()) mCopied = true;
+    // Batches finish out of order, so it's the thread finishing the last
+    // outstanding one, not the one with the last slots, that gets to mark
+    // the kvs copied. Before that some values are still on their way to the
+    // next kvs and lookups have to keep looking here.
+    size_t const copied = endIdx - startIdx;
+    if (mCopyDone.fetch_add(copied) + copied == mKvs.size()) {
+        mCopyNanos = nowNanos() - mCopyStart.load();
+        mCopied = true;
+    }
+}
 
-    assert(endIdx <= mKvs.size());
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::finishCopy() {
+    Backoff backoff(mConfig.backoff);
+    while (mCopyDone.load() < mKvs.size()) {
+        if (mCopyIdx.load() < mKvs.size()) {
+            copyBatch();
+        } else {
+            // The rest is being copied by other threads.
+            backoff.pause();
+        }
+    }
 }
 
-template <typename K, typename V>
-Slot<K, V>* KeyValueStore<K, V>::insertKey(K const key) {
-    DataWrapper<K> const* desiredKey = new DataWrapper<K>(key, ALIVE);
-    int idx = hash(desiredKey->data());
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+Slot<K, V, Policy>* KeyValueStore<K, V, Policy, Hash, KeyEqual>::insertKey(
+    K const& key) {
+    auto const mixed = mixedHash(key);
+    // Before the key can be seen in its slot, so a lookup that finds the
+    // key missing from the filter can't have found it in the slot either.
+    mMissFilter.add(mixed);
+    size_t idx = slotIndex(mixed);
     auto* slot = &mKvs[idx];
+    Backoff backoff(mConfig.backoff);
 
     while (true) {
         DataWrapper<K> const* currentKey = slot->key();
-        // Check if we've fo und an open space:
+
+        // Check if we've found an open space:
         if (currentKey->empty()) {
-            if (slot->casKey(currentKey, desiredKey)) {
+            if (slot->claimKey(currentKey, key)) {
                 // yay!! We inserted the key.
-                ++mSize;
+                addOrStore<Policy>(mSize, 1);
+                addOrStore<Policy>(mClaimed, 1);
                 break;
             }
             // We saw an empty key but failed to CAS our key in.
             // - Either another thread CAS'd its key in before us.
             // - Or an earlier CAS is not yet visible to this thread.
+            // - Or the slot was marked as copied, and the check below
+            //   sends us on to the next kvs.
             // Either way we don't have up-to-date information on what
             // key is stored in the current slot, meaning we need to
             // start again.
+            backoff.pause();
             continue;
         }
 
-        if (currentKey->eval(desiredKey->data())) {
+        if (keyEquals(currentKey, key)) {
             // The current key has the same value as the one were trying to
-            // insert. So we can just use the current key but need to not
-            // leak the memory of the newly allocated key.
-            delete desiredKey;
+            // insert, so we can just use the current key.
             break;
         }
 
+        // A slot copied while still empty means a copy is running, so the
+        // key belongs in the next kvs anyway.
+        if (currentKey->state() == COPIED_DEAD) return nullptr;
+
         // So we failed to claim a key slot:
         // If a resize is required let's not bother continueing to insert
         // into this kvs, and instead check if we can insert into the new
         // resized Kvs. NOTE: Without this check we could spin infinitely
         // here looking for a key slot on a full kvs.
-        if (resizeRequired()) {
-            delete desiredKey;
-            return nullptr;
-        }
+        if (resizeRequired()) return nullptr;
 
         // reprobe
         idx = clip(idx + 1);
@@ -251,104 +375,134 @@ Slot<K, V>* KeyValueStore<K, V>::insertKey(K const key) {
     return slot;
 }
 
-template <typename K, typename V>
-
-V KeyValueStore<K, V>::insertValue(Slot<K, V>* slot, V value,
-                                   DataState valueState) {
-    assert(valueState == COPIED_ALIVE || valueState == ALIVE);
-    DataWrapper<V> const* desiredValue = new DataWrapper<V>(value, valueState);
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V KeyValueStore<K, V, Policy, Hash, KeyEqual>::insertValue(
+    Slot<K, V, Policy>* slot, V value, DataState valueState) {
+    assert(valueState == COPIED_ALIVE || valueState == ALIVE ||
+           valueState == TOMB_STONE);
+    Backoff backoff(mConfig.backoff);
 
     while (true) {
-        DataWrapper<V> const* currentValue = slot->value();
+        auto const currentValue = slot->value();
+
+        if (currentValue->copied()) {
+            // The slot was copied to the next kvs before our value made it
+            // in, so that's where the value has to go now. Overwriting the
+            // marker would lose the update.
+            return nextKvs()->insert({slot->key()->data(), value},
+                                     valueState);
+        }
 
+        // A TOMB_STONE here is newer than anything still in the old kvs.
         bool const canReplaceWithValueFromOldKvs =
-            (currentValue->empty() || currentValue->fromPrevKvs());
+            (currentValue->state() == EMPTY || currentValue->fromPrevKvs());
         bool const insertingValueFromOldKvs = valueState == COPIED_ALIVE;
 
         if (!canReplaceWithValueFromOldKvs && insertingValueFromOldKvs) {
-            delete desiredValue;
             return currentValue->data();
         }
 
-        if (currentValue->eval(desiredValue->data())) {
+        if (valueState == TOMB_STONE) {
+            if (currentValue->state() == TOMB_STONE) return value;
+            if (slot->casValue(currentValue, value, TOMB_STONE)) {
+                addOrStore<Policy>(mSize, -1);
+                return value;
+            }
+            backoff.pause();
+            continue;
+        }
+
+        if (currentValue->eval(value)) {
             // Value already in place so we're done.
-            delete desiredValue;
             return currentValue->data();
         }
 
-        if (slot->casValue(currentValue, desiredValue))
-            return desiredValue->data();
+        // A claimed key was counted already, an erased one wasn't.
+        bool const erased = currentValue->state() == TOMB_STONE;
+        if (slot->casValue(currentValue, value, valueState)) {
+            if (erased) addOrStore<Policy>(mSize, 1);
+            return value;
+        }
+        backoff.pause();
     }
 }
 
-template <typename K, typename V>
-V KeyValueStore<K, V>::insertKvs(std::pair<K, V> const& val,
-                                 DataState const valueState) {
-    Slot<K, V>* slot = insertKey(val.first);
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V KeyValueStore<K, V, Policy, Hash, KeyEqual>::insertKvs(
+    std::pair<K, V> const& val, DataState const valueState) {
+    Slot<K, V, Policy>* slot = insertKey(val.first);
     if (slot == nullptr) {
         // We failed to get a keySlot and a resize is required. Let's start
         // again and check if we can use the new kvs or allocate one
         // ourselves.
-        return insert(val);
+        return insert(val, valueState);
     }
     return insertValue(slot, val.second, valueState);
 }
 
-template <typename K, typename V>
-
-bool KeyValueStore<K, V>::eraseKvs(K const key) {
-    int slotIdx = hash(key);
-
-    while (true) {
-        auto const slotKey = mKvs[slotIdx].key();
-
-        if (slotKey->eval(key)) {
-            // great we found it.
-            break;
-        }
-
-        if (slotKey->empty()) {
-            // Couldn't find it, seems the key doesn't exist.
-            return false;
-        }
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+Slot<K, V, Policy>* KeyValueStore<K, V, Policy, Hash, KeyEqual>::findKey(
+    Lookup const& key) {
+    auto const mixed = mixedHash(key);
+    if (!mMissFilter.mayContain(mixed)) return nullptr;
+    size_t idx = slotIndex(mixed);
+    for (size_t probes = 0; probes < mKvs.size(); probes++) {
+        auto* slot = &mKvs[idx];
+        auto const slotKey = slot->key();
+        if (keyEquals(slotKey, key)) return slot;
+        // A slot copied while empty ends the probe run just like an empty
+        // one, otherwise a kvs whose copy has finished has no empty slots
+        // left and we'd probe forever.
+        if (slotKey->empty() || slotKey->dead()) return nullptr;
+        idx = clip(idx + 1);
+    }
+    return nullptr;
+}
 
-        // reprobe
-        slotIdx = clip(slotIdx + 1);
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::eraseKvs(Lookup const& key) {
+    auto* slot = findKey(key);
+    if (slot == nullptr) {
+        // Couldn't find it, seems the key doesn't exist.
+        return false;
     }
 
-    DataWrapper<V>* tombStone = new DataWrapper<V>(V(), TOMB_STONE);
+    Backoff backoff(mConfig.backoff);
     while (true) {
-        auto& slot = mKvs[slotIdx];
-        DataWrapper<V> const* slotValue = slot.value();
+        auto const slotValue = slot->value();
 
         // If we find a TOMB_STONE somebody else has already deleted the
         // value, so we can return true, we're done.
-        if (slotValue->state() == TOMB_STONE) {
-            delete tombStone;
-            return true;
-        }
+        if (slotValue->state() == TOMB_STONE) return true;
 
         // If we find a COPIED_DEAD the value has been copied into a new
-        // table so we need to return false to ensure we check the newer
-        // table.
-        if (slotValue->state() == COPIED_DEAD) {
-            delete tombStone;
-            return false;
+        // table, but the copy may not have reached it yet. So rather than
+        // erasing there, which could miss it, a tombstone is inserted that
+        // the late copy can't overwrite. Likewise for a late insert after
+        // COPIED_EMPTY.
+        if (slotValue->copied()) {
+            nextKvs()->insert({K(key), V()}, TOMB_STONE);
+            return true;
         }
 
-        auto const valueData = slotValue->data();
-        if (slot.casValue(slotValue, tombStone)) {
-            mSize--;
+        if (slot->casValue(slotValue, V(), TOMB_STONE)) {
+            addOrStore<Policy>(mSize, -1);
             return true;
         }
+        backoff.pause();
     }
 
     assert(false);
 }
 
-template <typename K, typename V>
-V KeyValueStore<K, V>::insert(std::pair<K, V> const& val,
-                              DataState const valueState) {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V KeyValueStore<K, V, Policy, Hash, KeyEqual>::insert(
+    std::pair<K, V> const& val, DataState const valueState) {
     if (resizeRequired()) {
         newKvs();
     }
@@ -359,14 +513,285 @@ V KeyValueStore<K, V>::insert(std::pair<K, V> const& val,
         // We ask each inserter to also do a little work copying data to the
         // new Kvs.
         copyBatch();
+        // Copies and tombstones from the previous kvs still go through
+        // their key's slot here if it has one: if it holds a tombstone the
+        // copy is stale, and if it's been copied on insertValue follows it.
+        // Skipping ahead could resurrect an erased key.
+        if (valueState != ALIVE) {
+            if (auto* slot = findKey(val.first)) {
+                return insertValue(slot, val.second, valueState);
+            }
+        }
         return nextKvs()->insert(val, valueState);
     }
 
     return insertKvs(val, valueState);
 }
 
-template <typename K, typename V>
-V KeyValueStore<K, V>::at(K const key) {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V KeyValueStore<K, V, Policy, Hash, KeyEqual>::fetchAdd(K const& key,
+                                                        V delta,
+                                                        size_t& casFailures) {
+    if constexpr (!IS_ADDABLE<V>) {
+        throw std::logic_error("fetchAdd requires an arithmetic V");
+    } else {
+        auto const [live, before] = update(
+            key,
+            [&](bool live, V const& current) -> std::optional<V> {
+                return V((live ? current : V()) + delta);
+            },
+            casFailures);
+        return live ? before : V();
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::pair<V, bool> KeyValueStore<K, V, Policy, Hash, KeyEqual>::tryInsert(
+    std::pair<K, V> const& val) {
+    size_t casFailures = 0;
+    auto const [live, current] = update(
+        val.first,
+        [&](bool live, V const&) -> std::optional<V> {
+            if (live) return std::nullopt;
+            return val.second;
+        },
+        casFailures);
+    if (live) return {current, false};
+    return {val.second, true};
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+template <typename F>
+std::pair<bool, V> KeyValueStore<K, V, Policy, Hash, KeyEqual>::update(
+    K const& key, F const& fn, size_t& casFailures) {
+    if (resizeRequired()) newKvs();
+
+    Slot<K, V, Policy>* slot = nullptr;
+    if (mNextKvs != nullptr) {
+        copyBatch();
+        // Only a live value the copy hasn't got to yet is updated here, the
+        // copy then moves the result.
+        slot = findKey(key);
+        if (slot == nullptr) return nextKvs()->update(key, fn, casFailures);
+    } else {
+        slot = insertKey(key);
+        // No room left, start again so the resize gets going.
+        if (slot == nullptr) return update(key, fn, casFailures);
+    }
+
+    Backoff backoff(mConfig.backoff);
+    while (true) {
+        auto const current = slot->value();
+        auto const state = current->state();
+        if (state == COPIED_DEAD) {
+            // The copy may not have reached the next kvs yet. If our write
+            // got there first the copy would be dropped, and with it the
+            // value we based it on. So copy the value ourselves, from the
+            // marker; copying it twice does no harm.
+            nextKvs()->insert({slot->key()->data(), current->data()},
+                              COPIED_ALIVE);
+            return nextKvs()->update(key, fn, casFailures);
+        }
+
+        bool const live = state == ALIVE || state == COPIED_ALIVE;
+        // The copy may have passed over an EMPTY or erased value already, a
+        // new one belongs in the next kvs.
+        if (!live && mNextKvs != nullptr) {
+            return nextKvs()->update(key, fn, casFailures);
+        }
+        V const before = live ? current->data() : V();
+        auto const after = fn(live, before);
+        if (!after) return {live, before};
+        if (slot->casValue(current, *after, ALIVE)) {
+            if (state == TOMB_STONE) addOrStore<Policy>(mSize, 1);
+            return {live, before};
+        }
+        casFailures++;
+        backoff.pause();
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::applyBatch(
+    std::vector<BatchOp<K, V>> const& ops) {
+    typedef Slot<K, V, Policy> BatchSlot;
+    typedef typename BatchSlot::ValueRef ValueRef;
+
+    if (resizeRequired()) newKvs();
+    // A batch doesn't span two kvs, it waits for the copy instead.
+    if (mNextKvs != nullptr) {
+        finishCopy();
+        return nextKvs()->applyBatch(ops);
+    }
+
+    // The slot of every op, in slot order so that batches sharing slots
+    // take them in the same order. Erased keys get a slot too, so nobody
+    // can insert them while the batch is under way.
+    std::vector<std::pair<BatchSlot*, BatchOp<K, V> const*>> entries;
+    entries.reserve(ops.size());
+    for (auto const& op : ops) {
+        auto* slot = insertKey(op.key);
+        if (slot == nullptr) return applyBatch(ops);
+        entries.push_back({slot, &op});
+    }
+    // Ops on the same key stay in batch order, so the last one can win.
+    std::sort(entries.begin(), entries.end());
+    size_t const nEntries = entries.size();
+    // The ops on one key share its slot, which is written once.
+    auto const runEnd = [&](size_t begin) {
+        size_t end = begin + 1;
+        while (end < nEntries && entries[end].first == entries[begin].first)
+            end++;
+        return end;
+    };
+    // Whether the ops of the run at begin all expect what value holds.
+    auto const matches = [&](size_t begin, ValueRef const& value) {
+        auto const state = value->state();
+        bool const live = state == ALIVE || state == COPIED_ALIVE;
+        for (size_t i = begin; i < runEnd(begin); i++) {
+            auto const& expected = entries[i].second->expected;
+            if (expected && !(live && value->data() == *expected)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    Backoff backoff(mConfig.backoff);
+    if constexpr (!StoreValueInline<V>::value) {
+        // Heap values: the batch is one BatchDescriptor over the value
+        // words of its slots, built from a snapshot of what they hold. If
+        // any of them changes before the batch has marked it the batch is
+        // undone and built again from a new snapshot.
+        while (true) {
+            std::vector<ValueRef> snapshot;
+            snapshot.reserve(nEntries);
+            bool allMatch = true;
+            for (size_t begin = 0; begin < nEntries; begin = runEnd(begin)) {
+                auto* slot = entries[begin].first;
+                auto current = slot->value();
+                // A key nobody wrote a value for yet, likely one we just
+                // claimed. Erase it, so a batch that fails leaves no value
+                // behind that readers would wait for.
+                while (current->state() == EMPTY) {
+                    if (slot->casValue(current, V(), TOMB_STONE)) {
+                        addOrStore<Policy>(mSize, -1);
+                    }
+                    current = slot->value();
+                }
+                if (current->copied()) {
+                    // A resize started and got to this slot first, the
+                    // batch has to go to the next kvs.
+                    finishCopy();
+                    return nextKvs()->applyBatch(ops);
+                }
+                // One value that doesn't match is enough to fail, the batch
+                // can't have happened while it was there.
+                if (!matches(begin, current)) allMatch = false;
+                snapshot.push_back(current);
+            }
+            if (!allMatch) return false;
+
+            auto* batch = new BatchDescriptor<V>();
+            for (size_t begin = 0, r = 0; begin < nEntries;
+                 begin = runEnd(begin), r++) {
+                auto const& op = *entries[runEnd(begin) - 1].second;
+                auto const* desired =
+                    op.type == BatchOpType::INSERT
+                        ? new DataWrapper<V>(op.value, ALIVE)
+                        : new DataWrapper<V>(V(), TOMB_STONE);
+                batch->add(entries[begin].first->valueWord(), snapshot[r],
+                           desired);
+            }
+            if (batch->run()) {
+                for (size_t begin = 0, r = 0; begin < nEntries;
+                     begin = runEnd(begin), r++) {
+                    auto const& op = *entries[runEnd(begin) - 1].second;
+                    bool const wasErased = snapshot[r]->state() == TOMB_STONE;
+                    bool const erases = op.type == BatchOpType::ERASE;
+                    if (wasErased && !erases) addOrStore<Policy>(mSize, 1);
+                    if (!wasErased && erases) addOrStore<Policy>(mSize, -1);
+                }
+                return true;
+            }
+            backoff.pause();
+        }
+    } else {
+        // Inline values: the batch locks the seqlocks of its slots, in
+        // slot order so batches can't deadlock, then writes them.
+
+        // Puts back what a locked slot held. A value nobody wrote yet would
+        // keep readers waiting, it's erased instead.
+        auto const restore = [this](BatchSlot* slot, ValueRef const& old) {
+            if (old->state() != EMPTY) {
+                slot->unlockValue(old, old->data(), old->state());
+                return;
+            }
+            slot->unlockValue(old, V(), TOMB_STONE);
+            addOrStore<Policy>(mSize, -1);
+        };
+
+        // What each key's slot held when we locked it.
+        std::vector<ValueRef> locked;
+        locked.reserve(nEntries);
+        for (size_t begin = 0; begin < nEntries; begin = runEnd(begin)) {
+            auto* slot = entries[begin].first;
+            while (true) {
+                auto const current = slot->value();
+                if (current->copied()) {
+                    // A resize started and got to this slot first, the
+                    // batch has to go to the next kvs.
+                    for (size_t i = 0, r = 0; r < locked.size();
+                         i = runEnd(i), r++) {
+                        restore(entries[i].first, locked[r]);
+                    }
+                    finishCopy();
+                    return nextKvs()->applyBatch(ops);
+                }
+                if (slot->lockValue(current)) {
+                    locked.push_back(current);
+                    break;
+                }
+                backoff.pause();
+            }
+        }
+
+        // Every slot is locked, the batch takes effect here: readers of
+        // any of its keys wait until all of them are written.
+        bool allMatch = true;
+        for (size_t begin = 0, r = 0; begin < nEntries;
+             begin = runEnd(begin), r++) {
+            if (!matches(begin, locked[r])) allMatch = false;
+        }
+        for (size_t begin = 0, r = 0; begin < nEntries;
+             begin = runEnd(begin), r++) {
+            auto* slot = entries[begin].first;
+            auto const& op = *entries[runEnd(begin) - 1].second;
+            if (!allMatch) {
+                restore(slot, locked[r]);
+            } else if (op.type == BatchOpType::INSERT) {
+                if (locked[r]->state() == TOMB_STONE) {
+                    addOrStore<Policy>(mSize, 1);
+                }
+                slot->unlockValue(locked[r], op.value, ALIVE);
+            } else {
+                if (locked[r]->state() != TOMB_STONE) {
+                    addOrStore<Policy>(mSize, -1);
+                }
+                slot->unlockValue(locked[r], V(), TOMB_STONE);
+            }
+        }
+        return allMatch;
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V KeyValueStore<K, V, Policy, Hash, KeyEqual>::at(Lookup const& key) {
     if (mCopied) {
         // Not possible to be copied and not have a nextKvs, because
         // otherwise where did we copy everything into.
@@ -374,23 +799,174 @@ V KeyValueStore<K, V>::at(K const key) {
         return nextKvs()->at(key);
     }
 
-    mNumReaders++;
-    auto const result = atKvs(key);
-    mNumReaders--;
-    return result;
+    return atKvs(key);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::optional<V> KeyValueStore<K, V, Policy, Hash, KeyEqual>::find(
+    Lookup const& key) {
+    return findFrom(key, std::nullopt);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::optional<V> KeyValueStore<K, V, Policy, Hash, KeyEqual>::findFrom(
+    Lookup const& key, std::optional<V> copied) {
+    // Walks the chain the way at() recurses down it. findKey checks each
+    // kvs's miss filter first.
+    for (auto* kvs = this; kvs != nullptr; kvs = kvs->nextKvs()) {
+        // A copied kvs only holds markers, and tombstones, which don't
+        // matter unless they'd overrule copied.
+        if (kvs->mCopied && !copied) continue;
+        auto const* slot = kvs->findKey(key);
+        if (slot == nullptr) continue;
+        Backoff backoff(kvs->mConfig.backoff);
+        while (true) {
+            auto const value = slot->value();
+            auto const state = value->state();
+            if (state == ALIVE || state == COPIED_ALIVE) return value->data();
+            if (state == TOMB_STONE) copied.reset();
+            if (state == COPIED_DEAD) copied = value->data();
+            // Like atKvs, give an inserter between key and value a moment.
+            if (state != EMPTY || backoff.attempts() >= EMPTY_VALUE_MAX_WAITS)
+                break;
+            backoff.pause();
+        }
+        // Erased, copied on, or still not written: only a later kvs can
+        // have something newer.
+    }
+    return copied;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::contains(Lookup const& key) {
+    return find(key).has_value();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::mayContain(
+    Lookup const& key) const {
+    return mMissFilter.mayContain(mixedHash(key));
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::uint64_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::copyNanos() const {
+    return mCopyNanos;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::bytes() const {
+    return mKvs.size() * sizeof(Slot<K, V, Policy>) + mMissFilter.bytes();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::prefetchSlot(
+    Lookup const& key) const {
+    __builtin_prefetch(&mKvs[hash(key)]);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::prefetchData(
+    Lookup const& key) const {
+    auto const& slot = mKvs[hash(key)];
+    __builtin_prefetch(slot.key());
+    slot.prefetchValue();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::capacity() const {
+    return mKvs.size();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void KeyValueStore<K, V, Policy, Hash, KeyEqual>::forEach(
+    size_t begin, size_t end,
+    std::function<void(K const&, V const&)> const& fn) {
+    for (size_t idx = begin; idx < end && idx < mKvs.size(); idx++) {
+        auto const& slot = mKvs[idx];
+        auto const key = slot.key();
+        if (key->empty() || key->dead()) continue;
+
+        auto const value = slot.value();
+        if (value->state() != ALIVE && value->state() != COPIED_ALIVE) {
+            // Either deleted or already copied, in which case we'll find it
+            // when visiting the next kvs.
+            continue;
+        }
+
+        // The key has been inserted again into the next kvs before this
+        // slot was copied, so the value here is stale. Most keys aren't
+        // there yet, contains() answers those misses without throwing.
+        if (mNextKvs != nullptr && nextKvs()->contains(key->data())) continue;
+
+        fn(key->data(), value->data());
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::eraseIf(
+    size_t begin, size_t end,
+    std::function<bool(K const&, V const&)> const& pred) {
+    size_t erased = 0;
+    for (size_t idx = begin; idx < end && idx < mKvs.size(); idx++) {
+        auto& slot = mKvs[idx];
+        auto const key = slot.key();
+        if (key->empty() || key->dead()) continue;
+
+        Backoff backoff(mConfig.backoff);
+        while (true) {
+            auto const value = slot.value();
+            // Deleted, not written yet, or copied to the next kvs where
+            // it'll be swept.
+            if (value->state() != ALIVE && value->state() != COPIED_ALIVE) {
+                break;
+            }
+            if (!pred(key->data(), value->data())) break;
+
+            if (slot.casValue(value, V(), TOMB_STONE)) {
+                erased++;
+                break;
+            }
+            // The value changed under us, look at the new one.
+            backoff.pause();
+        }
+    }
+    // Once per range rather than per entry. It's a real atomic even for a
+    // SingleWriter, because erase_if sweeps with several threads.
+    mSize.fetch_sub(erased);
+    return erased;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+KvsConfig const& KeyValueStore<K, V, Policy, Hash, KeyEqual>::config() const {
+    return mConfig;
 }
 
-template <typename K, typename V>
-bool KeyValueStore<K, V>::resizeRequired() const {
-    return size() >= mKvs.size() * mMaxLoadRatio;
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool KeyValueStore<K, V, Policy, Hash, KeyEqual>::resizeRequired() const {
+    auto const limit = mKvs.size() * mConfig.maxLoadRatio;
+    return size() >= limit || mClaimed >= limit;
 }
 
-template <typename K, typename V>
-size_t KeyValueStore<K, V>::clip(size_t const slot) const {
-    // mKvs.size() has to be a power of 2.
-    // So subtracing 1 gives us a sequence of 1s and then &
-    // gives us a size_t between 0 and mKvs.size()
-    return slot & (mKvs.size() - 1);
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t KeyValueStore<K, V, Policy, Hash, KeyEqual>::clip(
+    size_t const slot) const {
+    // Probes only ever step one slot at a time, so at most one wrap is
+    // needed.
+    return slot < mKvs.size() ? slot : slot - mKvs.size();
 }
 
 // Explicitly instantiate all the template pairs supported.
@@ -400,3 +976,13 @@ template class KeyValueStore<float, float>;
 template class KeyValueStore<int, float>;
 template class KeyValueStore<float, int>;
 template class KeyValueStore<std::vector<bool>, float>;
+template class KeyValueStore<int, int, SingleWriter>;
+template class KeyValueStore<std::string, int>;
+template class KeyValueStore<std::string, int, MultiWriter, StringHash,
+                             StringEqual>;
+template class KeyValueStore<InlineString<23>, int>;
+template class KeyValueStore<InlineString<23>, int, MultiWriter, StringHash,
+                             StringEqual>;
+template class KeyValueStore<int, cmap::MultiMapNode<int>*>;
+template class KeyValueStore<int, std::array<float, 16>>;
+template class KeyValueStore<int, std::array<float, 2>>;
@@ -1,17 +1,72 @@
+#include "backoff.h"
+#include "bloom_filter.h"
 #include "consts.h"
+#include "key_traits.h"
+#include "numa_allocator.h"
 #include "slot.h"
 #include <functional>
+#include <optional>
 #include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 #ifndef KVS_H
 #define KVS_H
 
+// Settings shared by every kvs in a chain, newKvs passes them on to the
+// resized kvs.
+struct KvsConfig {
+    float maxLoadRatio = DEFAULT_MAX_LOAD_RATIO;
+    // Capacities don't have to be powers of 2, so any factor above 1 works,
+    // e.g. 1.5 to over-provision less on very big maps.
+    float growthFactor = DEFAULT_GROWTH_FACTOR;
+    NumaPolicy numaPolicy = NumaPolicy::DEFAULT;
+    BackoffStrategy backoff = DEFAULT_BACKOFF_STRATEGY;
+    // CASes one add() may lose before its key is combined, 0 combines
+    // every key that's added to.
+    size_t hotKeyCasFailures = COMBINE_HOT_CAS_FAILURES;
+    // Give every kvs a Bloom filter of the keys put into its slots, which
+    // lookups check before probing. Misses are then mostly answered from a
+    // single cache line per kvs instead of a probe run. The cost is
+    // BLOOM_BITS_PER_SLOT bits per slot and one more cache line for every
+    // hit and new key, so it's only worth it when a good share of lookups
+    // miss. Erased keys stay in the filter until the next resize.
+    bool missFilter = false;
+};
+
+// Whether values of type V can be summed, see ConcurrentUnorderedMap::add.
+template <typename V>
+constexpr bool IS_ADDABLE =
+    std::is_arithmetic_v<V> && !std::is_same_v<V, bool>;
+
+enum class BatchOpType { INSERT, ERASE };
+
+// One update of an atomic batch, see ConcurrentUnorderedMap::atomic_batch.
+// With expected set the whole batch only goes ahead if key holds exactly
+// that value.
 template <typename K, typename V>
+struct BatchOp {
+    BatchOpType type;
+    K key;
+    V value{};
+    std::optional<V> expected{};
+};
+
+// Lets the unit tests run the halves of an insert separately, see
+// KeyValueStore::insertKey and insertValue.
+struct KvsTestAccess;
+
+template <typename K, typename V, typename Policy = MultiWriter,
+          typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
 class KeyValueStore {
+    friend struct KvsTestAccess;
+
    public:
-    KeyValueStore(size_t size, float maxLoadRatio);
+    // What lookups take, see LookupKey in key_traits.h.
+    typedef typename LookupKey<K, Hash, KeyEqual>::type Lookup;
+
+    KeyValueStore(size_t size, KvsConfig const& config);
 
     size_t size() const;
 
@@ -24,20 +79,84 @@ class KeyValueStore {
     V insert(std::pair<K, V> const& val);
 
     // TODO: According to the spec this should return: size_t
-    void erase(K key);
+    void erase(Lookup const& key);
+
+    // Adds delta to the value of key, inserting delta if there's none, and
+    // returns the value before. Counts the CASes it lost in casFailures.
+    // Throws std::logic_error unless IS_ADDABLE<V>.
+    V fetchAdd(K const& key, V delta, size_t& casFailures);
+
+    // Stores val unless its key already has a live value. Returns the value
+    // the key has afterwards, and whether that's val's.
+    std::pair<V, bool> tryInsert(std::pair<K, V> const& val);
 
-    V atKvs(K key);
+    // Applies all of ops or, if one of their expected values doesn't
+    // match, none, and returns which. Heap values are swapped with a
+    // BatchDescriptor, inline ones under their slots' seqlocks.
+    bool applyBatch(std::vector<BatchOp<K, V>> const& ops);
+
+    V atKvs(Lookup const& key);
 
     KeyValueStore* nextKvs() const;
 
     bool copied() const;
 
-    bool hasActiveReaders() const;
+    V at(Lookup const& key);
+
+    // The value of key, or nothing if it has none: at() without the
+    // exception, for lookups that expect to miss.
+    std::optional<V> find(Lookup const& key);
+
+    bool contains(Lookup const& key);
 
-    V at(K const key);
+    // False if key is definitely not in the slots of this kvs, see
+    // KvsConfig::missFilter. Always true without a filter.
+    bool mayContain(Lookup const& key) const;
+
+    // Prefetch the slot key hashes to, or what that slot's key and value
+    // point at. Only hints, these never wait for the memory.
+    void prefetchSlot(Lookup const& key) const;
+    void prefetchData(Lookup const& key) const;
+
+    // Number of slots in this kvs, unlike bucket_count() this doesn't look
+    // at the next kvs.
+    size_t capacity() const;
+
+    // Calls fn on every live entry in the slots [begin, end) of this kvs.
+    // Entries which have been replaced in the next kvs are skipped, so
+    // visiting every kvs in a chain sees each key once, as long as no copy
+    // is running concurrently. Otherwise the view is only weakly consistent.
+    void forEach(size_t begin, size_t end,
+                 std::function<void(K const&, V const&)> const& fn);
+
+    // Tombstones every live entry in the slots [begin, end) of this kvs for
+    // which pred returns true, and returns how many it erased. Entries that
+    // have already been copied to the next kvs are left for the sweep of
+    // that kvs. Threads may sweep disjoint ranges at the same time.
+    size_t eraseIf(size_t begin, size_t end,
+                   std::function<bool(K const&, V const&)> const& pred);
+
+    KvsConfig const& config() const;
+
+    // Nanoseconds from the first newKvs of this kvs to its last slot being
+    // copied, 0 until the copy is done.
+    std::uint64_t copyNanos() const;
+
+    // Bytes of the slot array and the miss filter, not counting what heap
+    // allocated keys and values point at.
+    size_t bytes() const;
 
    private:
-    size_t hash(K const key) const;
+    // The hash of key, mixed so its high bits are usable.
+    std::uint64_t mixedHash(Lookup const& key) const;
+
+    // The slot a key with the given mixed hash starts probing at.
+    size_t slotIndex(std::uint64_t mixed) const;
+
+    size_t hash(Lookup const& key) const;
+
+    // Whether slotKey is a live key equal to key.
+    bool keyEquals(DataWrapper<K> const* slotKey, Lookup const& key) const;
 
     void newKvs();
 
@@ -47,30 +166,63 @@ class KeyValueStore {
 
     void copyBatch();
 
-    Slot<K, V>* insertKey(K const key);
+    // Helps copy this kvs until every slot is in the next one.
+    void finishCopy();
+
+    Slot<K, V, Policy>* insertKey(K const& key);
 
-    V insertValue(Slot<K, V>* slot, V value, DataState valueState);
+    V insertValue(Slot<K, V, Policy>* slot, V value, DataState valueState);
 
     V insert(std::pair<K, V> const& val, DataState const valueState);
 
-    bool eraseKvs(K const key);
+    // The slot holding key, or nullptr if key isn't in this kvs.
+    Slot<K, V, Policy>* findKey(Lookup const& key);
+
+    // find() for a key whose slot in the kvs before this one was marked
+    // COPIED_DEAD with the value copied: that value stands unless the copy,
+    // or a newer write or erase, has reached this kvs or a later one.
+    std::optional<V> findFrom(Lookup const& key, std::optional<V> copied);
+
+    bool eraseKvs(Lookup const& key);
 
     V insertKvs(std::pair<K, V> const& val, DataState const valueState);
 
+    // The read-modify-write behind fetchAdd and tryInsert: fn(live,
+    // current) gives the value to store for key, or nothing to leave the
+    // current one. Returns whether the value fn was last given was live,
+    // and that value.
+    template <typename F>
+    std::pair<bool, V> update(K const& key, F const& fn,
+                              size_t& casFailures);
+
     bool resizeRequired() const;
 
+    // Wraps a probe that stepped past the last slot back to the first.
     size_t clip(size_t const slot) const;
 
     std::atomic<size_t> mSize{};
-    std::vector<Slot<K, V>> mKvs;
+    // Slots that have had a key claimed, never decremented: an erased key
+    // keeps its slot, so this rather than mSize says when probing for a
+    // free slot can run out of them.
+    std::atomic<size_t> mClaimed{};
+    std::vector<Slot<K, V, Policy>, NumaAllocator<Slot<K, V, Policy>>> mKvs;
     std::atomic<KeyValueStore*> mNextKvs = nullptr;
-    std::atomic<size_t> mCopyIdx;
-    std::atomic<size_t> mNumReaders = 0;
+    std::atomic<size_t> mCopyIdx{};
+    // Slots whose copy has finished.
+    std::atomic<size_t> mCopyDone{};
     // mCopied doesn't need to be atomic because it's only every going to change
     // from false to true. and it doesn't matter how many times that happens.
     bool mCopied = false;
-    float const mMaxLoadRatio;
-    std::hash<K> mHash;
+    // steady_clock time of the first newKvs, and then how long the copy
+    // took, see copyNanos().
+    std::atomic<std::int64_t> mCopyStart{};
+    std::atomic<std::uint64_t> mCopyNanos{};
+    KvsConfig const mConfig;
+    // Every key ever claimed a slot here. Only copied keys make it into the
+    // next kvs's filter, which is how erased keys leave.
+    BlockedBloomFilter mMissFilter;
+    Hash mHash;
+    KeyEqual mKeyEqual;
 };
 
 #endif  // KVS_H
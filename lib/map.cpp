@@ -1,49 +1,216 @@
 #include "map.h"
 #include "data_wrapper.h"
+#include "multi_map.h"
 #include "slot.h"
+#include "snapshot.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <iterator>
+#include <optional>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 #include "kvs.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace cmap {
 
 typedef std::size_t size_t;
 
-template <typename K, typename V>
-ConcurrentUnorderedMap<K, V>::ConcurrentUnorderedMap(int exp,
-                                                     float maxLoadRatio)
-    : mHeadKvs(new KeyValueStore<K, V>(std::pow(2, exp), maxLoadRatio)) {}
+namespace {
 
-template <typename K, typename V>
-V ConcurrentUnorderedMap<K, V>::insert(std::pair<K, V> const& val) {
+int const HOT_KEY_FREE = 0;
+int const HOT_KEY_CLAIMED = 1;
+int const HOT_KEY_READY = 2;
+
+// Threads take delta cells round robin, the first time they add to a
+// combined key, and keep theirs for every combined key after that.
+std::atomic<size_t> nextDeltaCell{};
+
+size_t deltaCellOfThread() {
+    thread_local size_t const cell = nextDeltaCell++ % COMBINE_DELTA_CELLS;
+    return cell;
+}
+
+// fetch_add, which std::atomic only has for integers before C++20.
+template <typename T>
+void addRelaxed(std::atomic<T>& atomic, T delta) {
+    if constexpr (std::is_integral_v<T>) {
+        atomic.fetch_add(delta, std::memory_order_relaxed);
+    } else {
+        T current = atomic.load(std::memory_order_relaxed);
+        while (!atomic.compare_exchange_weak(current, T(current + delta),
+                                             std::memory_order_relaxed)) {
+        }
+    }
+}
+
+// Calls fn(0) to fn(nThreads - 1) on threads of their own, but for fn(0)
+// which runs on the calling thread.
+void runOnThreads(size_t nThreads, std::function<void(size_t)> const& fn) {
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nThreads; t++) threads.emplace_back(fn, t);
+    fn(0);
+    for (auto& t : threads) t.join();
+}
+
+size_t threadsOrCores(size_t nThreads) {
+    if (nThreads != 0) return nThreads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Keeps what each thread writes on cache lines of its own.
+template <typename T>
+struct alignas(64) PerThread {
+    T value{};
+};
+
+template <typename Key, typename Hash>
+size_t hotKeySlot(Key const& key) {
+    std::uint64_t const mixed =
+        std::uint64_t(Hash()(key)) * HASH_MIX_MULTIPLIER;
+    return (mixed >> 32) % COMBINE_HOT_KEY_SLOTS;
+}
+}  // namespace
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::ConcurrentUnorderedMap(
+    int exp, float maxLoadRatio, NumaPolicy numaPolicy, BackoffStrategy backoff,
+    float growthFactor)
+    : ConcurrentUnorderedMap(
+          std::pow(2, exp),
+          {maxLoadRatio, growthFactor, numaPolicy, backoff}) {}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::ConcurrentUnorderedMap(
+    size_t capacity, KvsConfig const& config)
+    : mInitialCapacity(std::max<size_t>(capacity, 1)) {
+    // A kvs that doesn't grow would never get out of a resize.
+    if (!(config.maxLoadRatio > 0 && config.maxLoadRatio <= 1)) {
+        throw std::invalid_argument("maxLoadRatio must be in (0, 1]");
+    }
+    if (!(config.growthFactor > 1)) {
+        throw std::invalid_argument("growthFactor must be above 1");
+    }
+    mHeadKvs = new Kvs(mInitialCapacity, config);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::
+    ~ConcurrentUnorderedMap() {
+    delete[] mHotKeys.load();
+    deleteChain(mHeadKvs.load());
+    // Retired kvs still held up by a guard are freed with the stats they
+    // share, whenever the threads that retired them get round to it.
+    reclaimRetired();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::insert(
+    std::pair<K, V> const& val) {
+    EpochGuard guard;
+    tryUpdateKvsHead();
+    dropDeltas(val.first);
+    auto const value = mHeadKvs.load()->insert(val);
+    // If this insert copied the last chunk of a resize the next kvs can
+    // take over now, rather than whenever the map is written to again.
+    tryUpdateKvsHead();
+    return value;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::pair<V, bool> ConcurrentUnorderedMap<K, V, Policy, Hash,
+                                          KeyEqual>::try_insert(
+    std::pair<K, V> const& val) {
+    EpochGuard guard;
     tryUpdateKvsHead();
-    return mHeadKvs.load()->insert(val);
+    return mHeadKvs.load()->tryInsert(val);
 }
-template <typename K, typename V>
-V ConcurrentUnorderedMap<K, V>::at(const K key) const {
-    return mHeadKvs.load()->at(key);
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::at(
+    Lookup const& key) const {
+    EpochGuard guard;
+    return atWithDeltas(mHeadKvs.load(), key);
 }
-template <typename K, typename V>
-size_t ConcurrentUnorderedMap<K, V>::bucket_count() const {
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::optional<V> ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::find(
+    Lookup const& key) const {
+    EpochGuard guard;
+    return findWithDeltas(mHeadKvs.load(), key);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::contains(
+    Lookup const& key) const {
+    EpochGuard guard;
+    return containsWithDeltas(mHeadKvs.load(), key);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::prefetchSlot(
+    Lookup const& key) const {
+    EpochGuard guard;
+    mHeadKvs.load()->prefetchSlot(key);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::prefetchData(
+    Lookup const& key) const {
+    EpochGuard guard;
+    mHeadKvs.load()->prefetchData(key);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::bucket_count()
+    const {
+    EpochGuard guard;
     return mHeadKvs.load()->bucket_count();
 }
 
-template <typename K, typename V>
-size_t ConcurrentUnorderedMap<K, V>::size() const {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::size() const {
+    EpochGuard guard;
     return mHeadKvs.load()->size();
 }
 
-template <typename K, typename V>
-bool ConcurrentUnorderedMap<K, V>::empty() const {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::empty() const {
+    EpochGuard guard;
     return mHeadKvs.load()->empty();
 }
 
-template <typename K, typename V>
-size_t ConcurrentUnorderedMap<K, V>::depth() const {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::depth() const {
+    EpochGuard guard;
     size_t depth = 0;
-    KeyValueStore<K, V>* kvs = mHeadKvs;
+    Kvs* kvs = mHeadKvs;
     while (true) {
         if (kvs->nextKvs() == nullptr) {
             break;
@@ -53,48 +220,786 @@ size_t ConcurrentUnorderedMap<K, V>::depth() const {
     }
     return depth;
 }
-template <typename K, typename V>
-bool ConcurrentUnorderedMap<K, V>::operator==(
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+typename ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::ResizeStats
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::resize_stats() const {
+    ResizeStats stats;
+    auto const count = [&](Kvs const* kvs) {
+        if (kvs->copyNanos() == 0) return;
+        stats.resizes++;
+        stats.totalCopyNanos += kvs->copyNanos();
+        stats.maxCopyNanos = std::max(stats.maxCopyNanos, kvs->copyNanos());
+    };
+    EpochGuard guard;
+    for (Kvs const* kvs = mHeadKvs; kvs != nullptr; kvs = kvs->nextKvs()) {
+        count(kvs);
+        if (kvs->nextKvs() != nullptr && !kvs->copied()) stats.copying++;
+    }
+    auto const& retired = *mRetiredStats;
+    stats.resizes += retired.resizes.load();
+    stats.totalCopyNanos += retired.totalCopyNanos.load();
+    stats.maxCopyNanos =
+        std::max(stats.maxCopyNanos, retired.maxCopyNanos.load());
+    stats.retiredKvs = retired.kvs.load();
+    stats.retainedBytes = retired.bytes.load();
+    return stats;
+}
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::operator==(
     std::unordered_map<K, V> const& other) const {
-    if (size() != other.size()) return false;
+    size_t const nThreads = threadsOrCores(0);
+    std::vector<PerThread<size_t>> matched(nThreads);
+    std::atomic<bool> mismatch{};
+    parallelForEach(nThreads, [&](size_t thread, K const& key, V const& value) {
+        if (mismatch.load(std::memory_order_relaxed)) return;
+        auto const it = other.find(key);
+        if (it == other.end() || !(it->second == value)) {
+            mismatch = true;
+            return;
+        }
+        matched[thread].value++;
+    });
+    if (mismatch) return false;
+    // Every entry we have is in other, so other has no more if it has as
+    // many.
+    size_t total = 0;
+    for (auto const& count : matched) total += count.value;
+    return total == other.size();
+}
 
-    for (auto const& pair : other) {
-        try {
-            if (mHeadKvs.load()->at(pair.first) != pair.second) {
-                return false;
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::erase(
+    Lookup const& key) {
+    EpochGuard guard;
+    dropDeltas(key);
+    mHeadKvs.load()->erase(key);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::add(K const& key,
+                                                               V delta) {
+    if constexpr (!IS_ADDABLE<V>) {
+        throw std::logic_error("add requires an arithmetic V");
+    } else {
+        if (auto const* hot = findHotKey(key)) {
+            // Only ever written through atomics, the const is findHotKey's.
+            auto& cells = const_cast<HotKey*>(hot)->cells;
+            addRelaxed(cells[deltaCellOfThread()].delta, delta);
+            // Read first, so adds to a key that's already marked don't all
+            // write the same line.
+            auto& added = const_cast<HotKey*>(hot)->added;
+            if (!added.load(std::memory_order_relaxed)) {
+                added.store(true, std::memory_order_release);
             }
+            return;
+        }
+        EpochGuard guard;
+        tryUpdateKvsHead();
+        auto* head = mHeadKvs.load();
+        size_t casFailures = 0;
+        head->fetchAdd(key, delta, casFailures);
+        if (casFailures >= head->config().hotKeyCasFailures) makeHot(key);
+    }
+}
 
-        } catch (std::out_of_range) {
-            return false;
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::merge_deltas() {
+    mergeDeltas();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::atomic_batch(
+    std::vector<BatchOp<K, V>> const& ops) {
+    EpochGuard guard;
+    // Expected values are compared with the stored ones.
+    mergeDeltas();
+    tryUpdateKvsHead();
+    return mHeadKvs.load()->applyBatch(ops);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::erase_if(
+    std::function<bool(K const&, V const&)> const& pred, size_t nThreads) {
+    // The sweeping threads below lean on this one: nothing retired while
+    // it's inside the guard is freed.
+    EpochGuard guard;
+    mergeDeltas();
+    if (nThreads == 0) {
+        nThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::atomic<size_t> erased{};
+    // Sweep the chain from the head, so an entry a resize moves while
+    // we're sweeping is found in a kvs we haven't swept yet.
+    for (auto* kvs = mHeadKvs.load(); kvs != nullptr; kvs = kvs->nextKvs()) {
+        // Like at(), skip a kvs that's been copied, everything in it lives
+        // in the next one now.
+        if (kvs->copied()) continue;
+
+        // Threads claim chunks of slots the way copyBatch does.
+        size_t const nChunks =
+            (kvs->capacity() + SWEEP_CHUNK_SIZE - 1) / SWEEP_CHUNK_SIZE;
+        std::atomic<size_t> nextChunk{};
+        auto const sweep = [&]() {
+            size_t chunk;
+            while ((chunk = nextChunk++) < nChunks) {
+                erased += kvs->eraseIf(chunk * SWEEP_CHUNK_SIZE,
+                                       (chunk + 1) * SWEEP_CHUNK_SIZE, pred);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < std::min(nThreads, nChunks); t++) {
+            threads.emplace_back(sweep);
         }
+        sweep();
+        for (auto& t : threads) t.join();
     }
-    return true;
+    return erased;
 }
 
-template <typename K, typename V>
-void ConcurrentUnorderedMap<K, V>::erase(K const key) {
-    mHeadKvs.load()->erase(key);
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+size_t ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::retain(
+    std::function<bool(K const&, V const&)> const& pred, size_t nThreads) {
+    return erase_if(
+        [&](K const& key, V const& value) { return !pred(key, value); },
+        nThreads);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::clear() {
+    {
+        EpochGuard guard;
+        auto* fresh = new Kvs(mInitialCapacity, mHeadKvs.load()->config());
+        retire(mHeadKvs.exchange(fresh), true);
+    }
+    reclaimRetired();
+    dropAllDeltas();
 }
 
-template <typename K, typename V>
-void ConcurrentUnorderedMap<K, V>::tryUpdateKvsHead() {
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::exchange(
+    ConcurrentUnorderedMap& replacement) {
+    // Deltas stay with the keys they were added to, so the replacement's
+    // go in with its contents and ours go out with the old ones.
+    {
+        EpochGuard guard;
+        replacement.mergeDeltas();
+        auto* fresh = new Kvs(replacement.mInitialCapacity,
+                              replacement.mHeadKvs.load()->config());
+        auto* newHead = replacement.mHeadKvs.exchange(fresh);
+        // Handles of replacement mustn't carry on in what's now ours.
+        replacement.mHeadGeneration++;
+        retire(mHeadKvs.exchange(newHead), true);
+    }
+    reclaimRetired();
+    dropAllDeltas();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::swap(
+    ConcurrentUnorderedMap& other) {
+    std::swap(mInitialCapacity, other.mInitialCapacity);
+    mHeadKvs.store(other.mHeadKvs.exchange(mHeadKvs.load()));
+    mHeadGeneration++;
+    other.mHeadGeneration++;
+    std::swap(mRetiredStats, other.mRetiredStats);
+    mHotKeys.store(other.mHotKeys.exchange(mHotKeys.load()));
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::save(
+    std::string const& path) const {
+    if constexpr (!std::is_trivially_copyable_v<K> ||
+                  !std::is_trivially_copyable_v<V>) {
+        throw std::logic_error("save requires trivially copyable K and V");
+    } else {
+        EpochGuard guard;
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file) throw std::runtime_error("Unable to open " + path);
+
+        SnapshotHeader header{};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.keySize = sizeof(K);
+        header.valueSize = sizeof(V);
+        // We only know the count at the end, so the header is written again
+        // once we're done.
+        file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+
+        std::vector<char> buffer;
+        buffer.reserve(SNAPSHOT_WRITE_BUFFER_SIZE);
+        auto const flush = [&]() {
+            file.write(buffer.data(), buffer.size());
+            buffer.clear();
+        };
+
+        std::function<void(K const&, V const&)> const write =
+            [&](K const& key, V const& value) {
+                auto const* k = reinterpret_cast<char const*>(&key);
+                buffer.insert(buffer.end(), k, k + sizeof(K));
+                auto const stored = withDeltas(key, value);
+                auto const* v = reinterpret_cast<char const*>(&stored);
+                buffer.insert(buffer.end(), v, v + sizeof(V));
+                header.count++;
+                if (buffer.size() >= SNAPSHOT_WRITE_BUFFER_SIZE) flush();
+            };
+        for (auto* kvs = mHeadKvs.load(); kvs != nullptr;
+             kvs = kvs->nextKvs()) {
+            kvs->forEach(0, kvs->capacity(), write);
+        }
+        forEachDeltaOnlyKey(write);
+        flush();
+
+        file.seekp(0);
+        file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        file.flush();
+        if (!file) throw std::runtime_error("Failed writing " + path);
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::load(
+    std::string const& path) {
+    if constexpr (!std::is_trivially_copyable_v<K> ||
+                  !std::is_trivially_copyable_v<V>) {
+        throw std::logic_error("load requires trivially copyable K and V");
+    } else {
+        int const fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Unable to open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Unable to stat " + path);
+        }
+        size_t const fileSize = st.st_size;
+        if (fileSize < sizeof(SnapshotHeader)) {
+            close(fd);
+            throw std::runtime_error("Not a snapshot: " + path);
+        }
+        void* data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Unable to mmap " + path);
+        }
+        madvise(data, fileSize, MADV_WILLNEED);
+
+        char const* bytes = static_cast<char const*>(data);
+        SnapshotHeader header;
+        std::memcpy(&header, bytes, sizeof(header));
+        size_t const recordSize = sizeof(K) + sizeof(V);
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+            header.version != SNAPSHOT_VERSION ||
+            header.keySize != sizeof(K) || header.valueSize != sizeof(V) ||
+            // Divided first, a corrupt count mustn't wrap the product round
+            // to the file size.
+            header.count > (fileSize - sizeof(header)) / recordSize ||
+            fileSize != sizeof(header) + header.count * recordSize) {
+            munmap(data, fileSize);
+            throw std::runtime_error("Not a compatible snapshot: " + path);
+        }
+        char const* records = bytes + sizeof(header);
+        size_t const count = header.count;
+
+        // Size the kvs up front so no insert below triggers a resize.
+        auto const config = mHeadKvs.load()->config();
+        size_t const capacity =
+            std::max(COPY_CHUNK_SIZE, size_t(count / config.maxLoadRatio) + 1);
+        auto* kvs = new Kvs(capacity, config);
+
+        // A SingleWriter kvs's CASes are plain stores, two threads loading
+        // into it would overwrite each other's slots.
+        size_t const nThreads =
+            Policy::singleWriter
+                ? 1
+                : std::max(1u, std::thread::hardware_concurrency());
+        size_t const perThread = (count + nThreads - 1) / nThreads;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < nThreads; t++) {
+            threads.emplace_back([=]() {
+                size_t const end = std::min(count, (t + 1) * perThread);
+                for (size_t i = t * perThread; i < end; i++) {
+                    K key;
+                    V value;
+                    char const* record = records + i * recordSize;
+                    std::memcpy(&key, record, sizeof(K));
+                    std::memcpy(&value, record + sizeof(K), sizeof(V));
+                    kvs->insert({key, value});
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        munmap(data, fileSize);
+
+        // Handles may still be holding on to the old head, so the chain is
+        // retired like clear()'s rather than deleted.
+        {
+            EpochGuard guard;
+            retire(mHeadKvs.exchange(kvs), true);
+        }
+        reclaimRetired();
+        dropAllDeltas();
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+FrozenUnorderedMap<K, V, Hash, KeyEqual>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::freeze() const {
+    return FrozenUnorderedMap<K, V, Hash, KeyEqual>(to_vector());
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::vector<std::pair<K, V>>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::to_vector(
+    size_t nThreads) const {
+    auto buffers = scanEntries(threadsOrCores(nThreads));
+    if (buffers.size() == 1) return std::move(buffers[0]);
+    size_t total = 0;
+    for (auto const& buffer : buffers) total += buffer.size();
+    std::vector<std::pair<K, V>> entries;
+    entries.reserve(total);
+    for (auto& buffer : buffers) {
+        std::move(buffer.begin(), buffer.end(), std::back_inserter(entries));
+    }
+    return entries;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::vector<std::pair<K, V>>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::to_sorted_vector(
+    size_t nThreads) const {
+    nThreads = threadsOrCores(nThreads);
+    auto const byKey = [](auto const& a, auto const& b) {
+        return a.first < b.first;
+    };
+    auto buffers = scanEntries(nThreads);
+    runOnThreads(nThreads, [&](size_t t) {
+        std::sort(buffers[t].begin(), buffers[t].end(), byKey);
+    });
+
+    // The sorted runs, back to back, and where each of them starts.
+    std::vector<size_t> runStarts;
+    std::vector<std::pair<K, V>> entries;
+    size_t total = 0;
+    for (auto const& buffer : buffers) total += buffer.size();
+    entries.reserve(total);
+    for (auto& buffer : buffers) {
+        runStarts.push_back(entries.size());
+        std::move(buffer.begin(), buffer.end(), std::back_inserter(entries));
+    }
+    runStarts.push_back(entries.size());
+
+    // Each round merges runs 0 and 1, 2 and 3, ... into merged, halving
+    // their number, and the two arrays swap roles for the next round.
+    std::vector<std::pair<K, V>> merged(runStarts.size() > 2 ? total : 0);
+    while (runStarts.size() > 2) {
+        size_t const nRuns = runStarts.size() - 1;
+        runOnThreads((nRuns + 1) / 2, [&](size_t pair) {
+            auto const from = entries.begin();
+            auto const begin = runStarts[2 * pair];
+            auto const middle = runStarts[std::min(2 * pair + 1, nRuns)];
+            auto const end = runStarts[std::min(2 * pair + 2, nRuns)];
+            std::merge(std::make_move_iterator(from + begin),
+                       std::make_move_iterator(from + middle),
+                       std::make_move_iterator(from + middle),
+                       std::make_move_iterator(from + end),
+                       merged.begin() + begin, byKey);
+        });
+        std::vector<size_t> starts;
+        for (size_t run = 0; run < nRuns; run += 2) {
+            starts.push_back(runStarts[run]);
+        }
+        starts.push_back(total);
+        runStarts = std::move(starts);
+        entries.swap(merged);
+    }
+    return entries;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::unordered_map<K, V>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::to_unordered_map(
+    size_t nThreads) const {
+    auto const buffers = scanEntries(threadsOrCores(nThreads));
+    size_t total = 0;
+    for (auto const& buffer : buffers) total += buffer.size();
+    std::unordered_map<K, V> map;
+    map.reserve(total);
+    for (auto const& buffer : buffers) map.insert(buffer.begin(), buffer.end());
+    return map;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::parallelForEach(
+    size_t nThreads,
+    std::function<void(size_t, K const&, V const&)> const& fn) const {
+    // The chunks of every kvs in the chain, in chain order so that like
+    // erase_if's sweep an entry moved by a resize while we scan tends to
+    // be found in a kvs that hasn't been scanned yet. The scanning threads
+    // are covered by this thread's guard.
+    EpochGuard guard;
+    std::vector<std::pair<Kvs*, size_t>> chunks;
+    for (auto* kvs = mHeadKvs.load(); kvs != nullptr; kvs = kvs->nextKvs()) {
+        // Everything in a copied kvs lives in the next one now.
+        if (kvs->copied()) continue;
+        for (size_t begin = 0; begin < kvs->capacity();
+             begin += SWEEP_CHUNK_SIZE) {
+            chunks.push_back({kvs, begin});
+        }
+    }
+    std::atomic<size_t> nextChunk{};
+    runOnThreads(std::min(nThreads, chunks.size()), [&](size_t thread) {
+        std::function<void(K const&, V const&)> const visit =
+            [&](K const& key, V const& value) {
+                fn(thread, key, withDeltas(key, value));
+            };
+        size_t chunk;
+        while ((chunk = nextChunk++) < chunks.size()) {
+            auto const [kvs, begin] = chunks[chunk];
+            kvs->forEach(begin, begin + SWEEP_CHUNK_SIZE, visit);
+        }
+    });
+    forEachDeltaOnlyKey(
+        [&](K const& key, V const& deltas) { fn(0, key, deltas); });
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::vector<std::vector<std::pair<K, V>>>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::scanEntries(
+    size_t nThreads) const {
+    std::vector<PerThread<std::vector<std::pair<K, V>>>> buffers(nThreads);
+    // Room for a fair share and then some, so most buffers never grow.
+    size_t const share = size() / nThreads;
+    for (auto& buffer : buffers) buffer.value.reserve(share + share / 4);
+    parallelForEach(nThreads, [&](size_t thread, K const& key, V const& value) {
+        buffers[thread].value.emplace_back(key, value);
+    });
+    std::vector<std::vector<std::pair<K, V>>> entries;
+    for (auto& buffer : buffers) entries.push_back(std::move(buffer.value));
+    return entries;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+typename ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::HotKey const*
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::findHotKey(
+    Lookup const& key) const {
+    auto const* table = mHotKeys.load(std::memory_order_acquire);
+    if (table == nullptr) return nullptr;
+    size_t idx = hotKeySlot<Lookup, Hash>(key);
+    for (size_t probes = 0; probes < COMBINE_HOT_KEY_SLOTS; probes++) {
+        auto const& hot = table[idx];
+        auto const state = hot.state.load(std::memory_order_acquire);
+        if (state == HOT_KEY_FREE) return nullptr;
+        // A CLAIMED key isn't combined yet, its adds still go to the slot.
+        if (state == HOT_KEY_READY && KeyEqual()(hot.key, key)) return &hot;
+        idx = (idx + 1) % COMBINE_HOT_KEY_SLOTS;
+    }
+    return nullptr;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::makeHot(
+    K const& key) {
+    auto* table = mHotKeys.load(std::memory_order_acquire);
+    if (table == nullptr) {
+        auto* fresh = new HotKey[COMBINE_HOT_KEY_SLOTS];
+        if (mHotKeys.compare_exchange_strong(table, fresh)) {
+            table = fresh;
+        } else {
+            delete[] fresh;
+        }
+    }
+    size_t idx = hotKeySlot<K, Hash>(key);
+    for (size_t probes = 0; probes < COMBINE_HOT_KEY_SLOTS; probes++) {
+        auto& hot = table[idx];
+        auto state = hot.state.load(std::memory_order_acquire);
+        if (state == HOT_KEY_FREE &&
+            hot.state.compare_exchange_strong(state, HOT_KEY_CLAIMED)) {
+            hot.key = key;
+            hot.state.store(HOT_KEY_READY, std::memory_order_release);
+            return;
+        }
+        // Whoever claimed it may be combining this very key, and two
+        // entries for one key would split its deltas.
+        while (state == HOT_KEY_CLAIMED) {
+            cpuRelax();
+            state = hot.state.load(std::memory_order_acquire);
+        }
+        if (KeyEqual()(hot.key, key)) return;
+        idx = (idx + 1) % COMBINE_HOT_KEY_SLOTS;
+    }
+    // Full, the key carries on without combining.
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::atWithDeltas(
+    Kvs* head, Lookup const& key) const {
+    auto const found = findWithDeltas(head, key);
+    if (!found) throw std::out_of_range("Unable to find key");
+    return *found;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+std::optional<V>
+ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::findWithDeltas(
+    Kvs* head, Lookup const& key) const {
+    if constexpr (IS_ADDABLE<V>) {
+        if (auto const* hot = findHotKey(key)) {
+            // A merge moves deltas from the cells to the stored value, a sum
+            // overlapping one could miss them or count them twice.
+            while (true) {
+                auto const merges = hot->merges.load(std::memory_order_acquire);
+                if (merges % 2 == 1) {
+                    cpuRelax();
+                    continue;
+                }
+                bool const added = hot->added.load(std::memory_order_acquire);
+                V const deltas = pendingDeltas(*hot);
+                auto const stored = head->find(key);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (hot->merges.load(std::memory_order_relaxed) != merges) {
+                    continue;
+                }
+                if (stored) return V(*stored + deltas);
+                if (!added && deltas == V()) return std::nullopt;
+                return deltas;
+            }
+        }
+    }
+    return head->find(key);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+bool ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::containsWithDeltas(
+    Kvs* head, Lookup const& key) const {
+    return findWithDeltas(head, key).has_value();
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::dropDeltas(
+    Lookup const& key) {
+    if (auto const* hot = findHotKey(key)) {
+        const_cast<HotKey*>(hot)->added.store(false,
+                                              std::memory_order_relaxed);
+        for (auto& cell : const_cast<HotKey*>(hot)->cells) {
+            cell.delta.store(Delta(), std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::dropAllDeltas() {
+    auto* table = mHotKeys.load(std::memory_order_acquire);
+    if (table == nullptr) return;
+    for (size_t i = 0; i < COMBINE_HOT_KEY_SLOTS; i++) {
+        table[i].added.store(false, std::memory_order_relaxed);
+        for (auto& cell : table[i].cells) {
+            cell.delta.store(Delta(), std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::mergeDeltas() {
+    if constexpr (IS_ADDABLE<V>) {
+        auto* table = mHotKeys.load(std::memory_order_acquire);
+        if (table == nullptr) return;
+        EpochGuard guard;
+        for (size_t i = 0; i < COMBINE_HOT_KEY_SLOTS; i++) {
+            auto& hot = table[i];
+            if (hot.state.load(std::memory_order_acquire) != HOT_KEY_READY) {
+                continue;
+            }
+            // Odd while we move the deltas, so at() doesn't sum the key
+            // half way. One merge of a key at a time, the others wait.
+            auto merges = hot.merges.load();
+            while (merges % 2 == 1 ||
+                   !hot.merges.compare_exchange_weak(merges, merges + 1)) {
+                cpuRelax();
+                merges = hot.merges.load();
+            }
+            // A reader that sees any of the cells change must see the odd
+            // count, like the writers of an inline slot.
+            std::atomic_thread_fence(std::memory_order_release);
+            // Cleared before the cells are taken, so an add that lands
+            // after this sets it again. An add that isn't stored is stored
+            // even if its deltas sum to 0.
+            bool const added = hot.added.exchange(false);
+            V sum = V();
+            for (auto& cell : hot.cells) {
+                sum += cell.delta.exchange(V(), std::memory_order_relaxed);
+            }
+            if (added || sum != V()) {
+                size_t casFailures = 0;
+                mHeadKvs.load()->fetchAdd(hot.key, sum, casFailures);
+            }
+            hot.merges.store(merges + 2, std::memory_order_release);
+        }
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::pendingDeltas(
+    HotKey const& hot) {
+    V deltas = V();
+    if constexpr (IS_ADDABLE<V>) {
+        for (auto const& cell : hot.cells) {
+            deltas += cell.delta.load(std::memory_order_relaxed);
+        }
+    }
+    return deltas;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+V ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::withDeltas(
+    K const& key, V const& value) const {
+    if constexpr (IS_ADDABLE<V>) {
+        if (auto const* hot = findHotKey(key)) {
+            return V(value + pendingDeltas(*hot));
+        }
+    }
+    return value;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::forEachDeltaOnlyKey(
+    std::function<void(K const&, V const&)> const& fn) const {
+    if constexpr (IS_ADDABLE<V>) {
+        auto const* table = mHotKeys.load(std::memory_order_acquire);
+        if (table == nullptr) return;
+        EpochGuard guard;
+        for (size_t i = 0; i < COMBINE_HOT_KEY_SLOTS; i++) {
+            auto const& hot = table[i];
+            if (hot.state.load(std::memory_order_acquire) != HOT_KEY_READY) {
+                continue;
+            }
+            bool const added = hot.added.load(std::memory_order_acquire);
+            V const deltas = pendingDeltas(hot);
+            if ((!added && deltas == V()) ||
+                mHeadKvs.load()->contains(hot.key)) {
+                continue;
+            }
+            fn(hot.key, deltas);
+        }
+    }
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::tryUpdateKvsHead() {
     // Surgically replace the head.
     auto headKvs = mHeadKvs.load();
     auto nextKvs = headKvs->nextKvs();
-    if (nextKvs != nullptr && headKvs->copied() &&
-        !headKvs->hasActiveReaders()) {
+    // Readers still in the old head don't need to hold this up: the head
+    // is retired rather than deleted, and a read of a copied kvs carries on
+    // in the next one.
+    if (nextKvs != nullptr && headKvs->copied()) {
+        // A real CAS whatever the policy: Handles of readers promote the
+        // head too, and only one of them may retire the old one.
         if (mHeadKvs.compare_exchange_strong(headKvs, nextKvs)) {
-            // We won so it's out responsibility to clean up the old Kvs
-            // TODO NB: Will need to put this back, but currently it creates
-            // segfault sometimes. delete headValue;/* ; */
-            // delete mHeadKvs.load();
+            // We won so it's our responsibility to clean up the old Kvs.
+            // Readers that loaded the head before the CAS may still be in
+            // it, so it can't be deleted straight away.
+            retire(headKvs, false);
+            // Our own guard holds up the kvs we've just retired, but not
+            // those of earlier resizes.
+            reclaimRetired();
         }
     }
 }
 
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::retire(
+    Kvs* kvs, bool wholeChain) {
+    // Tells Handles holding on to kvs to look up the head again. Bumped
+    // before the epoch is read, so a Handle that still sees the old
+    // generation is inside a guard that holds kvs up.
+    mHeadGeneration++;
+    auto& stats = *mRetiredStats;
+    for (Kvs const* k = kvs; k != nullptr;
+         k = wholeChain ? k->nextKvs() : nullptr) {
+        // A kvs is only retired once its copy is done, or never will be,
+        // so its copy time can be counted now.
+        auto const copyNanos = k->copyNanos();
+        if (copyNanos != 0) {
+            stats.resizes++;
+            stats.totalCopyNanos += copyNanos;
+            auto max = stats.maxCopyNanos.load();
+            while (max < copyNanos &&
+                   !stats.maxCopyNanos.compare_exchange_weak(max, copyNanos)) {
+            }
+        }
+        stats.kvs++;
+        stats.bytes += k->bytes();
+    }
+    retireLater(new RetiredKvs{kvs, wholeChain, mRetiredStats}, freeRetired);
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::freeRetired(
+    void* ptr) {
+    auto const* retired = static_cast<RetiredKvs*>(ptr);
+    Kvs* kvs = retired->kvs;
+    while (kvs != nullptr) {
+        retired->stats->kvs--;
+        retired->stats->bytes -= kvs->bytes();
+        Kvs* const next = retired->wholeChain ? kvs->nextKvs() : nullptr;
+        delete std::exchange(kvs, next);
+    }
+    delete retired;
+}
+
+template <typename K, typename V, typename Policy, typename Hash,
+          typename KeyEqual>
+void ConcurrentUnorderedMap<K, V, Policy, Hash, KeyEqual>::deleteChain(
+    Kvs* kvs) {
+    while (kvs != nullptr) delete std::exchange(kvs, kvs->nextKvs());
+}
+
 template class ConcurrentUnorderedMap<float, float>;
 template class ConcurrentUnorderedMap<int, int>;
 template class ConcurrentUnorderedMap<int, float>;
 template class ConcurrentUnorderedMap<float, int>;
 template class ConcurrentUnorderedMap<std::vector<bool>, float>;
+template class ConcurrentUnorderedMap<int, int, SingleWriter>;
+template class ConcurrentUnorderedMap<std::string, int>;
+template class ConcurrentUnorderedMap<std::string, int, MultiWriter,
+                                      StringHash, StringEqual>;
+template class ConcurrentUnorderedMap<InlineString<23>, int>;
+template class ConcurrentUnorderedMap<InlineString<23>, int, MultiWriter,
+                                      StringHash, StringEqual>;
+template class ConcurrentUnorderedMap<int, MultiMapNode<int>*>;
+template class ConcurrentUnorderedMap<int, std::array<float, 16>>;
+template class ConcurrentUnorderedMap<int, std::array<float, 2>>;
 }  // namespace cmap
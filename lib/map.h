@@ -2,31 +2,366 @@
 #define MAP_H
 
 #include "kvs.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
+#include "async_lookup.h"
+#include "epoch.h"
 #include "kvs.h"
 #include "consts.h"
+#include "frozen_map.h"
 
 namespace cmap {
 
-template <typename K, typename V>
+// Hash and KeyEqual work like std::unordered_map's. If both are
+// transparent, at/contains/erase take the key's KeyView, e.g. a
+// ConcurrentUnorderedMap<std::string, V, MultiWriter, StringHash,
+// StringEqual> is looked up with std::string_view.
+template <typename K, typename V, typename Policy = MultiWriter,
+          typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
 class ConcurrentUnorderedMap {
    public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef KeyValueStore<K, V, Policy, Hash, KeyEqual> Kvs;
+    typedef typename Kvs::Lookup Lookup;
+
+    // Throws std::invalid_argument unless 0 < maxLoadRatio <= 1 and
+    // growthFactor > 1.
     ConcurrentUnorderedMap(int exp = 5,
-                           float maxLoadRatio = DEFAULT_MAX_LOAD_RATIO);
+                           float maxLoadRatio = DEFAULT_MAX_LOAD_RATIO,
+                           NumaPolicy numaPolicy = NumaPolicy::DEFAULT,
+                           BackoffStrategy backoff = DEFAULT_BACKOFF_STRATEGY,
+                           float growthFactor = DEFAULT_GROWTH_FACTOR);
+    // Starts with exactly capacity slots, which doesn't have to be a power
+    // of 2.
+    ConcurrentUnorderedMap(size_t capacity, KvsConfig const& config);
+    ~ConcurrentUnorderedMap();
 
     V insert(std::pair<K, V> const& val);
-    V at(K key) const;
+    // Inserts val unless its key is already there, like
+    // std::unordered_map::insert: returns the value the key has afterwards
+    // and whether val was inserted. Doesn't see the pending add() deltas
+    // of a combined key.
+    std::pair<V, bool> try_insert(std::pair<K, V> const& val);
+    V at(Lookup const& key) const;
+    // at() without the exception: std::nullopt if key isn't there.
+    std::optional<V> find(Lookup const& key) const;
+    bool contains(Lookup const& key) const;
+
+    // Ask the cpu to start loading the slot a lookup of key starts at
+    // (prefetchSlot), or the key and value that slot points at
+    // (prefetchData), without waiting for either.
+    void prefetchSlot(Lookup const& key) const;
+    void prefetchData(Lookup const& key) const;
+
+#ifdef CMAP_ENABLE_COROUTINES
+    // co_await from a LookupTask to look key up while other tasks run
+    // during the cache misses, see async_lookup.h.
+    AsyncFind<ConcurrentUnorderedMap> async_find(Lookup const& key) const {
+        return {*this, key};
+    }
+#endif
     std::size_t bucket_count() const;
     std::size_t size() const;
     bool empty() const;
     std::size_t depth() const;
 
+    // How the resizes so far went, for spotting resize stalls.
+    struct ResizeStats {
+        // Resizes whose copy has finished, and those still copying, which
+        // only move on as the map is written to.
+        std::size_t resizes = 0;
+        std::size_t copying = 0;
+        // From the first thread asking for a resize to the last slot being
+        // copied, summed and the longest.
+        std::uint64_t totalCopyNanos = 0;
+        std::uint64_t maxCopyNanos = 0;
+        // Retired kvs that haven't been freed yet, see RetiredKvs. Counts
+        // their slot arrays, not what heap allocated keys and values in them
+        // point at.
+        std::size_t retiredKvs = 0;
+        std::size_t retainedBytes = 0;
+    };
+    // Walks the chain, so don't call it per operation.
+    ResizeStats resize_stats() const;
+
+    // Scans the map's slots (see to_vector) and looks every entry up in
+    // other, rather than probing the map for each key of other.
     bool operator==(std::unordered_map<K, V> const& other) const;
-    void erase(K const key);
+    void erase(Lookup const& key);
+
+    // Adds delta to the value of key, inserting delta if key isn't there.
+    // Only for arithmetic V, throws std::logic_error otherwise.
+    // Adds commute, so a key they keep colliding on (an add losing
+    // config.hotKeyCasFailures CASes) is switched to combining: from then
+    // on adds go to one of the key's COMBINE_DELTA_CELLS delta cells, picked
+    // per thread, instead of all CASing the same slot, and at() adds up the
+    // cells and the stored value. A map combines at most
+    // COMBINE_HOT_KEY_SLOTS keys, and a key stays combined for good.
+    // insert() and erase() of a combined key drop its pending deltas. An
+    // add() of a combined key that isn't stored inserts it like any other
+    // add(): at() then returns the sum of the deltas added since, even 0.
+    void add(K const& key, V delta);
+    // Folds the delta cells of combined keys into the stored values. Only
+    // the writers erase_if and atomic_batch do this themselves, at() and
+    // the exports add the pending deltas to what they read instead. An at()
+    // of a key that's being merged waits for the merge.
+    void merge_deltas();
+
+    // Applies a batch of inserts and erases all or nothing: a reader sees
+    // either none of the batch or all of it, and if an op's expected value
+    // isn't what its key holds nothing is applied and this returns false.
+    // E.g. moving the value v from key a to b:
+    //   map.atomic_batch({{BatchOpType::ERASE, a, {}, v},
+    //                     {BatchOpType::INSERT, b, v}});
+    // Of several ops on one key the last one is applied, and all their
+    // expected values are checked. For values on the heap the batch is a
+    // lock-free multi-word CAS (see batch_descriptor.h): a thread that
+    // reads a key of a batch in progress finishes the batch itself rather
+    // than wait for it. Values stored inline (StoreValueInline) are
+    // instead written under their slots' seqlocks, taken in slot order,
+    // and readers of those keys wait while the batch writes. A batch that
+    // meets a resize finishes the copy first. Pending add() deltas are
+    // merged before.
+    bool atomic_batch(std::vector<BatchOp<K, V>> const& ops);
+
+    // Erases every entry for which pred(key, value) returns true and returns
+    // how many were erased. The slot arrays are swept directly, in chunks
+    // spread over nThreads threads (all cores by default), so pred has to
+    // be thread safe. Runs alongside other operations and any resize in
+    // progress, but entries inserted during the sweep, or moved by the
+    // resize at the moment the sweep passes them, may be missed. Once the
+    // writers stop a second sweep catches those.
+    size_t erase_if(std::function<bool(K const&, V const&)> const& pred,
+                    size_t nThreads = 0);
+    // Erases every entry for which pred(key, value) returns false.
+    size_t retain(std::function<bool(K const&, V const&)> const& pred,
+                  size_t nThreads = 0);
+
+    // Empties the map in O(1) by publishing a fresh kvs of the starting
+    // capacity as the head. Inserts racing with the clear may land in the
+    // old chain, in which case they're lost as if they happened before it.
+    void clear();
+    // Atomically installs the contents of replacement, a map that was built
+    // up front and isn't in use, as the contents of this map. Readers see
+    // either all of the old or all of the new contents, without any pause.
+    // replacement is left empty.
+    void exchange(ConcurrentUnorderedMap& replacement);
+    // Swaps the contents of two maps, neither of which may be in use by
+    // any other thread. Handles of either map go on with what it holds
+    // after the swap.
+    void swap(ConcurrentUnorderedMap& other);
+
+    // A worker thread's view of the map, for threads making many calls.
+    // It remembers the head kvs instead of loading mHeadKvs on every call,
+    // and only goes back to the map when the kvs it holds has been copied,
+    // a flag that lives in the kvs it reads anyway, or when the map's head
+    // generation says the head has been replaced, e.g. by clear(), and the
+    // kvs it holds may have been freed. So in the steady state an operation
+    // writes nothing but its epoch announcement and the slots it changes.
+    // It also counts the thread's operations, without any atomics.
+    // A Handle belongs to one thread and mustn't outlive its map.
+    class Handle {
+       public:
+        struct Stats {
+            size_t inserts = 0;
+            size_t lookups = 0;
+            size_t misses = 0;
+            size_t erases = 0;
+            // How many times the cached head had to be replaced.
+            size_t headRefreshes = 0;
+        };
+
+        V insert(std::pair<K, V> const& val) {
+            mStats.inserts++;
+            EpochGuard guard;
+            mMap.dropDeltas(val.first);
+            return head()->insert(val);
+        }
+
+        V at(Lookup const& key) {
+            mStats.lookups++;
+            EpochGuard guard;
+            try {
+                return mMap.atWithDeltas(head(), key);
+            } catch (std::out_of_range const&) {
+                mStats.misses++;
+                throw;
+            }
+        }
+
+        bool contains(Lookup const& key) {
+            mStats.lookups++;
+            EpochGuard guard;
+            bool const found = mMap.containsWithDeltas(head(), key);
+            if (!found) mStats.misses++;
+            return found;
+        }
+
+        void erase(Lookup const& key) {
+            mStats.erases++;
+            EpochGuard guard;
+            mMap.dropDeltas(key);
+            head()->erase(key);
+        }
+
+        Stats const& stats() const { return mStats; }
+
+       private:
+        friend class ConcurrentUnorderedMap;
+
+        explicit Handle(ConcurrentUnorderedMap& map)
+            : mMap(map),
+              mGeneration(map.mHeadGeneration.load()),
+              mHead(map.mHeadKvs.load()) {}
+
+        // Only call inside an EpochGuard.
+        Kvs* head() {
+            auto const generation = mMap.mHeadGeneration.load();
+            // A kvs retired since may be gone, so don't touch mHead unless
+            // the generation still matches.
+            if (generation != mGeneration || mHead->copied()) {
+                // Everything's in the next kvs, make that the head if
+                // nobody has yet.
+                if (generation == mGeneration) mMap.tryUpdateKvsHead();
+                mGeneration = mMap.mHeadGeneration.load();
+                mHead = mMap.mHeadKvs.load();
+                mStats.headRefreshes++;
+            }
+            return mHead;
+        }
+
+        ConcurrentUnorderedMap& mMap;
+        std::uint64_t mGeneration;
+        Kvs* mHead;
+        Stats mStats;
+    };
+
+    Handle handle() { return Handle(*this); }
+
+    // Writes a weakly consistent snapshot of the live entries to path, see
+    // snapshot.h for the format. Safe to call while the map is in use.
+    // Throws std::logic_error if K or V isn't trivially copyable.
+    void save(std::string const& path) const;
+    // Replaces the contents of the map with a snapshot written by save().
+    // The file is mmap'd and inserted into a kvs that's already big
+    // enough, so there are no resizes, by one thread per core unless the
+    // map is SingleWriter. Must not be called concurrently
+    // with any other operation on the map. Handles taken before go on with
+    // the loaded contents.
+    void load(std::string const& path);
+
+    // Copies the live entries into an immutable FrozenUnorderedMap whose
+    // lookups don't write to any shared memory. Like save() the copy is
+    // weakly consistent if the map is being modified at the same time.
+    FrozenUnorderedMap<K, V, Hash, KeyEqual> freeze() const;
+
+    // Copies of the entries, gathered by scanning the slot arrays of the
+    // chain in chunks, like erase_if, on nThreads threads (all cores by
+    // default) that each fill a buffer of their own. Combined keys come with
+    // their pending add() deltas added. Weakly consistent like save() if the
+    // map is being modified at the same time.
+    std::vector<std::pair<K, V>> to_vector(size_t nThreads = 0) const;
+    // to_vector ordered by key: each thread sorts its own buffer, then the
+    // buffers are merged pairwise, the merges of a round in parallel.
+    std::vector<std::pair<K, V>> to_sorted_vector(size_t nThreads = 0) const;
+    std::unordered_map<K, V> to_unordered_map(size_t nThreads = 0) const;
 
    private:
+    // What resize_stats reports for the kvs retired so far. Shared with
+    // the RetiredKvs, whose deleters may only run after the map is gone.
+    struct RetiredStats {
+        std::atomic<std::size_t> resizes{};
+        std::atomic<std::uint64_t> totalCopyNanos{};
+        std::atomic<std::uint64_t> maxCopyNanos{};
+        // Those not freed yet.
+        std::atomic<std::size_t> kvs{};
+        std::atomic<std::size_t> bytes{};
+    };
+
+    // A kvs that's no longer reachable from the head but may still be in use
+    // by threads that loaded the head earlier. It goes to the retiring
+    // thread's limbo list (see epoch.h) and is freed once every thread that
+    // could have loaded it has left its EpochGuard. wholeChain says whether
+    // the kvs after it in the chain were retired with it.
+    struct RetiredKvs {
+        Kvs* kvs;
+        bool wholeChain;
+        std::shared_ptr<RetiredStats> stats;
+    };
+
+    // What a combined key's delta cells hold, only summed for addable V.
+    typedef std::conditional_t<IS_ADDABLE<V>, V, char> Delta;
+
+    // Each cell on a cache line of its own, so the threads adding to
+    // different cells of a key don't contend.
+    struct alignas(64) DeltaCell {
+        std::atomic<Delta> delta{};
+    };
+
+    // A combined key. Its state goes FREE -> CLAIMED (while key is written)
+    // -> READY and stays there. merges is odd while a merge moves the
+    // deltas into the stored value, at() retries if it changes. added is
+    // set by the adds since the last insert, erase or merge of the key, so
+    // an add that isn't stored yet counts as present even if its deltas
+    // sum to 0.
+    struct HotKey {
+        std::atomic<int> state{};
+        std::atomic<std::uint64_t> merges{};
+        std::atomic<bool> added{};
+        K key{};
+        DeltaCell cells[COMBINE_DELTA_CELLS];
+    };
+
+    // These two are called inside an EpochGuard.
     void tryUpdateKvsHead();
-    std::atomic<KeyValueStore<K, V>*> mHeadKvs;
+    void retire(Kvs* kvs, bool wholeChain);
+    static void freeRetired(void* retired);
+
+    // Calls fn(thread, key, value) for every live entry, thread being which
+    // of the nThreads (0 for all cores) scanning threads found it.
+    void parallelForEach(
+        size_t nThreads,
+        std::function<void(size_t, K const&, V const&)> const& fn) const;
+    // The entries each of the nThreads scanning threads found.
+    std::vector<std::vector<std::pair<K, V>>> scanEntries(
+        size_t nThreads) const;
+    static void deleteChain(Kvs* kvs);
+
+    // The combined key equal to key, or nullptr if it isn't combined.
+    HotKey const* findHotKey(Lookup const& key) const;
+    void makeHot(K const& key);
+    // head's value of key plus the key's pending deltas.
+    V atWithDeltas(Kvs* head, Lookup const& key) const;
+    std::optional<V> findWithDeltas(Kvs* head, Lookup const& key) const;
+    bool containsWithDeltas(Kvs* head, Lookup const& key) const;
+    void dropDeltas(Lookup const& key);
+    void dropAllDeltas();
+    void mergeDeltas();
+    // The sum of hot's delta cells, only for addable V.
+    static V pendingDeltas(HotKey const& hot);
+    // value plus the pending deltas of key if it's combined.
+    V withDeltas(K const& key, V const& value) const;
+    // Calls fn on each combined key that's only in its delta cells, with the
+    // deltas as its value.
+    void forEachDeltaOnlyKey(
+        std::function<void(K const&, V const&)> const& fn) const;
+
+    size_t mInitialCapacity;
+    std::atomic<Kvs*> mHeadKvs;
+    // Bumped every time a kvs is retired, see Handle.
+    std::atomic<std::uint64_t> mHeadGeneration{};
+    std::shared_ptr<RetiredStats> mRetiredStats =
+        std::make_shared<RetiredStats>();
+    // Table of COMBINE_HOT_KEY_SLOTS combined keys, allocated by the first
+    // key to be combined.
+    std::atomic<HotKey*> mHotKeys{};
 };
 }  // namespace cmap
 
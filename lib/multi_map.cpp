@@ -0,0 +1,186 @@
+#include "multi_map.h"
+#include <optional>
+
+namespace cmap {
+
+typedef std::size_t size_t;
+
+namespace {
+// Low bit of a node's next link, set when the node has been erased.
+constexpr std::uintptr_t ERASED = 1;
+
+template <typename V>
+MultiMapNode<V>* toNode(std::uintptr_t link) {
+    return reinterpret_cast<MultiMapNode<V>*>(link & ~ERASED);
+}
+
+template <typename V>
+std::uintptr_t toLink(MultiMapNode<V> const* node) {
+    return reinterpret_cast<std::uintptr_t>(node);
+}
+}  // namespace
+
+template <typename K, typename V>
+ConcurrentUnorderedMultiMap<K, V>::ConcurrentUnorderedMultiMap(
+    int exp, float maxLoadRatio)
+    : mLists(exp, maxLoadRatio) {}
+
+template <typename K, typename V>
+ConcurrentUnorderedMultiMap<K, V>::~ConcurrentUnorderedMultiMap() {
+    // Erased nodes still linked in are freed here, unlinked ones have been
+    // retired.
+    for (auto const& entry : mLists.to_vector(1)) {
+        auto* node = entry.second;
+        while (node != nullptr) {
+            auto* const next = toNode<V>(node->next.load());
+            delete node;
+            node = next;
+        }
+    }
+}
+
+template <typename K, typename V>
+void ConcurrentUnorderedMultiMap<K, V>::insert(std::pair<K, V> const& val) {
+    EpochGuard guard;
+    auto* const head = list(val.first);
+    Node* node = nullptr;
+    while (true) {
+        auto const position = search(head, val.second);
+        if (position.node != nullptr && position.node->value == val.second) {
+            delete node;
+            return;
+        }
+        if (node == nullptr) node = new Node{val.second};
+        auto expected = toLink(position.node);
+        node->next.store(expected, std::memory_order_relaxed);
+        if (position.link->compare_exchange_strong(expected, toLink(node))) {
+            mSize.fetch_add(1);
+            return;
+        }
+    }
+}
+
+template <typename K, typename V>
+void ConcurrentUnorderedMultiMap<K, V>::erase(K const& key, V const& value) {
+    EpochGuard guard;
+    auto* const head = findList(key);
+    if (head == nullptr) return;
+    while (true) {
+        auto const position = search(head, value);
+        auto* const node = position.node;
+        if (node == nullptr || !(node->value == value)) return;
+        auto next = node->next.load();
+        // Another erase got there first, the next search unlinks it.
+        if (next & ERASED) continue;
+        if (!node->next.compare_exchange_strong(next, next | ERASED)) continue;
+        // Marked, so erased. Now unlink it, or leave it to a search if the
+        // link has changed in the meantime.
+        mSize.fetch_sub(1);
+        auto expected = toLink(node);
+        if (position.link->compare_exchange_strong(expected, next)) {
+            retireLater(node);
+        } else {
+            search(head, value);
+        }
+        return;
+    }
+}
+
+template <typename K, typename V>
+bool ConcurrentUnorderedMultiMap<K, V>::contains(K const& key,
+                                                 V const& value) const {
+    EpochGuard guard;
+    auto const* const head = findList(key);
+    if (head == nullptr) return false;
+    for (auto link = head->next.load(); toNode<V>(link) != nullptr;) {
+        auto const* const node = toNode<V>(link);
+        link = node->next.load();
+        if (node->value < value) continue;
+        return !(link & ERASED) && node->value == value;
+    }
+    return false;
+}
+
+template <typename K, typename V>
+size_t ConcurrentUnorderedMultiMap<K, V>::count(K const& key) const {
+    size_t n = 0;
+    equal_range(key, [&](V const&) { n++; });
+    return n;
+}
+
+template <typename K, typename V>
+void ConcurrentUnorderedMultiMap<K, V>::equal_range(
+    K const& key, std::function<void(V const&)> const& fn) const {
+    EpochGuard guard;
+    auto const* const head = findList(key);
+    if (head == nullptr) return;
+    for (auto link = head->next.load(); toNode<V>(link) != nullptr;) {
+        auto const* const node = toNode<V>(link);
+        link = node->next.load();
+        if (!(link & ERASED)) fn(node->value);
+    }
+}
+
+template <typename K, typename V>
+size_t ConcurrentUnorderedMultiMap<K, V>::size() const {
+    return mSize.load();
+}
+
+template <typename K, typename V>
+bool ConcurrentUnorderedMultiMap<K, V>::empty() const {
+    return size() == 0;
+}
+
+template <typename K, typename V>
+size_t ConcurrentUnorderedMultiMap<K, V>::bucket_count() const {
+    return mLists.bucket_count();
+}
+
+template <typename K, typename V>
+typename ConcurrentUnorderedMultiMap<K, V>::Node*
+ConcurrentUnorderedMultiMap<K, V>::findList(K const& key) const {
+    return mLists.find(key).value_or(nullptr);
+}
+
+template <typename K, typename V>
+typename ConcurrentUnorderedMultiMap<K, V>::Node*
+ConcurrentUnorderedMultiMap<K, V>::list(K const& key) {
+    if (auto* const head = findList(key)) return head;
+    // Of the threads creating the list at once only one head gets in.
+    auto* const fresh = new Node;
+    auto const [head, inserted] = mLists.try_insert({key, fresh});
+    if (!inserted) delete fresh;
+    return head;
+}
+
+template <typename K, typename V>
+typename ConcurrentUnorderedMultiMap<K, V>::Position
+ConcurrentUnorderedMultiMap<K, V>::search(Node* head, V const& value) {
+    while (true) {
+        auto* link = &head->next;
+        auto* node = toNode<V>(link->load());
+        bool restart = false;
+        while (node != nullptr) {
+            auto const next = node->next.load();
+            if (next & ERASED) {
+                // Fails if the node link belongs to has been erased too, or
+                // something went in in front of node: start over.
+                auto expected = toLink(node);
+                if (!link->compare_exchange_strong(expected, next & ~ERASED)) {
+                    restart = true;
+                    break;
+                }
+                retireLater(node);
+                node = toNode<V>(next);
+                continue;
+            }
+            if (!(node->value < value)) break;
+            link = &node->next;
+            node = toNode<V>(next);
+        }
+        if (!restart) return {link, node};
+    }
+}
+
+template class ConcurrentUnorderedMultiMap<int, int>;
+}  // namespace cmap
@@ -0,0 +1,88 @@
+#include "epoch.h"
+#include "map.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+#ifndef MULTI_MAP_H
+#define MULTI_MAP_H
+
+namespace cmap {
+
+// One value of a ConcurrentUnorderedMultiMap key. A key's values form a
+// singly linked list, sorted by value, behind a head node whose own value
+// isn't used.
+template <typename V>
+struct MultiMapNode {
+    V value{};
+    // The next node, with the low bit set once this one has been erased.
+    std::atomic<std::uintptr_t> next{};
+};
+
+// Lock-free map from a key to a set of values, e.g. a secondary index
+// from an attribute to ids. Keys go in a ConcurrentUnorderedMap, so
+// looking a key up costs what a lookup in the map does however many
+// values it has, and keys don't crowd each other's probe runs. Each key
+// points at a lock-free list of its values (Harris's, with erased nodes
+// marked before they're unlinked), so inserting, erasing or finding a
+// value walks that key's values and no others. Unlinked nodes are freed
+// through epoch.h.
+// Unlike std::unordered_multimap a pair is only stored once, inserting it
+// again does nothing. A key keeps its (empty) list once its last value is
+// erased.
+// V has to be default constructible and ordered by <.
+template <typename K, typename V>
+class ConcurrentUnorderedMultiMap {
+   public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef MultiMapNode<V> Node;
+
+    explicit ConcurrentUnorderedMultiMap(
+        int exp = 5, float maxLoadRatio = DEFAULT_MAX_LOAD_RATIO);
+    ~ConcurrentUnorderedMultiMap();
+
+    ConcurrentUnorderedMultiMap(ConcurrentUnorderedMultiMap const&) = delete;
+    ConcurrentUnorderedMultiMap& operator=(
+        ConcurrentUnorderedMultiMap const&) = delete;
+
+    void insert(std::pair<K, V> const& val);
+    void erase(K const& key, V const& value);
+    bool contains(K const& key, V const& value) const;
+    // Number of values of key, with the same caveat as equal_range.
+    std::size_t count(K const& key) const;
+    // Calls fn on every value of key, in ascending order. Values inserted
+    // or erased during the walk may or may not be visited.
+    void equal_range(K const& key,
+                     std::function<void(V const&)> const& fn) const;
+
+    // Number of (key, value) pairs.
+    std::size_t size() const;
+    bool empty() const;
+    // Of the map holding the keys.
+    std::size_t bucket_count() const;
+
+   private:
+    // A link to a node and the node it points at: where a value goes in a
+    // list.
+    struct Position {
+        std::atomic<std::uintptr_t>* link;
+        Node* node;
+    };
+
+    // The head of key's list, or nullptr if key never had a value.
+    Node* findList(K const& key) const;
+    // The head of key's list, created if need be.
+    Node* list(K const& key);
+    // The first node of the list at head whose value isn't below value,
+    // and the link to it. Unlinks the erased nodes it passes.
+    static Position search(Node* head, V const& value);
+
+    ConcurrentUnorderedMap<K, Node*> mLists;
+    std::atomic<std::size_t> mSize{};
+};
+}  // namespace cmap
+
+#endif  // MULTI_MAP_H
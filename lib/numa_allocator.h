@@ -0,0 +1,175 @@
+#include "consts.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef NUMA_ALLOCATOR_H
+#define NUMA_ALLOCATOR_H
+
+enum class NumaPolicy {
+    DEFAULT,     // Memory lands on the node of the thread that touches it.
+    INTERLEAVE,  // Large slot arrays are spread page by page over all nodes.
+};
+
+// The node ids in a sysfs node list such as "0", "0-1" or "0,2-3". Node ids
+// needn't be contiguous, so they can't be told from the count alone.
+inline std::vector<int> parseNumaNodeList(std::string const& list) {
+    std::vector<int> nodes;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        auto const range = list.substr(pos, end - pos);
+        auto const dash = range.find('-');
+        int const first = std::stoi(range.substr(0, dash));
+        int const last = dash == std::string::npos
+                             ? first
+                             : std::stoi(range.substr(dash + 1));
+        for (int node = first; node <= last; node++) nodes.push_back(node);
+        pos = end + 1;
+    }
+    return nodes;
+}
+
+// The ids of the NUMA nodes the kernel reports as online. Anything we can't
+// read or parse (non-Linux, no sysfs in a container, ...) counts as the
+// single node 0, which makes every policy fall back to default placement.
+inline std::vector<int> const& onlineNumaNodes() {
+    static std::vector<int> const nodes = [] {
+        std::vector<int> online;
+#ifdef __linux__
+        std::ifstream file("/sys/devices/system/node/online");
+        std::string list;
+        if (file >> list) {
+            try {
+                online = parseNumaNodeList(list);
+            } catch (std::logic_error const&) {
+                online.clear();
+            }
+        }
+#endif
+        if (online.empty()) online = {0};
+        return online;
+    }();
+    return nodes;
+}
+
+inline int numaNodeCount() { return onlineNumaNodes().size(); }
+
+// How many interleaved allocations the kernel refused to bind, see
+// NumaAllocator.
+inline std::atomic<std::size_t>& numaBindFailures() {
+    static std::atomic<std::size_t> failures{};
+    return failures;
+}
+
+// Binds [ptr, ptr + bytes) with mbind(MPOL_INTERLEAVE) over nodes, through
+// syscall() so there's no link time dependency on libnuma. Returns false,
+// leaving the placement as it was, if the kernel refuses: a node that isn't
+// online, or a seccomp profile that doesn't allow mbind (Docker's default).
+inline bool numaInterleave(void* ptr, std::size_t bytes,
+                           std::vector<int> const& nodes) {
+#ifdef __linux__
+    // Values from <linux/mempolicy.h>, spelled out to avoid the
+    // dependency on the numactl headers.
+    int const MPOL_INTERLEAVE_MODE = 3;
+    size_t const WORD_BITS = sizeof(unsigned long) * 8;
+    int const maxId = *std::max_element(nodes.begin(), nodes.end());
+    std::vector<unsigned long> nodeMask(maxId / WORD_BITS + 1);
+    for (int const node : nodes) {
+        nodeMask[node / WORD_BITS] |= 1UL << (node % WORD_BITS);
+    }
+    // The kernel reads one bit less than maxnode, libnuma passes the
+    // mask size + 1 too.
+    unsigned long const maxNode = nodeMask.size() * WORD_BITS + 1;
+    return syscall(SYS_mbind, ptr, bytes, MPOL_INTERLEAVE_MODE,
+                   nodeMask.data(), maxNode, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+// Allocator for the slot array of a KeyValueStore.
+// With NumaPolicy::INTERLEAVE, arrays of at least NUMA_INTERLEAVE_MIN_BYTES
+// are mapped directly and bound with mbind(MPOL_INTERLEAVE) *before* the
+// slots are constructed, so the first touch doesn't pull every page onto
+// the node of the resizing thread. If the kernel refuses the binding the
+// mapping is used as it is, with default first touch placement, and the
+// failure is counted in numaBindFailures().
+template <typename T>
+class NumaAllocator {
+   public:
+    typedef T value_type;
+
+    explicit NumaAllocator(NumaPolicy policy = NumaPolicy::DEFAULT)
+        : mPolicy(policy) {}
+
+    template <typename U>
+    NumaAllocator(NumaAllocator<U> const& other) : mPolicy(other.policy()) {}
+
+    T* allocate(std::size_t n) {
+        std::size_t const bytes = n * sizeof(T);
+        if (!mapped(bytes)) {
+            return static_cast<T*>(::operator new(bytes));
+        }
+#ifdef __linux__
+        void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) throw std::bad_alloc();
+        if (numaNodeCount() > 1 &&
+            !numaInterleave(ptr, bytes, onlineNumaNodes())) {
+            numaBindFailures()++;
+        }
+        return static_cast<T*>(ptr);
+#endif
+    }
+
+    void deallocate(T* ptr, std::size_t n) {
+        std::size_t const bytes = n * sizeof(T);
+        if (!mapped(bytes)) {
+            ::operator delete(ptr);
+            return;
+        }
+#ifdef __linux__
+        munmap(ptr, bytes);
+#endif
+    }
+
+    NumaPolicy policy() const { return mPolicy; }
+
+    template <typename U>
+    bool operator==(NumaAllocator<U> const& other) const {
+        return mPolicy == other.policy();
+    }
+    template <typename U>
+    bool operator!=(NumaAllocator<U> const& other) const {
+        return !(*this == other);
+    }
+
+   private:
+    // Needs to give the same answer in allocate and deallocate, so it can
+    // only depend on the size and the policy.
+    bool mapped(std::size_t bytes) const {
+#ifdef __linux__
+        return mPolicy == NumaPolicy::INTERLEAVE &&
+               bytes >= NUMA_INTERLEAVE_MIN_BYTES;
+#else
+        return false;
+#endif
+    }
+
+    NumaPolicy mPolicy;
+};
+
+#endif  // NUMA_ALLOCATOR_H
@@ -0,0 +1,430 @@
+#include "shared_map.h"
+#include "backoff.h"
+#include "string_key.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cmap {
+
+typedef std::size_t size_t;
+
+namespace {
+
+char const SHARED_MAP_MAGIC[8] = {'C', 'M', 'A', 'P', 'S', 'H', 'M', 'M'};
+// Bump this whenever the segment layout changes.
+std::uint32_t const SHARED_MAP_VERSION = 3;
+
+// A slot's key goes EMPTY -> CLAIMED -> ALIVE and then stays put, so a
+// probe never has to look past a slot that isn't ALIVE. A CLAIMED state
+// also holds the pid of the claiming process (see claimedBy), so that if
+// the process dies before publishing its key the slot can be taken over
+// instead of blocking inserts into it for good.
+std::uint64_t const KEY_EMPTY = 0;
+std::uint64_t const KEY_CLAIMED = 1;
+std::uint64_t const KEY_ALIVE = 2;
+
+// How many times an insert backs off on a claimed slot before it checks
+// whether the claimer is still alive.
+size_t const CLAIM_MAX_WAITS = 16;
+
+std::uint64_t claimedBy(pid_t pid) {
+    return KEY_CLAIMED | std::uint64_t(pid) << 2;
+}
+
+bool isClaimed(std::uint64_t keyState) { return keyState % 4 == KEY_CLAIMED; }
+
+// Whether the process holding the claim keyState is gone. A recycled pid
+// looks alive, the slot then waits for that process to exit.
+bool claimerDied(std::uint64_t keyState) {
+    return kill(pid_t(keyState >> 2), 0) != 0 && errno == ESRCH;
+}
+
+// Values the value offset of a slot takes besides real offsets, which
+// always point past the header.
+std::uint64_t const NO_VALUE = 0;
+std::uint64_t const TOMB_STONE_VALUE = 1;
+
+size_t const SEGMENT_ALIGNMENT = 64;
+
+size_t alignUp(size_t n) {
+    return (n + SEGMENT_ALIGNMENT - 1) / SEGMENT_ALIGNMENT * SEGMENT_ALIGNMENT;
+}
+}  // namespace
+
+// Free list entries: the index of a cell plus 1 in the low half, 0 for none.
+std::uint64_t const CELL_INDEX_MASK = 0xffffffff;
+
+// Segment layout: the Header, the slots, then the value arena, each
+// starting on a cache line. The creator sizes a fresh segment, so
+// everything not written below starts out zero: every slot is KEY_EMPTY
+// with NO_VALUE, the counters are 0 and the free list is empty.
+template <typename K, typename V, typename Hash, typename KeyEqual>
+struct SharedUnorderedMap<K, V, Hash, KeyEqual>::Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t keySize;
+    std::uint32_t valueSize;
+    std::uint32_t reserved;
+    std::uint64_t capacity;
+    std::uint64_t maxKeys;
+    std::uint64_t valueCapacity;
+    std::atomic<std::uint64_t> size;
+    // Claimed slots, keys are never given back.
+    std::atomic<std::uint64_t> keys;
+    // Cells handed out from the part of the arena never used before.
+    std::atomic<std::uint64_t> values;
+    // Top of the stack of freed cells, a CELL_INDEX_MASK entry with a count
+    // of pushes above it, so a CAS doesn't mistake a cell that's been
+    // popped and pushed again meanwhile for an unchanged top.
+    std::atomic<std::uint64_t> freeCells;
+
+    static size_t slotsOffset() { return alignUp(sizeof(Header)); }
+    static size_t arenaOffset(size_t capacity) {
+        return alignUp(slotsOffset() + capacity * sizeof(Slot));
+    }
+    static size_t segmentSize(size_t capacity, size_t valueCapacity) {
+        return arenaOffset(capacity) + valueCapacity * sizeof(Cell);
+    }
+};
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+struct SharedUnorderedMap<K, V, Hash, KeyEqual>::Slot {
+    std::atomic<std::uint64_t> keyState;
+    K key;
+    std::atomic<std::uint64_t> value;
+};
+
+// A value and the seqlock readers check it with: version is odd while the
+// value is being written.
+template <typename K, typename V, typename Hash, typename KeyEqual>
+struct SharedUnorderedMap<K, V, Hash, KeyEqual>::Cell {
+    std::atomic<std::uint64_t> version;
+    // The next entry on the free list while the cell is on it.
+    std::atomic<std::uint64_t> next;
+    V value;
+};
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+SharedUnorderedMap<K, V, Hash, KeyEqual>::SharedUnorderedMap(
+    std::string const& name, size_t capacity, float maxLoadRatio,
+    size_t valueCapacity) {
+    if (!(maxLoadRatio > 0 && maxLoadRatio <= 1)) {
+        throw std::invalid_argument("maxLoadRatio must be in (0, 1]");
+    }
+    if (capacity < 2) throw std::invalid_argument("capacity must be >= 2");
+    // Leaving one slot empty guarantees every probe ends.
+    size_t const maxKeys = std::min(
+        capacity - 1, std::max(size_t(1), size_t(capacity * maxLoadRatio)));
+    if (valueCapacity == 0) valueCapacity = 2 * maxKeys;
+    if (valueCapacity >= CELL_INDEX_MASK) {
+        throw std::invalid_argument("valueCapacity must be below 2^32 - 1");
+    }
+    size_t const bytes = Header::segmentSize(capacity, valueCapacity);
+
+    // Shrinking a segment other processes have mapped would get them a
+    // SIGBUS, so an existing one is unlinked rather than reused: whoever has
+    // it mapped keeps the old table, and we start on a fresh, zeroed object.
+    shm_unlink(name.c_str());
+    int const fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) throw std::runtime_error("Unable to create " + name);
+    if (ftruncate(fd, bytes) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Unable to size " + name);
+    }
+    map(fd, bytes);
+
+    mHeader = new (mBase) Header{};
+    mHeader->version = SHARED_MAP_VERSION;
+    mHeader->keySize = sizeof(K);
+    mHeader->valueSize = sizeof(V);
+    mHeader->capacity = capacity;
+    mHeader->maxKeys = maxKeys;
+    mHeader->valueCapacity = valueCapacity;
+    // The magic goes in last so a process attaching early doesn't take a
+    // half written header for a valid one.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(mHeader->magic, SHARED_MAP_MAGIC, sizeof(mHeader->magic));
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+SharedUnorderedMap<K, V, Hash, KeyEqual>::SharedUnorderedMap(
+    std::string const& name) {
+    int const fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) throw std::runtime_error("Unable to open " + name);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("Unable to stat " + name);
+    }
+    if (size_t(st.st_size) < sizeof(Header)) {
+        close(fd);
+        throw std::runtime_error("Not a shared map: " + name);
+    }
+    map(fd, st.st_size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (std::memcmp(mHeader->magic, SHARED_MAP_MAGIC, sizeof(mHeader->magic)) ||
+        mHeader->version != SHARED_MAP_VERSION ||
+        mHeader->keySize != sizeof(K) || mHeader->valueSize != sizeof(V) ||
+        Header::segmentSize(mHeader->capacity, mHeader->valueCapacity) !=
+            mBytes) {
+        munmap(mBase, mBytes);
+        throw std::runtime_error("Not a compatible shared map: " + name);
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+SharedUnorderedMap<K, V, Hash, KeyEqual>::~SharedUnorderedMap() {
+    munmap(mBase, mBytes);
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void SharedUnorderedMap<K, V, Hash, KeyEqual>::remove(
+    std::string const& name) {
+    shm_unlink(name.c_str());
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void SharedUnorderedMap<K, V, Hash, KeyEqual>::map(int fd, size_t bytes) {
+    void* data =
+        mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("Unable to mmap");
+    mBase = static_cast<char*>(data);
+    mBytes = bytes;
+    mHeader = reinterpret_cast<Header*>(mBase);
+    mSlots = reinterpret_cast<Slot*>(mBase + Header::slotsOffset());
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t SharedUnorderedMap<K, V, Hash, KeyEqual>::hash(K const& key) const {
+    // Same fibonacci mixing and range reduction as KeyValueStore::hash.
+    std::uint64_t const mixed = std::uint64_t(mHash(key)) * HASH_MIX_MULTIPLIER;
+    return (unsigned __int128)mixed * mHeader->capacity >> 64;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+typename SharedUnorderedMap<K, V, Hash, KeyEqual>::Slot const*
+SharedUnorderedMap<K, V, Hash, KeyEqual>::find(K const& key) const {
+    size_t const capacity = mHeader->capacity;
+    size_t idx = hash(key);
+    for (size_t probes = 0; probes < capacity; probes++) {
+        auto const& slot = mSlots[idx];
+        // A CLAIMED slot was still empty when key was inserted, if it was
+        // inserted at all, so key can't be any further along.
+        if (slot.keyState.load(std::memory_order_acquire) != KEY_ALIVE) {
+            return nullptr;
+        }
+        if (mKeyEqual(slot.key, key)) return &slot;
+        idx = idx + 1 < capacity ? idx + 1 : 0;
+    }
+    return nullptr;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+typename SharedUnorderedMap<K, V, Hash, KeyEqual>::Cell&
+SharedUnorderedMap<K, V, Hash, KeyEqual>::cellAt(std::uint64_t offset) const {
+    return *std::launder(reinterpret_cast<Cell*>(mBase + offset));
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+std::uint64_t SharedUnorderedMap<K, V, Hash, KeyEqual>::storeValue(
+    V const& value) {
+    size_t const arena = Header::arenaOffset(mHeader->capacity);
+    std::uint64_t idx;
+    auto top = mHeader->freeCells.load(std::memory_order_acquire);
+    while (true) {
+        if ((top & CELL_INDEX_MASK) == 0) {
+            idx = mHeader->values.fetch_add(1);
+            if (idx >= mHeader->valueCapacity) {
+                throw std::length_error("Shared map value arena is full");
+            }
+            break;
+        }
+        idx = (top & CELL_INDEX_MASK) - 1;
+        // next may be stale if the cell was popped meanwhile, but then top
+        // has changed and the CAS fails.
+        auto const& cell = cellAt(arena + idx * sizeof(Cell));
+        auto const next = cell.next.load(std::memory_order_relaxed);
+        if (mHeader->freeCells.compare_exchange_weak(
+                top, (top & ~CELL_INDEX_MASK) | next,
+                std::memory_order_acquire)) {
+            break;
+        }
+    }
+
+    std::uint64_t const offset = arena + idx * sizeof(Cell);
+    auto& cell = cellAt(offset);
+    auto const version = cell.version.load(std::memory_order_relaxed);
+    cell.version.store(version + 1, std::memory_order_relaxed);
+    // Readers that see any of the value must see the odd version.
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&cell.value, &value, sizeof(V));
+    cell.version.store(version + 2, std::memory_order_release);
+    return offset;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void SharedUnorderedMap<K, V, Hash, KeyEqual>::freeValue(
+    std::uint64_t offset) {
+    auto& cell = cellAt(offset);
+    std::uint64_t const entry =
+        (offset - Header::arenaOffset(mHeader->capacity)) / sizeof(Cell) + 1;
+    auto top = mHeader->freeCells.load(std::memory_order_relaxed);
+    do {
+        cell.next.store(top & CELL_INDEX_MASK, std::memory_order_relaxed);
+    } while (!mHeader->freeCells.compare_exchange_weak(
+        top, ((top >> 32) + 1) << 32 | entry, std::memory_order_release,
+        std::memory_order_relaxed));
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool SharedUnorderedMap<K, V, Hash, KeyEqual>::readValue(Slot const& slot,
+                                                         V& value) const {
+    while (true) {
+        auto const offset = slot.value.load(std::memory_order_acquire);
+        if (offset == NO_VALUE || offset == TOMB_STONE_VALUE) return false;
+        auto const& cell = cellAt(offset);
+        auto const version = cell.version.load(std::memory_order_acquire);
+        if (version % 2 == 0) {
+            std::memcpy(&value, &cell.value, sizeof(V));
+            // The copy only counts if nobody rewrote the cell meanwhile, and
+            // it's still the slot's: a cell freed and reused since holds
+            // another key's value.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (cell.version.load(std::memory_order_relaxed) == version &&
+                slot.value.load(std::memory_order_relaxed) == offset) {
+                return true;
+            }
+        }
+        cpuRelax();
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+V SharedUnorderedMap<K, V, Hash, KeyEqual>::insert(
+    std::pair<K, V> const& val) {
+    size_t const capacity = mHeader->capacity;
+    size_t idx = hash(val.first);
+    Backoff backoff(DEFAULT_BACKOFF_STRATEGY);
+    Slot* slot = nullptr;
+    for (size_t probes = 0; slot == nullptr && probes < capacity;) {
+        auto& candidate = mSlots[idx];
+        auto state = candidate.keyState.load(std::memory_order_acquire);
+        if (state == KEY_EMPTY) {
+            // Reserve the key first, so the map never fills up completely.
+            if (mHeader->keys.fetch_add(1) >= mHeader->maxKeys) {
+                mHeader->keys.fetch_sub(1);
+                throw std::length_error("Shared map is full");
+            }
+            if (candidate.keyState.compare_exchange_strong(
+                    state, claimedBy(getpid()))) {
+                candidate.key = val.first;
+                candidate.keyState.store(KEY_ALIVE, std::memory_order_release);
+                slot = &candidate;
+                break;
+            }
+            mHeader->keys.fetch_sub(1);
+        }
+        if (isClaimed(state)) {
+            // Whoever claimed it may be inserting this very key. Unless it
+            // died first, then the slot is as good as empty and we take it
+            // over, along with the key the claimer reserved.
+            if (backoff.attempts() >= CLAIM_MAX_WAITS && claimerDied(state) &&
+                candidate.keyState.compare_exchange_strong(
+                    state, claimedBy(getpid()))) {
+                candidate.key = val.first;
+                candidate.keyState.store(KEY_ALIVE, std::memory_order_release);
+                slot = &candidate;
+                break;
+            }
+            backoff.pause();
+            continue;
+        }
+        if (state == KEY_ALIVE && mKeyEqual(candidate.key, val.first)) {
+            slot = &candidate;
+            break;
+        }
+        idx = idx + 1 < capacity ? idx + 1 : 0;
+        probes++;
+    }
+    if (slot == nullptr) throw std::length_error("Shared map is full");
+
+    auto const old = slot->value.exchange(storeValue(val.second));
+    if (old == NO_VALUE || old == TOMB_STONE_VALUE) {
+        mHeader->size.fetch_add(1);
+    } else {
+        freeValue(old);
+    }
+    return val.second;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+V SharedUnorderedMap<K, V, Hash, KeyEqual>::at(K const& key) const {
+    auto const* slot = find(key);
+    V value;
+    if (slot != nullptr && readValue(*slot, value)) return value;
+    throw std::out_of_range("Unable to find key");
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool SharedUnorderedMap<K, V, Hash, KeyEqual>::contains(K const& key) const {
+    auto const* slot = find(key);
+    if (slot == nullptr) return false;
+    auto const offset = slot->value.load(std::memory_order_acquire);
+    return offset != NO_VALUE && offset != TOMB_STONE_VALUE;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+void SharedUnorderedMap<K, V, Hash, KeyEqual>::erase(K const& key) {
+    auto* slot = const_cast<Slot*>(find(key));
+    if (slot == nullptr) return;
+    auto offset = slot->value.load();
+    while (offset != NO_VALUE && offset != TOMB_STONE_VALUE) {
+        if (slot->value.compare_exchange_weak(offset, TOMB_STONE_VALUE)) {
+            mHeader->size.fetch_sub(1);
+            freeValue(offset);
+            return;
+        }
+    }
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t SharedUnorderedMap<K, V, Hash, KeyEqual>::size() const {
+    return mHeader->size;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool SharedUnorderedMap<K, V, Hash, KeyEqual>::empty() const {
+    return size() == 0;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+size_t SharedUnorderedMap<K, V, Hash, KeyEqual>::bucket_count() const {
+    return mHeader->capacity;
+}
+
+template <typename K, typename V, typename Hash, typename KeyEqual>
+bool SharedUnorderedMap<K, V, Hash, KeyEqual>::operator==(
+    std::unordered_map<K, V> const& other) const {
+    if (size() != other.size()) return false;
+    for (auto const& [key, value] : other) {
+        if (!contains(key) || !(at(key) == value)) return false;
+    }
+    return true;
+}
+
+template class SharedUnorderedMap<float, float>;
+template class SharedUnorderedMap<int, int>;
+template class SharedUnorderedMap<int, float>;
+template class SharedUnorderedMap<float, int>;
+template class SharedUnorderedMap<InlineString<23>, int>;
+}  // namespace cmap
@@ -0,0 +1,101 @@
+#include "consts.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#ifndef SHARED_MAP_H
+#define SHARED_MAP_H
+
+namespace cmap {
+
+// Fixed capacity lock-free hash map living in a POSIX shared memory object,
+// so several processes on a host can share one table instead of keeping a
+// copy each, and a restarted process attaches to the table as it is.
+// Nothing in the segment is a pointer: slots hold the key inline and the
+// offset of their value, and values live in cells of an arena at the end of
+// the segment, so every process can map it at a different address.
+// A published value is never overwritten in place: an update writes the
+// new value to a free cell and swings the slot's offset, and the old cell
+// goes back on a free list. A cell has a version counter, so a reader that
+// was still copying a cell when it got reused notices and reads again.
+// The arena holds valueCapacity values at a time, those published and
+// those being written (by default two per key).
+// There's no resizing, pick the capacity up front. Every process has to use
+// the same K, V, Hash and KeyEqual.
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename KeyEqual = std::equal_to<K>>
+class SharedUnorderedMap {
+    static_assert(std::is_trivially_copyable_v<K> &&
+                      std::is_trivially_copyable_v<V>,
+                  "Shared memory can only hold trivially copyable types");
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+                  "Process shared atomics have to be lock free");
+
+   public:
+    // Creates the shared memory object name (e.g. "/lookup-table"),
+    // replacing any existing one, with room for capacity * maxLoadRatio
+    // keys and valueCapacity values (0 means two per key). A replaced
+    // object is unlinked, not overwritten: processes attached to it keep
+    // using the old table, only those attaching from now on get this one.
+    // Throws std::runtime_error if another process creates the same name
+    // at the same time.
+    SharedUnorderedMap(std::string const& name, size_t capacity,
+                       float maxLoadRatio = DEFAULT_MAX_LOAD_RATIO,
+                       size_t valueCapacity = 0);
+    // Attaches to a map another process created. Throws std::runtime_error
+    // if there's none or it was created for different types.
+    explicit SharedUnorderedMap(std::string const& name);
+    ~SharedUnorderedMap();
+
+    SharedUnorderedMap(SharedUnorderedMap const&) = delete;
+    SharedUnorderedMap& operator=(SharedUnorderedMap const&) = delete;
+
+    // Removes the shared memory object. Processes that have it mapped keep
+    // using it until they unmap it.
+    static void remove(std::string const& name);
+
+    // Throws std::length_error when the map has no room for another key,
+    // or the arena no free cell for another value.
+    V insert(std::pair<K, V> const& val);
+    V at(K const& key) const;
+    bool contains(K const& key) const;
+    void erase(K const& key);
+
+    std::size_t size() const;
+    bool empty() const;
+    std::size_t bucket_count() const;
+
+    bool operator==(std::unordered_map<K, V> const& other) const;
+
+   private:
+    struct Header;
+    struct Slot;
+    struct Cell;
+
+    void map(int fd, std::size_t bytes);
+    std::size_t hash(K const& key) const;
+    // The slot holding key, or nullptr if key isn't in the map.
+    Slot const* find(K const& key) const;
+    Cell& cellAt(std::uint64_t offset) const;
+    // Writes value to a free cell and returns its offset.
+    std::uint64_t storeValue(V const& value);
+    // Puts the cell at offset, which no slot holds any more, on the free
+    // list.
+    void freeValue(std::uint64_t offset);
+    // Copies slot's value into value, unless it has none.
+    bool readValue(Slot const& slot, V& value) const;
+
+    char* mBase = nullptr;
+    std::size_t mBytes = 0;
+    Header* mHeader = nullptr;
+    Slot* mSlots = nullptr;
+    Hash mHash;
+    KeyEqual mKeyEqual;
+};
+}  // namespace cmap
+
+#endif  // SHARED_MAP_H
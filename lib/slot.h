@@ -1,43 +1,241 @@
 
+#include "backoff.h"
+#include "batch_descriptor.h"
+#include "concurrency_policy.h"
 #include "data_wrapper.h"
+#include "epoch.h"
+#include "key_traits.h"
+#include "string_key.h"
 #include <atomic>
+#include <cstdint>
+#include <new>
+#include <type_traits>
 
 #ifndef SLOT_H
 #define SLOT_H
 
-template <typename K, typename V>
-class Slot {
+// The value half of a Slot. value() returns a ValueRef that reads like a
+// DataWrapper<V> const* (value->state(), value->data(), ...), and casValue
+// replaces the value only if it's still the one value() returned.
+// By default every write allocates a new DataWrapper and swaps the pointer.
+// The replaced wrapper is retired rather than deleted (see epoch.h): a
+// reader may still hold it, and a writer comparing against it must not
+// find a new wrapper allocated at the same address. So slots are only
+// touched inside an EpochGuard.
+template <typename V, typename Policy,
+          bool InlineValue = StoreValueInline<V>::value>
+class SlotValue {
    public:
-    Slot() {
-        mKey.store(new DataWrapper<K>(K(), EMPTY));
-        mValue.store(new DataWrapper<V>(V(), EMPTY));
+    typedef DataWrapper<V> const* ValueRef;
+
+    SlotValue() { mValue.store(new DataWrapper<V>(V(), EMPTY)); }
+
+    ~SlotValue() { delete mValue.load(); }
+
+    // Never a batch's marker: a batch in progress is finished first.
+    ValueRef value() const {
+        while (true) {
+            auto const* value = mValue.load();
+            if (value->state() != BATCH) return value;
+            BatchDescriptor<V>::helpMarker(value);
+        }
     }
 
-    ~Slot() {
-        delete mKey.load();
-        delete mValue.load();
+    bool casValue(ValueRef expected, V const& value, DataState state) {
+        auto const* desired = new DataWrapper<V>(value, state);
+        if (casOrStore<Policy>(mValue, expected, desired)) {
+            retireLater(expected);
+            return true;
+        }
+        delete desired;
+        return false;
     }
 
-    bool casValue(DataWrapper<V> const* expected,
-                  DataWrapper<V> const* desired) {
-        auto const success = mValue.compare_exchange_strong(expected, desired);
-        if (success) delete expected;
-        return success;
+    void prefetchValue() const { __builtin_prefetch(mValue.load()); }
+
+    // The word a BatchDescriptor swaps its marker and values into.
+    typename BatchDescriptor<V>::Word* valueWord() { return &mValue; }
+
+   private:
+    std::atomic<DataWrapper<V> const*> mValue{};
+};
+
+// Value stored in the slot itself with StoreValueInline, guarded by a
+// seqlock: mVersion is odd while a writer is changing the value. A writer
+// takes the lock by CASing the version it read the value at to the next
+// odd one, so, like the pointer CAS, it fails if anybody wrote since.
+// Readers copy the value and state and only keep the copy if the version
+// was even and didn't change meanwhile. They never write, but they do
+// spin while a writer is half way through.
+template <typename V, typename Policy>
+class SlotValue<V, Policy, true> {
+    static_assert(std::is_trivially_copyable_v<V>,
+                  "Only trivially copyable values can be stored inline");
+
+   public:
+    // A consistent copy of the value and the version it was read at.
+    class ValueRef {
+       public:
+        ValueRef(std::uint64_t version, V const& data, DataState state)
+            : mVersion(version), mData(data, state) {}
+
+        DataWrapper<V> const* operator->() const { return &mData; }
+
+       private:
+        friend class SlotValue;
+        std::uint64_t mVersion;
+        DataWrapper<V> mData;
+    };
+
+    ValueRef value() const {
+        while (true) {
+            auto const version = mVersion.load(std::memory_order_acquire);
+            if (version % 2 == 0) {
+                V const data = mData;
+                DataState const state = mState;
+                // The copies above may have raced with a writer, they're
+                // only good if the version is still the same.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (mVersion.load(std::memory_order_relaxed) == version) {
+                    return ValueRef(version, data, state);
+                }
+            }
+            cpuRelax();
+        }
+    }
+
+    bool casValue(ValueRef const& expected, V const& value,
+                  DataState state) {
+        if (!lockValue(expected)) return false;
+        unlockValue(expected, value, state);
+        return true;
+    }
+
+    // casValue in two halves, for writers that need several slots at once
+    // (KeyValueStore::applyBatch). Between them the version is odd, so
+    // readers and other writers of the slot wait.
+    bool lockValue(ValueRef const& expected) {
+        auto const version = expected.mVersion;
+        return casOrStore<Policy>(mVersion, version, version + 1);
+    }
+
+    void unlockValue(ValueRef const& locked, V const& value,
+                     DataState state) {
+        // Readers that see any of the writes below must see the odd version.
+        std::atomic_thread_fence(std::memory_order_release);
+        mData = value;
+        mState = state;
+        mVersion.store(locked.mVersion + 2, std::memory_order_release);
     }
 
+    void prefetchValue() const { __builtin_prefetch(&mData); }
+
+   private:
+    std::atomic<std::uint64_t> mVersion{};
+    DataState mState = EMPTY;
+    V mData{};
+};
+
+template <typename K, typename V, typename Policy = MultiWriter,
+          bool InlineKey = StoreKeyInline<K>::value>
+class Slot : public SlotValue<V, Policy> {
+   public:
+    Slot() { mKey.store(new DataWrapper<K>(K(), EMPTY)); }
+
+    ~Slot() { delete mKey.load(); }
+
     bool casKey(DataWrapper<K> const* expected, DataWrapper<K> const* desired) {
-        bool const success = mKey.compare_exchange_strong(expected, desired);
-        if (success) delete expected;
+        bool const success = casOrStore<Policy>(mKey, expected, desired);
+        // Retired like replaced values, see SlotValue.
+        if (success) retireLater(expected);
         return success;
     }
 
-    DataWrapper<K> const* key() const { return mKey.load(); }
+    // Try to put key into the slot, expected being the EMPTY key we saw.
+    bool claimKey(DataWrapper<K> const* expected, K const& key) {
+        auto const* desired = new DataWrapper<K>(key, ALIVE);
+        if (casKey(expected, desired)) return true;
+        delete desired;
+        return false;
+    }
 
-    DataWrapper<V> const* value() const { return mValue.load(); }
+    // Try to mark the EMPTY key expected as copied to the next kvs.
+    bool markKeyCopied(DataWrapper<K> const* expected) {
+        auto const* marker = new DataWrapper<K>(K(), COPIED_DEAD);
+        if (casKey(expected, marker)) return true;
+        delete marker;
+        return false;
+    }
+
+    DataWrapper<K> const* key() const { return mKey.load(); }
 
    private:
     std::atomic<DataWrapper<K> const*> mKey{};
-    std::atomic<DataWrapper<V> const*> mValue{};
+};
+
+// Slot for keys with StoreKeyInline. The key ends up in mKeyStorage,
+// inside the slot, and mKey points either at it or at one of the marker
+// keys shared by all slots, so reading a key stays within the slot's cache
+// line. The key can't be written into the slot with a single CAS, and a
+// thread must never be left waiting for another to finish writing it. So
+// it's published the way Slot publishes heap keys, by CASing in a wrapper
+// built up front, and then the thread that published it copies it into
+// mKeyStorage and points mKey there. Until it gets round to that readers
+// just follow the pointer to the heap copy, which is retired afterwards.
+template <typename K, typename V, typename Policy>
+class Slot<K, V, Policy, true> : public SlotValue<V, Policy> {
+    static_assert(std::is_trivially_copyable_v<K>,
+                  "Only trivially copyable keys can be stored inline");
+
+   public:
+    Slot() = default;
+
+    // A thread that published a key always moves it in before leaving its
+    // EpochGuard, but don't leak it if it didn't.
+    ~Slot() {
+        auto const* key = mKey.load();
+        if (key != storage() && !isMarker(key)) delete key;
+    }
+
+    bool claimKey(DataWrapper<K> const* expected, K const& key) {
+        auto const* published = new DataWrapper<K>(key, ALIVE);
+        if (!casOrStore<Policy>(mKey, expected, published)) {
+            delete published;
+            return false;
+        }
+        // Nobody else writes the key of a slot that isn't empty, so the
+        // storage is ours and a plain store will do.
+        new (mKeyStorage) DataWrapper<K>(key, ALIVE);
+        mKey.store(storage());
+        retireLater(published);
+        return true;
+    }
+
+    // Try to mark the EMPTY key expected as copied to the next kvs.
+    bool markKeyCopied(DataWrapper<K> const* expected) {
+        return casOrStore<Policy>(mKey, expected, marker(COPIED_DEAD));
+    }
+
+    DataWrapper<K> const* key() const { return mKey.load(); }
+
+   private:
+    static DataWrapper<K> const* marker(DataState state) {
+        static DataWrapper<K> const empty(K(), EMPTY);
+        static DataWrapper<K> const copied(K(), COPIED_DEAD);
+        if (state == COPIED_DEAD) return &copied;
+        return &empty;
+    }
+
+    static bool isMarker(DataWrapper<K> const* key) {
+        return key == marker(EMPTY) || key == marker(COPIED_DEAD);
+    }
+
+    DataWrapper<K> const* storage() const {
+        return reinterpret_cast<DataWrapper<K> const*>(mKeyStorage);
+    }
+
+    std::atomic<DataWrapper<K> const*> mKey{marker(EMPTY)};
+    alignas(DataWrapper<K>) unsigned char mKeyStorage[sizeof(DataWrapper<K>)];
 };
 
 #endif // SLOT_H
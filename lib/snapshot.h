@@ -0,0 +1,27 @@
+#include <cstddef>
+#include <cstdint>
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// On disk layout of a snapshot written by ConcurrentUnorderedMap::save:
+// a SnapshotHeader followed by `count` records, each record being the raw
+// bytes of the key followed by the raw bytes of the value (no padding).
+// Only trivially copyable keys and values can be snapshotted, and the file
+// is only readable on a machine with the same endianness.
+char const SNAPSHOT_MAGIC[8] = {'C', 'M', 'A', 'P', 'S', 'N', 'A', 'P'};
+// Bump this whenever the layout below changes.
+std::uint32_t const SNAPSHOT_VERSION = 1;
+// save() batches records into a buffer of this size before writing.
+std::size_t const SNAPSHOT_WRITE_BUFFER_SIZE = 1 << 20;
+
+struct SnapshotHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t keySize;
+    std::uint32_t valueSize;
+    std::uint32_t reserved;
+    std::uint64_t count;
+};
+
+#endif  // SNAPSHOT_H
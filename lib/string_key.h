@@ -0,0 +1,90 @@
+#include "key_traits.h"
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifndef STRING_KEY_H
+#define STRING_KEY_H
+
+// Fixed capacity string that keeps its characters inside the object, so
+// it's trivially copyable and is stored inline in the slot (see
+// StoreKeyInline below). Use it as the key type for short string keys to
+// save the key allocation, the string's own heap buffer and the pointer
+// chase to it on every probe.
+template <std::size_t N>
+class InlineString {
+    static_assert(N < 256, "The length has to fit in a byte");
+
+   public:
+    InlineString() = default;
+    // Throws std::length_error for strings longer than N.
+    InlineString(std::string_view str) : mSize(str.size()) {
+        if (str.size() > N) {
+            throw std::length_error("String too long for InlineString");
+        }
+        str.copy(mData, str.size());
+    }
+    InlineString(char const* str) : InlineString(std::string_view(str)) {}
+    InlineString(std::string const& str)
+        : InlineString(std::string_view(str)) {}
+
+    operator std::string_view() const { return {mData, mSize}; }
+    std::size_t size() const { return mSize; }
+
+    bool operator==(InlineString const& other) const {
+        return std::string_view(*this) == std::string_view(other);
+    }
+    bool operator!=(InlineString const& other) const {
+        return !(*this == other);
+    }
+    // Same order as the strings, see ConcurrentUnorderedMap::to_sorted_vector.
+    bool operator<(InlineString const& other) const {
+        return std::string_view(*this) < std::string_view(other);
+    }
+
+   private:
+    char mData[N] = {};
+    unsigned char mSize = 0;
+};
+
+// Transparent hash and equality for string keys, a map using them takes
+// std::string_view (or anything that converts to it) for lookups.
+struct StringHash {
+    typedef void is_transparent;
+    std::size_t operator()(std::string_view str) const {
+        return std::hash<std::string_view>()(str);
+    }
+};
+
+struct StringEqual {
+    typedef void is_transparent;
+    bool operator()(std::string_view lhs, std::string_view rhs) const {
+        return lhs == rhs;
+    }
+};
+
+template <>
+struct KeyView<std::string> {
+    typedef std::string_view type;
+};
+
+template <std::size_t N>
+struct KeyView<InlineString<N>> {
+    typedef std::string_view type;
+};
+
+template <std::size_t N>
+struct StoreKeyInline<InlineString<N>> : std::true_type {};
+
+namespace std {
+template <std::size_t N>
+struct hash<InlineString<N>> {
+    std::size_t operator()(InlineString<N> const& str) const {
+        return StringHash()(str);
+    }
+};
+}  // namespace std
+
+#endif  // STRING_KEY_H
@@ -1,13 +1,31 @@
 #include "gtest/gtest.h"
+#include "cuckoo_map.h"
 #include "map.h"
+#include "multi_map.h"
+#include "shared_map.h"
+#include "snapshot.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <optional>
 #include <random>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace cmap;
 
@@ -33,7 +51,7 @@ std::unordered_map<int, int> createRandomMap(int const n) {
         }
         auto const value = dist(rng);
         map.insert({key, value});
-        if (map.size() == n) {
+        if (map.size() == size_t(n)) {
             return map;
         }
     }
@@ -151,6 +169,950 @@ TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_Erase) {
     EXPECT_THROW(cmap.at(10), std::out_of_range);
 }
 
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_EraseIf) {
+    ConcurrentUnorderedMap<int, int> cmap;
+    auto map = createRandomMap(1000);
+    insertMapIntoConcurrentMap(map, cmap);
+
+    auto const isEven = [](int const& key, int const&) { return key % 2 == 0; };
+    size_t expectedErased = 0;
+    for (auto it = map.begin(); it != map.end();) {
+        if (isEven(it->first, it->second)) {
+            it = map.erase(it);
+            expectedErased++;
+        } else {
+            it++;
+        }
+    }
+    EXPECT_EQ(cmap.erase_if(isEven), expectedErased);
+    EXPECT_EQ(cmap, map);
+    EXPECT_EQ(cmap.erase_if(isEven), 0);
+
+    // Keep only the entries with a value below 50000, on 4 threads.
+    auto const small = [](int const&, int const& value) {
+        return value < 50000;
+    };
+    for (auto it = map.begin(); it != map.end();) {
+        it = small(it->first, it->second) ? std::next(it) : map.erase(it);
+    }
+    cmap.retain(small, 4);
+    EXPECT_EQ(cmap, map);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_ClearAndExchange) {
+    ConcurrentUnorderedMap<int, int> cmap;
+    auto const startingBucketCount = cmap.bucket_count();
+    auto const map = createRandomMap(startingBucketCount * 4);
+    insertMapIntoConcurrentMap(map, cmap);
+
+    cmap.clear();
+    EXPECT_TRUE(cmap.empty());
+    EXPECT_EQ(cmap.bucket_count(), startingBucketCount);
+    EXPECT_EQ(cmap.depth(), 0);
+    EXPECT_THROW(cmap.at(map.begin()->first), std::out_of_range);
+    cmap.insert({1, 2});
+    EXPECT_EQ(cmap.at(1), 2);
+
+    ConcurrentUnorderedMap<int, int> replacement;
+    insertMapIntoConcurrentMap(map, replacement);
+    cmap.exchange(replacement);
+    EXPECT_EQ(cmap, map);
+    EXPECT_TRUE(replacement.empty());
+
+    replacement.insert({1, 2});
+    cmap.swap(replacement);
+    EXPECT_EQ(replacement, map);
+    EXPECT_EQ(cmap, (std::unordered_map<int, int>{{1, 2}}));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_GrowthFactor) {
+    KvsConfig config;
+    config.maxLoadRatio = 0.75;
+    config.growthFactor = 1.5;
+    ConcurrentUnorderedMap<int, int> cmap(100, config);
+    EXPECT_EQ(cmap.bucket_count(), 100);
+
+    auto const map = createRandomMap(1000);
+    insertMapIntoConcurrentMap(map, cmap);
+    EXPECT_EQ(cmap, map);
+    // 100 -> 150 -> 225 -> 337 -> 505 -> 757 -> 1135 -> 1702, the first
+    // one with room for 1000 entries at a load of 0.75.
+    EXPECT_EQ(cmap.bucket_count(), 1702);
+
+    config.growthFactor = 1;
+    EXPECT_THROW((ConcurrentUnorderedMap<int, int>(100, config)),
+                 std::invalid_argument);
+    EXPECT_THROW((ConcurrentUnorderedMap<int, int>(5, 0)),
+                 std::invalid_argument);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_FullLoadAfterErase) {
+    // An erased key keeps its slot, so at a load ratio of 1 the live count
+    // stays under the limit while every slot is taken. The inserts after
+    // the erase must still find their way into a resized kvs.
+    ConcurrentUnorderedMap<int, int> cmap(5, 1.0f);
+    for (int key = 0; key < 31; key++) cmap.insert({key, key});
+    cmap.erase(0);
+    cmap.insert({1000, 1000});
+    cmap.insert({1001, 1001});
+    EXPECT_EQ(cmap.size(), 32u);
+    EXPECT_EQ(cmap.at(1000), 1000);
+    EXPECT_EQ(cmap.at(1001), 1001);
+    EXPECT_FALSE(cmap.contains(0));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_Handle) {
+    ConcurrentUnorderedMap<int, int> cmap;
+    auto handle = cmap.handle();
+    auto const map = createRandomMap(cmap.bucket_count() * 4);
+    for (auto const& pair : map) handle.insert(pair);
+    EXPECT_EQ(cmap, map);
+    EXPECT_GT(handle.stats().headRefreshes, 0);
+
+    for (auto const& pair : map) EXPECT_EQ(handle.at(pair.first), pair.second);
+    EXPECT_FALSE(handle.contains(0));
+    handle.erase(map.begin()->first);
+    EXPECT_FALSE(handle.contains(map.begin()->first));
+    EXPECT_EQ(handle.stats().inserts, map.size());
+    EXPECT_EQ(handle.stats().lookups, map.size() + 2);
+    EXPECT_EQ(handle.stats().misses, 2);
+    EXPECT_EQ(handle.stats().erases, 1);
+
+    // The handle has to notice its cached head being retired.
+    cmap.clear();
+    EXPECT_FALSE(handle.contains(std::next(map.begin())->first));
+    handle.insert({1, 2});
+    EXPECT_EQ(cmap.at(1), 2);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_NumaInterleave) {
+    // On a single node machine the interleave policy should quietly fall
+    // back to default placement, so this needs to pass everywhere.
+    EXPECT_GE(numaNodeCount(), 1);
+    // Online nodes can have gaps, the mbind mask must only hold real ids.
+    EXPECT_EQ(parseNumaNodeList("0,2-3"), (std::vector<int>{0, 2, 3}));
+    EXPECT_EQ(parseNumaNodeList("1"), (std::vector<int>{1}));
+
+    // 2**17 slots is big enough for the slot array to be mmap'd and bound.
+    ConcurrentUnorderedMap<int, int> cmap(17, DEFAULT_MAX_LOAD_RATIO,
+                                          NumaPolicy::INTERLEAVE);
+    // Push it through a resize to check the policy is passed on to the new
+    // kvs.
+    auto const map = createRandomMap(cmap.bucket_count() / 2 + 1);
+    insertMapIntoConcurrentMap(map, cmap);
+    EXPECT_EQ(cmap.bucket_count(), 1 << 18);
+    EXPECT_EQ(cmap, map);
+
+    KvsConfig config;
+    config.numaPolicy = NumaPolicy::INTERLEAVE;
+    KeyValueStore<int, int> kvs(1 << 17, config);
+    for (int key = 0; key <= 1 << 16; key++) kvs.insert({key, key});
+    ASSERT_NE(kvs.nextKvs(), nullptr);
+    EXPECT_EQ(kvs.nextKvs()->config().numaPolicy, NumaPolicy::INTERLEAVE);
+
+    // A binding the kernel refuses, here to a node that isn't online,
+    // leaves the mapping as it was for the allocator to hand out anyway.
+    size_t const bytes = NUMA_INTERLEAVE_MIN_BYTES;
+    void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(ptr, MAP_FAILED);
+    EXPECT_FALSE(numaInterleave(ptr, bytes, {onlineNumaNodes().back() + 1}));
+    std::memset(ptr, 1, bytes);
+    EXPECT_EQ(static_cast<char*>(ptr)[bytes - 1], 1);
+    munmap(ptr, bytes);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_SaveAndLoad) {
+    auto const path = testing::TempDir() + "cmap_snapshot.bin";
+    // Same setup as Test_CopyDoesnNotOverrideNewValues so the snapshot is
+    // taken part way through a resize.
+    ConcurrentUnorderedMap<int, int> cmap(9, 0.5);
+    auto map = createRandomMap(256);
+    insertMapIntoConcurrentMap(map, cmap);
+    cmap.insert({0, 0});
+    map[0] = 0;
+    ASSERT_EQ(cmap.depth(), 1);
+    // Overwrite some values so they live in both kvs.
+    int idx = 0;
+    for (auto& pair : map) {
+        if (idx++ % 2) continue;
+        pair.second = -idx;
+        cmap.insert(pair);
+    }
+    // Erased entries shouldn't make it into the snapshot.
+    auto const erased = map.begin()->first;
+    cmap.erase(erased);
+    map.erase(erased);
+    cmap.save(path);
+
+    // Load into a map that already holds something to check it's replaced.
+    ConcurrentUnorderedMap<int, int> loaded;
+    loaded.insert({-1, -1});
+    auto handle = loaded.handle();
+    EXPECT_TRUE(handle.contains(-1));
+    loaded.load(path);
+    EXPECT_EQ(loaded, map);
+    EXPECT_EQ(loaded.depth(), 0);
+    EXPECT_THROW(loaded.at(erased), std::out_of_range);
+    // The handle's head was replaced by the load, it must not read it.
+    EXPECT_FALSE(handle.contains(-1));
+    EXPECT_EQ(handle.at(map.begin()->first), map.begin()->second);
+    std::remove(path.c_str());
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_LoadInvalidSnapshot) {
+    auto const path = testing::TempDir() + "cmap_snapshot.bin";
+    ConcurrentUnorderedMap<int, int> cmap;
+    cmap.insert({1, 1});
+    cmap.save(path);
+
+    // Chop the last record in half.
+    std::ifstream in(path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    in.close();
+    std::ofstream(path, std::ios::binary | std::ios::trunc)
+        .write(contents.data(), contents.size() - 2);
+    EXPECT_THROW(cmap.load(path), std::runtime_error);
+    EXPECT_THROW(cmap.load(path + ".missing"), std::runtime_error);
+
+    // A count whose records would wrap round to exactly the one record
+    // that's there.
+    SnapshotHeader header;
+    std::memcpy(&header, contents.data(), sizeof(header));
+    header.count = 1 + (std::uint64_t(1) << 61);
+    std::memcpy(contents.data(), &header, sizeof(header));
+    std::ofstream(path, std::ios::binary | std::ios::trunc)
+        .write(contents.data(), contents.size());
+    EXPECT_THROW(cmap.load(path), std::runtime_error);
+    // A failed load leaves the map as it was.
+    EXPECT_EQ(cmap.at(1), 1);
+    // Keys that can't be written as raw bytes.
+    ConcurrentUnorderedMap<std::vector<bool>, float> vectorMap;
+    EXPECT_THROW(vectorMap.save(path), std::logic_error);
+    std::remove(path.c_str());
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_FreezeAndThaw) {
+    ConcurrentUnorderedMap<int, int> cmap;
+    auto const map = createRandomMap(1000);
+    insertMapIntoConcurrentMap(map, cmap);
+
+    auto const frozen = cmap.freeze();
+    EXPECT_EQ(frozen.size(), map.size());
+    EXPECT_EQ(frozen, map);
+    EXPECT_THROW(frozen.at(0), std::out_of_range);
+    EXPECT_FALSE(frozen.contains(0));
+
+    auto const thawed = frozen.thaw();
+    EXPECT_EQ(*thawed, map);
+    // thaw should size the map up front instead of resizing.
+    EXPECT_EQ(thawed->depth(), 0);
+    thawed->insert({0, 0});
+    EXPECT_EQ(thawed->at(0), 0);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_FreezeStridedKeys) {
+    // Integer keys hash to themselves, so without mixing these would all
+    // share a tag and one probe run.
+    std::vector<std::pair<int, int>> entries;
+    for (int i = 0; i < 4096; i++) entries.push_back({i << 12, i});
+    FrozenUnorderedMap<int, int> const frozen(entries);
+    for (auto const& [key, value] : entries) EXPECT_EQ(frozen.at(key), value);
+    EXPECT_FALSE(frozen.contains(1));
+    EXPECT_FALSE(frozen.contains(4096 << 12));
+
+    EXPECT_THROW((FrozenUnorderedMap<int, int>(entries, 0)),
+                 std::invalid_argument);
+    EXPECT_THROW((FrozenUnorderedMap<int, int>(entries, 1.5)),
+                 std::invalid_argument);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_FreezeVectorKey) {
+    ConcurrentUnorderedMap<std::vector<bool>, float> cmap;
+    cmap.insert({{true, false}, 10.0});
+    cmap.insert({{false}, 5.0});
+    auto const frozen = cmap.freeze();
+    EXPECT_EQ(frozen.at({true, false}), 10.0);
+    EXPECT_EQ(frozen.at({false}), 5.0);
+    EXPECT_FALSE(frozen.contains({true}));
+    EXPECT_TRUE((FrozenUnorderedMap<int, int>({}).empty()));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_SingleWriter) {
+    ConcurrentUnorderedMap<int, int, SingleWriter> cmap;
+    auto const startingBucketCount = cmap.bucket_count();
+    auto map = createRandomMap(startingBucketCount * 4);
+    for (auto const& pair : map) cmap.insert(pair);
+    EXPECT_EQ(cmap.bucket_count(), startingBucketCount * 8);
+    EXPECT_EQ(cmap, map);
+
+    auto const erased = map.begin()->first;
+    cmap.erase(erased);
+    map.erase(erased);
+    EXPECT_EQ(cmap, map);
+    EXPECT_THROW(cmap.at(erased), std::out_of_range);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_StringViewLookup) {
+    ConcurrentUnorderedMap<std::string, int, MultiWriter, StringHash,
+                           StringEqual>
+        cmap;
+    std::unordered_map<std::string, int> map;
+    for (int i = 0; i < 100; i++) {
+        map.insert({"key" + std::to_string(i), i});
+        cmap.insert({"key" + std::to_string(i), i});
+    }
+    EXPECT_EQ(cmap, map);
+
+    std::string_view const key = "key42";
+    EXPECT_EQ(cmap.at(key), 42);
+    EXPECT_EQ(cmap.find(key), 42);
+    EXPECT_TRUE(cmap.contains(key));
+    cmap.erase(key);
+    EXPECT_FALSE(cmap.contains(key));
+    EXPECT_FALSE(cmap.find(key).has_value());
+    EXPECT_THROW(cmap.at(key), std::out_of_range);
+    EXPECT_EQ(cmap.size(), 99);
+
+    // Frozen and thawed again the map keeps its transparent hashing.
+    std::string_view const other = "key7";
+    auto const frozen = cmap.freeze();
+    EXPECT_EQ(frozen.at(other), 7);
+    EXPECT_FALSE(frozen.contains(key));
+    auto const thawed = frozen.thaw();
+    EXPECT_EQ(thawed->at(other), 7);
+    EXPECT_FALSE(thawed->contains(key));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_InlineStringKey) {
+    ConcurrentUnorderedMap<InlineString<23>, int, MultiWriter, StringHash,
+                           StringEqual>
+        cmap;
+    auto const startingBucketCount = cmap.bucket_count();
+    for (int i = 0; i < int(startingBucketCount) * 4; i++) {
+        cmap.insert({"key" + std::to_string(i), i});
+    }
+    EXPECT_EQ(cmap.bucket_count(), startingBucketCount * 8);
+    EXPECT_EQ(cmap.size(), startingBucketCount * 4);
+    for (int i = 0; i < int(startingBucketCount) * 4; i++) {
+        EXPECT_EQ(cmap.at("key" + std::to_string(i)), i);
+    }
+    EXPECT_FALSE(cmap.contains("missing"));
+
+    auto const frozen = cmap.freeze();
+    EXPECT_EQ(frozen.at("key7"), 7);
+
+    EXPECT_THROW(InlineString<23>("this key is much too long to fit"),
+                 std::length_error);
+}
+
+#ifdef CMAP_ENABLE_COROUTINES
+LookupTask asyncFindInto(ConcurrentUnorderedMap<int, int> const& cmap,
+                         int const key, std::optional<int>& result) {
+    result = co_await cmap.async_find(key);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_AsyncFind) {
+    ConcurrentUnorderedMap<int, int> cmap;
+    auto const map = createRandomMap(1000);
+    insertMapIntoConcurrentMap(map, cmap);
+
+    std::vector<int> keys;
+    for (auto const& pair : map) keys.push_back(pair.first);
+    // createRandomMap never picks 0 or negative keys.
+    keys.push_back(0);
+    keys.push_back(-1);
+
+    std::vector<std::optional<int>> results(keys.size());
+    LookupScheduler scheduler;
+    for (size_t i = 0; i < keys.size(); i++) {
+        scheduler.spawn(asyncFindInto(cmap, keys[i], results[i]));
+    }
+    scheduler.run();
+
+    for (size_t i = 0; i < map.size(); i++) {
+        EXPECT_EQ(results[i], map.at(keys[i]));
+    }
+    EXPECT_FALSE(results[map.size()].has_value());
+    EXPECT_FALSE(results[map.size() + 1].has_value());
+}
+#endif
+
+// A shared memory name no other test run is using.
+std::string sharedMapName() {
+    return "/cmap_test_" + std::to_string(getpid());
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_SharedMap) {
+    auto const name = sharedMapName();
+    auto const map = createRandomMap(1000);
+    SharedUnorderedMap<int, int> created(name, 4096);
+    for (auto const& pair : map) created.insert(pair);
+    EXPECT_EQ(created, map);
+    EXPECT_EQ(created.bucket_count(), 4096);
+
+    // A second mapping, as another process would have, sees the same table
+    // and its updates show up in the first.
+    SharedUnorderedMap<int, int> attached(name);
+    EXPECT_EQ(attached, map);
+    auto const key = map.begin()->first;
+    attached.insert({key, -1});
+    EXPECT_EQ(created.at(key), -1);
+    attached.erase(key);
+    EXPECT_FALSE(created.contains(key));
+    EXPECT_THROW(created.at(key), std::out_of_range);
+    EXPECT_EQ(created.size(), map.size() - 1);
+    created.insert({key, 1});
+    EXPECT_EQ(attached.at(key), 1);
+
+    // Creating the map again leaves processes attached to the old one with
+    // the old table, instead of pulling it from under them.
+    {
+        SharedUnorderedMap<int, int> recreated(name, 64);
+        EXPECT_TRUE(recreated.empty());
+        EXPECT_EQ(attached.at(key), 1);
+        EXPECT_EQ(attached.size(), map.size());
+        SharedUnorderedMap<int, int> reattached(name);
+        EXPECT_EQ(reattached.bucket_count(), 64);
+    }
+
+    // Attaching with other types, or to nothing, fails.
+    typedef SharedUnorderedMap<InlineString<23>, int> WrongMap;
+    EXPECT_THROW(WrongMap{name}, std::runtime_error);
+    typedef SharedUnorderedMap<int, int> IntMap;
+    IntMap::remove(name);
+    EXPECT_THROW(IntMap{name}, std::runtime_error);
+    // Mapped tables outlive the name.
+    EXPECT_EQ(attached.at(key), 1);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_SharedMapDeadClaimer) {
+    // A process that dies between claiming a slot and publishing its key
+    // mustn't block the slot for good. Fake one by rewriting the slot of a
+    // key as claimed by a process that has exited.
+    pid_t const dead = fork();
+    ASSERT_GE(dead, 0);
+    if (dead == 0) _exit(0);
+    waitpid(dead, nullptr, 0);
+
+    auto const name = sharedMapName();
+    SharedUnorderedMap<int, int> cmap(name, 16);
+    cmap.insert({7, 7});
+    int const fd = shm_open(name.c_str(), O_RDWR, 0);
+    SharedUnorderedMap<int, int>::remove(name);
+    ASSERT_GE(fd, 0);
+    struct stat st;
+    ASSERT_EQ(fstat(fd, &st), 0);
+    auto* segment = static_cast<char*>(
+        mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    close(fd);
+    ASSERT_NE(segment, MAP_FAILED);
+    // A slot starts with its 64 bit key state, ALIVE being 2, then the key.
+    bool rewritten = false;
+    for (off_t offset = 0; offset + 12 <= st.st_size; offset += 8) {
+        std::uint64_t state;
+        int key;
+        std::memcpy(&state, segment + offset, sizeof(state));
+        std::memcpy(&key, segment + offset + 8, sizeof(key));
+        if (state == 2 && key == 7) {
+            // CLAIMED is 1, with the claimer's pid above the two state bits.
+            state = 1 | std::uint64_t(dead) << 2;
+            std::memcpy(segment + offset, &state, sizeof(state));
+            rewritten = true;
+            break;
+        }
+    }
+    munmap(segment, st.st_size);
+    ASSERT_TRUE(rewritten);
+
+    EXPECT_FALSE(cmap.contains(7));
+    cmap.insert({7, 8});
+    EXPECT_EQ(cmap.at(7), 8);
+    EXPECT_EQ(cmap.size(), 1);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_SharedMapFull) {
+    auto const name = sharedMapName();
+    SharedUnorderedMap<int, int> cmap(name, 16, 0.5, 10);
+    SharedUnorderedMap<int, int>::remove(name);
+    for (int i = 0; i < 8; i++) cmap.insert({i, i});
+    EXPECT_THROW(cmap.insert({8, 8}), std::length_error);
+    // Existing keys can still be updated, as often as we like: every update
+    // gives the cell of the value it replaces back.
+    for (int i = 0; i < 104; i++) cmap.insert({i % 8, i});
+    for (int i = 0; i < 8; i++) EXPECT_EQ(cmap.at(i), 96 + i);
+    EXPECT_EQ(cmap.size(), 8);
+
+    // With a cell per key there's none left to write an update to before
+    // the old one is given back, until a key is erased.
+    auto const tightName = name + "_tight";
+    SharedUnorderedMap<int, int> tight(tightName, 16, 0.5, 8);
+    SharedUnorderedMap<int, int>::remove(tightName);
+    for (int i = 0; i < 8; i++) tight.insert({i, i});
+    EXPECT_THROW(tight.insert({0, 10}), std::length_error);
+    EXPECT_EQ(tight.at(0), 0);
+    tight.erase(7);
+    tight.insert({0, 10});
+    EXPECT_EQ(tight.at(0), 10);
+    EXPECT_EQ(tight.size(), 7);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_FindDuringResize) {
+    // Stop inserting half way through a copy, so keys are spread over both
+    // kvs, some of them rewritten in the next one before being copied.
+    EpochGuard guard;
+    KeyValueStore<int, int> kvs(64, KvsConfig());
+    int key = 0;
+    for (; kvs.nextKvs() == nullptr; key++) kvs.insert({key, key});
+    ASSERT_FALSE(kvs.copied());
+    kvs.insert({0, -1});
+    std::unordered_map<int, int> map;
+    for (int k = 0; k < key; k++) map[k] = k;
+    map[0] = -1;
+
+    for (auto const& [k, v] : map) {
+        EXPECT_EQ(kvs.find(k), std::optional<int>(v));
+    }
+    EXPECT_EQ(kvs.find(-1), std::nullopt);
+    EXPECT_FALSE(kvs.contains(-1));
+
+    // Every key once, with its newest value.
+    std::unordered_map<int, int> visited;
+    for (auto* k = &kvs; k != nullptr; k = k->nextKvs()) {
+        k->forEach(0, k->capacity(), [&](int const& k, int const& v) {
+            EXPECT_TRUE(visited.emplace(k, v).second);
+        });
+    }
+    EXPECT_EQ(visited, map);
+    delete kvs.nextKvs();
+}
+
+// An insert in two halves, to stall it between claiming its key and
+// writing its value.
+struct KvsTestAccess {
+    template <typename K, typename V>
+    static Slot<K, V>* claimKey(KeyValueStore<K, V>& kvs, K const& key) {
+        return kvs.insertKey(key);
+    }
+
+    template <typename K, typename V>
+    static V writeValue(KeyValueStore<K, V>& kvs, Slot<K, V>* slot,
+                        V const& value) {
+        return kvs.insertValue(slot, value, ALIVE);
+    }
+};
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_StalledInsertResize) {
+    // An inserter stalls after claiming its key, and a resize copies the
+    // kvs meanwhile. Readers stop waiting for the value, the copy marks it
+    // copied instead of waiting forever, and the inserter, once it wakes
+    // up, follows the marker to the next kvs.
+    EpochGuard guard;
+    KeyValueStore<int, int> kvs(16, KvsConfig());
+    auto* const slot = KvsTestAccess::claimKey(kvs, 7);
+    ASSERT_NE(slot, nullptr);
+    EXPECT_EQ(slot->value()->state(), EMPTY);
+    EXPECT_THROW(kvs.at(7), std::out_of_range);
+    EXPECT_FALSE(kvs.contains(7));
+
+    int others = 0;
+    for (int key = 100; !kvs.copied(); key++) {
+        ASSERT_LT(others, 100);
+        kvs.insert({key, key});
+        others++;
+    }
+    ASSERT_NE(kvs.nextKvs(), nullptr);
+    ASSERT_EQ(kvs.nextKvs()->nextKvs(), nullptr);
+    EXPECT_EQ(slot->value()->state(), COPIED_EMPTY);
+    // The claim was counted and the copy took it off again.
+    EXPECT_EQ(kvs.size(), others);
+    EXPECT_THROW(kvs.at(7), std::out_of_range);
+
+    EXPECT_EQ(KvsTestAccess::writeValue(kvs, slot, 70), 70);
+    EXPECT_EQ(kvs.at(7), 70);
+    EXPECT_EQ(kvs.nextKvs()->at(7), 70);
+    EXPECT_EQ(kvs.size(), others + 1);
+    delete kvs.nextKvs();
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_TryInsert) {
+    ConcurrentUnorderedMap<int, int> cmap(3);
+    for (int key = 0; key < 100; key++) {
+        EXPECT_EQ(cmap.try_insert({key, key}), std::make_pair(key, true));
+    }
+    EXPECT_EQ(cmap.try_insert({7, -1}), std::make_pair(7, false));
+    EXPECT_EQ(cmap.at(7), 7);
+    cmap.erase(7);
+    EXPECT_EQ(cmap.try_insert({7, -1}), std::make_pair(-1, true));
+    EXPECT_EQ(cmap.at(7), -1);
+    EXPECT_EQ(cmap.size(), 100);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_MultiMap) {
+    // Small enough to resize a few times.
+    ConcurrentUnorderedMultiMap<int, int> index(3);
+    for (int key = 0; key < 100; key++) {
+        for (int id = 0; id < key % 7; id++) {
+            index.insert({key, key * 100 + id});
+        }
+    }
+    index.insert({1, 100});
+    EXPECT_EQ(index.size(), 295);
+    EXPECT_GT(index.bucket_count(), 8);
+
+    for (int key = 0; key < 100; key++) {
+        EXPECT_EQ(index.count(key), key % 7);
+        std::unordered_set<int> ids;
+        index.equal_range(key, [&](int id) { ids.insert(id); });
+        EXPECT_EQ(ids.size(), key % 7);
+        for (auto const id : ids) EXPECT_EQ(id / 100, key);
+    }
+    EXPECT_EQ(index.count(100), 0);
+
+    index.erase(6, 601);
+    index.erase(6, 601);
+    index.erase(6, 1234);
+    EXPECT_FALSE(index.contains(6, 601));
+    EXPECT_TRUE(index.contains(6, 600));
+    EXPECT_EQ(index.count(6), 5);
+    EXPECT_EQ(index.size(), 294);
+    index.insert({6, 601});
+    EXPECT_EQ(index.count(6), 6);
+
+    // A key with many values doesn't get in the way of its neighbours, and
+    // its values come out in order.
+    for (int id = 5000; id > 0; id--) index.insert({1000, id});
+    EXPECT_EQ(index.count(1000), 5000);
+    int last = 0;
+    index.equal_range(1000, [&](int id) { EXPECT_EQ(id, ++last); });
+    for (int key = 1001; key < 1010; key++) index.insert({key, key});
+    for (int key = 1001; key < 1010; key++) {
+        EXPECT_EQ(index.count(key), 1);
+        EXPECT_TRUE(index.contains(key, key));
+    }
+    EXPECT_TRUE(index.contains(1000, 2500));
+    EXPECT_FALSE(index.contains(1000, 5001));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_Cuckoo) {
+    CuckooUnorderedMap<int, int> cmap(16);
+    EXPECT_TRUE(cmap.empty());
+    EXPECT_THROW(cmap.at(1), std::out_of_range);
+
+    // Fill the table up to its first grow.
+    auto const startingBucketCount = cmap.bucket_count();
+    std::unordered_map<int, int> map;
+    for (int key = 0; cmap.bucket_count() == startingBucketCount; key++) {
+        EXPECT_LE(map.size(), startingBucketCount);
+        map[key] = key * 2;
+        cmap.insert({key, key * 2});
+    }
+    // Cuckoo moves fill the table almost completely before it has to grow.
+    EXPECT_GE(map.size() - 1, startingBucketCount * 9 / 10);
+    EXPECT_EQ(cmap, map);
+
+    auto const more = createRandomMap(10000);
+    for (auto const& pair : more) {
+        map[pair.first] = pair.second;
+        cmap.insert(pair);
+    }
+    EXPECT_EQ(cmap, map);
+    EXPECT_GE(cmap.size(), cmap.bucket_count() * 4 / 10);
+
+    for (int key = 0; key < 100; key++) {
+        cmap.erase(key);
+        map.erase(key);
+    }
+    cmap.erase(-1);
+    EXPECT_EQ(cmap, map);
+    EXPECT_FALSE(cmap.contains(0));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_CuckooLoadFactor) {
+    // Buckets of at least 4 entries let the table fill to 90% without
+    // growing.
+    EXPECT_GE((CuckooUnorderedMap<int, int>::SLOTS_PER_BUCKET), 4u);
+    CuckooUnorderedMap<int, int> ints(1 << 14);
+    auto const intSlots = ints.bucket_count();
+    for (size_t key = 0; key < intSlots * 9 / 10; key++) {
+        ints.insert({int(key), int(key)});
+    }
+    EXPECT_EQ(ints.bucket_count(), intSlots);
+    EXPECT_EQ(ints.size(), intSlots * 9 / 10);
+}
+
+// A 64 byte record with every feature set to x.
+std::array<float, 16> record(float x) {
+    std::array<float, 16> features;
+    features.fill(x);
+    return features;
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_InlineValue) {
+    typedef std::array<float, 16> Features;
+    static_assert(StoreValueInline<Features>::value);
+    static_assert(!StoreValueInline<std::array<float, 2>>::value);
+    static_assert(!StoreValueInline<int>::value);
+
+    // Small enough to resize a few times.
+    ConcurrentUnorderedMap<int, Features> cmap(3);
+    std::unordered_map<int, Features> map;
+    for (int key = 0; key < 1000; key++) {
+        map[key] = record(key);
+        cmap.insert({key, record(key)});
+    }
+    EXPECT_EQ(cmap, map);
+    for (int key = 0; key < 1000; key += 2) {
+        map[key] = record(-key);
+        cmap.insert({key, record(-key)});
+    }
+    for (int key = 0; key < 1000; key += 3) {
+        map.erase(key);
+        cmap.erase(key);
+    }
+    EXPECT_EQ(cmap, map);
+    EXPECT_THROW(cmap.at(0), std::out_of_range);
+    cmap.insert({0, record(1)});
+    EXPECT_EQ(cmap.at(0), record(1));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_Add) {
+    // Small enough to resize a few times.
+    ConcurrentUnorderedMap<int, int> cmap(3);
+    std::unordered_map<int, int> map;
+    for (int n = 0; n < 3; n++) {
+        for (int key = 0; key < 1000; key++) {
+            map[key] += key;
+            cmap.add(key, key);
+        }
+    }
+    EXPECT_EQ(cmap, map);
+    cmap.erase(7);
+    cmap.add(7, -1);
+    EXPECT_EQ(cmap.at(7), -1);
+
+    ConcurrentUnorderedMap<int, float> floats;
+    floats.add(1, 0.5f);
+    floats.add(1, 0.25f);
+    EXPECT_EQ(floats.at(1), 0.75f);
+
+    ConcurrentUnorderedMap<int, std::array<float, 16>> records;
+    EXPECT_THROW(records.add(1, record(1)), std::logic_error);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_AddCombined) {
+    KvsConfig config;
+    // Every key that's added to is combined right away.
+    config.hotKeyCasFailures = 0;
+    ConcurrentUnorderedMap<int, int> cmap(8, config);
+    cmap.add(1, 5);
+    EXPECT_EQ(cmap.at(1), 5);
+    // From here on the adds only go to the delta cells.
+    cmap.add(1, 2);
+    cmap.add(2, 3);
+    EXPECT_EQ(cmap.at(1), 7);
+    EXPECT_EQ(cmap.at(2), 3);
+    EXPECT_EQ(cmap, (std::unordered_map<int, int>{{1, 7}, {2, 3}}));
+
+    // insert and erase replace what was added before.
+    cmap.insert({1, 10});
+    EXPECT_EQ(cmap.at(1), 10);
+    cmap.add(1, 1);
+    cmap.erase(1);
+    EXPECT_FALSE(cmap.contains(1));
+    EXPECT_THROW(cmap.at(1), std::out_of_range);
+    // A combined key that isn't stored exists once it's added to.
+    cmap.add(1, 1);
+    EXPECT_TRUE(cmap.contains(1));
+    EXPECT_EQ(cmap.at(1), 1);
+    // The exports add the deltas without merging them.
+    auto const expected = std::unordered_map<int, int>{{1, 1}, {2, 3}};
+    EXPECT_EQ(cmap.to_unordered_map(), expected);
+    EXPECT_EQ(cmap, expected);
+
+    cmap.merge_deltas();
+    EXPECT_EQ(cmap.at(1), 1);
+    EXPECT_EQ(cmap.at(2), 3);
+
+    // Even when its deltas cancel out, like an add to a key that isn't
+    // combined.
+    cmap.erase(2);
+    cmap.add(2, 1);
+    cmap.add(2, -1);
+    EXPECT_TRUE(cmap.contains(2));
+    EXPECT_EQ(cmap.at(2), 0);
+    EXPECT_EQ(cmap.to_unordered_map(),
+              (std::unordered_map<int, int>{{1, 1}, {2, 0}}));
+    cmap.merge_deltas();
+    EXPECT_EQ(cmap.at(2), 0);
+    cmap.clear();
+    EXPECT_TRUE(cmap.empty());
+    EXPECT_FALSE(cmap.contains(2));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_MissFilter) {
+    KvsConfig config;
+    config.missFilter = true;
+    // Small enough to resize a few times.
+    ConcurrentUnorderedMap<int, int> cmap(8, config);
+    auto map = createRandomMap(1000);
+    insertMapIntoConcurrentMap(map, cmap);
+    EXPECT_EQ(cmap, map);
+    for (int key = 0; key < 1000; key++) {
+        if (map.count(key) == 0) {
+            EXPECT_FALSE(cmap.contains(key));
+        }
+    }
+    auto const erased = map.begin()->first;
+    cmap.erase(erased);
+    map.erase(erased);
+    EXPECT_THROW(cmap.at(erased), std::out_of_range);
+    EXPECT_EQ(cmap, map);
+
+    // No false negatives, and few false positives.
+    KeyValueStore<int, int> kvs(1 << 14, config);
+    for (int key = 0; key < 1 << 13; key++) kvs.insert({key, key});
+    size_t falsePositives = 0;
+    for (int key = 0; key < 1 << 13; key++) {
+        EXPECT_TRUE(kvs.mayContain(key));
+        falsePositives += kvs.mayContain(key + (1 << 13));
+    }
+    EXPECT_LT(falsePositives, (1 << 13) / 100);
+
+    KeyValueStore<int, int> unfiltered(64, KvsConfig());
+    EXPECT_TRUE(unfiltered.mayContain(1));
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_AtomicBatch) {
+    typedef BatchOp<int, int> Op;
+    // Small enough for the batches to resize it.
+    ConcurrentUnorderedMap<int, int> cmap(3);
+    std::vector<Op> inserts;
+    for (int key = 0; key < 100; key++) {
+        inserts.push_back({BatchOpType::INSERT, key, key});
+    }
+    EXPECT_TRUE(cmap.atomic_batch(inserts));
+    std::unordered_map<int, int> map;
+    for (int key = 0; key < 100; key++) map[key] = key;
+    EXPECT_EQ(cmap, map);
+
+    // Moves the value of 1 to 200.
+    EXPECT_TRUE(cmap.atomic_batch(
+        {{BatchOpType::ERASE, 1, 0, 1}, {BatchOpType::INSERT, 200, 1}}));
+    EXPECT_FALSE(cmap.contains(1));
+    EXPECT_EQ(cmap.at(200), 1);
+    // A stale expected value stops the whole batch, new keys included.
+    EXPECT_FALSE(cmap.atomic_batch(
+        {{BatchOpType::INSERT, 300, 1}, {BatchOpType::INSERT, 2, 5, 3}}));
+    EXPECT_FALSE(cmap.contains(300));
+    EXPECT_EQ(cmap.at(2), 2);
+    EXPECT_FALSE(cmap.atomic_batch({{BatchOpType::ERASE, 1, 0, 1}}));
+
+    // The last op on a key wins.
+    EXPECT_TRUE(cmap.atomic_batch({{BatchOpType::INSERT, 3, 30},
+                                   {BatchOpType::ERASE, 3},
+                                   {BatchOpType::INSERT, 3, 31, 3}}));
+    EXPECT_EQ(cmap.at(3), 31);
+    // Bringing back an erased key counts it again.
+    EXPECT_TRUE(cmap.atomic_batch({{BatchOpType::INSERT, 1, 1}}));
+    EXPECT_EQ(cmap.size(), 101);
+
+    // Inline values are written under the slot locks instead of the
+    // multi-word CAS.
+    ConcurrentUnorderedMap<int, std::array<float, 16>> records(3);
+    std::vector<BatchOp<int, std::array<float, 16>>> recordInserts;
+    for (int key = 0; key < 100; key++) {
+        recordInserts.push_back({BatchOpType::INSERT, key, record(key)});
+    }
+    EXPECT_TRUE(records.atomic_batch(recordInserts));
+    EXPECT_EQ(records.size(), 100);
+    EXPECT_TRUE(records.atomic_batch({{BatchOpType::ERASE, 1, {}, record(1)},
+                                      {BatchOpType::INSERT, 200, record(1)}}));
+    EXPECT_FALSE(records.contains(1));
+    EXPECT_EQ(records.at(200), record(1));
+    EXPECT_FALSE(records.atomic_batch(
+        {{BatchOpType::INSERT, 300, record(1)},
+         {BatchOpType::INSERT, 2, record(5), record(3)}}));
+    EXPECT_FALSE(records.contains(300));
+    EXPECT_EQ(records.at(2), record(2));
+    EXPECT_TRUE(records.atomic_batch({{BatchOpType::INSERT, 3, record(30)},
+                                      {BatchOpType::ERASE, 3},
+                                      {BatchOpType::INSERT, 1, record(-1)}}));
+    EXPECT_FALSE(records.contains(3));
+    EXPECT_EQ(records.at(1), record(-1));
+    EXPECT_EQ(records.size(), 100);
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_Export) {
+    // Enough slots for the scan to be split into several chunks.
+    ConcurrentUnorderedMap<int, int> cmap(3);
+    auto map = createRandomMap(100000);
+    insertMapIntoConcurrentMap(map, cmap);
+    std::vector<std::pair<int, int>> sorted(map.begin(), map.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    for (size_t nThreads : {1, 3, 4}) {
+        EXPECT_EQ(cmap.to_sorted_vector(nThreads), sorted);
+        auto entries = cmap.to_vector(nThreads);
+        std::sort(entries.begin(), entries.end());
+        EXPECT_EQ(entries, sorted);
+        EXPECT_EQ(cmap.to_unordered_map(nThreads), map);
+    }
+
+    EXPECT_EQ(cmap, map);
+    auto const key = sorted.front().first;
+    map[key]++;
+    EXPECT_FALSE(cmap == map);
+    map[key]--;
+    map[-1] = 0;
+    EXPECT_FALSE(cmap == map);
+    map.erase(-1);
+    map.erase(key);
+    EXPECT_FALSE(cmap == map);
+
+    ConcurrentUnorderedMap<InlineString<23>, int> strings;
+    for (auto const* str : {"pear", "apple", "fig"}) strings.insert({str, 0});
+    auto const names = strings.to_sorted_vector();
+    ASSERT_EQ(names.size(), 3);
+    EXPECT_EQ(std::string_view(names[0].first), "apple");
+    EXPECT_EQ(std::string_view(names[2].first), "pear");
+}
+
+TEST(TestConcurrentUnorderedHashMap_SingleThread, Test_ResizeStats) {
+    ConcurrentUnorderedMap<int, int> cmap;
+    auto stats = cmap.resize_stats();
+    EXPECT_EQ(stats.resizes, 0);
+    EXPECT_EQ(stats.retiredKvs, 0);
+
+    insertMapIntoConcurrentMap(createRandomMap(10000), cmap);
+    stats = cmap.resize_stats();
+    EXPECT_GT(stats.resizes, 0);
+    EXPECT_GT(stats.maxCopyNanos, 0);
+    EXPECT_GE(stats.totalCopyNanos, stats.maxCopyNanos);
+    EXPECT_EQ(stats.copying, cmap.depth());
+    // Every finished copy lets the head move on and retire the old kvs,
+    // which is freed by a later resize once nobody can be in it.
+    EXPECT_LE(stats.retiredKvs, stats.resizes);
+
+    // A guard holds up the chain the clear retires.
+    {
+        EpochGuard guard;
+        cmap.clear();
+        auto const cleared = cmap.resize_stats();
+        EXPECT_GT(cleared.retiredKvs, stats.retiredKvs);
+        EXPECT_GT(cleared.retainedBytes, stats.retainedBytes);
+    }
+    // With no thread in a guard the next clear frees it all, and the
+    // resizes it went through are still counted.
+    cmap.clear();
+    auto const cleared = cmap.resize_stats();
+    EXPECT_EQ(cleared.retiredKvs, 0);
+    EXPECT_EQ(cleared.retainedBytes, 0);
+    EXPECT_EQ(cleared.resizes, stats.resizes);
+    EXPECT_EQ(cleared.maxCopyNanos, stats.maxCopyNanos);
+}
+
 void threadedMapInsert(ConcurrentUnorderedMap<int, int>& cmap,
                        std::unordered_map<int, int> const& map,
                        int const nThreads) {
@@ -207,7 +1169,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_Size) {
     ConcurrentUnorderedMap<int, int> cmap;
     auto const map = createRandomMap(4);
 
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         threadedMapInsert(cmap, map, THREAD_INTENSITY);
         EXPECT_EQ(4, cmap.size());
     }
@@ -219,14 +1181,14 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_InsertAndAt1) {
     ConcurrentUnorderedMap<int, int> cmap;
     auto const map = createRandomMap(4);
 
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         threadedMapInsert(cmap, map, THREAD_INTENSITY);
         EXPECT_EQ(cmap, map);
     }
 }
 
 TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_Resize) {
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         ConcurrentUnorderedMap<int, int> cmap;
         auto const startingBucketCount = cmap.bucket_count();
         // Make sure we pick a factor here higher than the load factor!
@@ -248,7 +1210,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_DoubleResize) {
     // We don't want to test resize here so make the number of elements here
     // less than the starting capacity of the cmap.
 
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         ConcurrentUnorderedMap<int, int> cmap;
         auto const startingBucketCount = cmap.bucket_count();
         // The +1 will trigger a second resize with load factor threshold 0.5.
@@ -269,7 +1231,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_MaxLoadRatio) {
     // less than the starting capacity of the cmap.
 
     // TODO: Under high repeition this test will fail.
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         ConcurrentUnorderedMap<int, int> cmap(5, 1.0);
 
         auto const startingBucketCount = cmap.bucket_count() * 0.75;
@@ -299,7 +1261,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_StragglerInsertOnOldKvs) {
     // some logic to break out of the insert and either allocate a new kvs
     // yourself or use one another thread has allocated.
 
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         // Set the resize ratio to 1.0 so that at the point of the resize the
         // current is full, allowing us to check that a thread will detect
         // this, break out of it reprobe loop and use the new larger kvs.
@@ -323,7 +1285,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread,
     // This was causing a data race where the copy was colliding
     // with inserts into the old table.
 
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         ConcurrentUnorderedMap<int, int> cmap(7, 0.3);
         auto m = createRandomMap(16 * 16);
         auto map = threadedMapInsertMapPerThread(cmap, m, 16);
@@ -339,7 +1301,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread,
     // after the new values are inserted and we need to detect that and drop the
     // copy.
 
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         // cmap will have 2**9=512 slots to start:
         ConcurrentUnorderedMap<int, int> cmap(9, 0.5);
         // Insert 256 values which is exactly 1 short of triggering a resize.
@@ -376,7 +1338,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread,
 }
 
 TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_Erase) {
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         // We don't want to test resize here so make the number of elements here
         // (4)
         // less than the starting capacity of the cmap.
@@ -395,7 +1357,7 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_Erase) {
 }
 
 TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_EraseDuringResize) {
-    for (int i = 0; i < REPEATS; i++) {
+    for (size_t i = 0; i < REPEATS; i++) {
         ConcurrentUnorderedMap<int, int> cmap(9, 0.5);
         auto map = createRandomMap(256);
         threadedMapInsertMapPerThread(cmap, map, 16);
@@ -419,6 +1381,728 @@ TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_EraseDuringResize) {
     }
 }
 
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_SingleWriterReaders) {
+    // One writer inserts while the other threads keep reading the keys it
+    // inserted up front. The readers must always find them.
+    for (size_t i = 0; i < REPEATS / 10; i++) {
+        ConcurrentUnorderedMap<int, int, SingleWriter> cmap(10);
+        auto const initial = createRandomMap(100);
+        for (auto const& pair : initial) cmap.insert(pair);
+
+        std::atomic<bool> done = false;
+        std::vector<std::thread> readers;
+        std::atomic<size_t> misses = 0;
+        for (size_t t = 0; t < THREAD_INTENSITY - 1; t++) {
+            readers.emplace_back([&]() {
+                while (!done) {
+                    for (auto const& pair : initial) {
+                        if (cmap.at(pair.first) != pair.second) misses++;
+                    }
+                }
+            });
+        }
+        // Negative keys can't clash with the ones from createRandomMap.
+        for (int key = -1; key > -300; key--) cmap.insert({key, key});
+        done = true;
+        for (auto& t : readers) t.join();
+
+        EXPECT_EQ(misses, 0);
+        EXPECT_EQ(cmap.size(), 100 + 299);
+        EXPECT_EQ(cmap.at(-299), -299);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread,
+     Test_SingleWriterHandleReaders) {
+    // Test_SingleWriterReaders with a Handle per reader. The writer's
+    // inserts resize the map over and over, and the readers' Handles race
+    // it and each other to promote the copied head, which only one of them
+    // may retire. A few readers are enough for that race, more only starve
+    // the writer.
+    for (size_t i = 0; i < REPEATS / 10; i++) {
+        ConcurrentUnorderedMap<int, int, SingleWriter> cmap(3);
+        auto const initial = createRandomMap(100);
+        for (auto const& pair : initial) cmap.insert(pair);
+
+        std::atomic<bool> done = false;
+        std::vector<std::thread> readers;
+        std::atomic<size_t> misses = 0;
+        for (size_t t = 0; t < 4; t++) {
+            readers.emplace_back([&]() {
+                auto handle = cmap.handle();
+                while (!done) {
+                    for (auto const& pair : initial) {
+                        if (handle.at(pair.first) != pair.second) misses++;
+                    }
+                }
+            });
+        }
+        for (int key = -1; key > -3000; key--) cmap.insert({key, key});
+        done = true;
+        for (auto& t : readers) t.join();
+
+        EXPECT_EQ(misses, 0);
+        EXPECT_EQ(cmap.size(), 100 + 2999);
+        EXPECT_EQ(cmap.at(-2999), -2999);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_SingleWriterLoad) {
+    // load() inserts from several threads, which a SingleWriter kvs can't
+    // take: racing plain stores would drop keys and miscount the size.
+    auto const path = testing::TempDir() + "cmap_single_writer.bin";
+    auto const map = createRandomMap(100000);
+    ConcurrentUnorderedMap<int, int, SingleWriter> saved;
+    for (auto const& pair : map) saved.insert(pair);
+    saved.save(path);
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMap<int, int, SingleWriter> loaded;
+        loaded.load(path);
+        EXPECT_EQ(loaded.size(), map.size());
+        EXPECT_EQ(loaded, map);
+    }
+    std::remove(path.c_str());
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_BackoffStrategies) {
+    // Same as Test_DoubleResize, with every thread fighting over the same
+    // keys, for each of the backoff strategies.
+    for (auto const strategy :
+         {BackoffStrategy::NONE, BackoffStrategy::PAUSE,
+          BackoffStrategy::EXPONENTIAL, BackoffStrategy::YIELD}) {
+        for (size_t i = 0; i < REPEATS / 10; i++) {
+            ConcurrentUnorderedMap<int, int> cmap(5, DEFAULT_MAX_LOAD_RATIO,
+                                                  NumaPolicy::DEFAULT,
+                                                  strategy);
+            auto const startingBucketCount = cmap.bucket_count();
+            auto const map = createRandomMap(startingBucketCount + 1);
+
+            threadedMapInsert(cmap, map, THREAD_INTENSITY);
+            EXPECT_EQ(cmap.bucket_count(), startingBucketCount * 4);
+            EXPECT_EQ(cmap, map);
+        }
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_EraseIfDuringResize) {
+    // Sweep out the even keys while other threads insert enough negative
+    // keys to resize the map twice. The predicate never matches the new
+    // keys, so nothing else may go missing. An even key that's being moved
+    // by the resize can be missed though, which the second sweep fixes.
+    for (size_t i = 0; i < REPEATS / 10; i++) {
+        ConcurrentUnorderedMap<int, int> cmap;
+        auto map = createRandomMap(cmap.bucket_count() / 4);
+        insertMapIntoConcurrentMap(map, cmap);
+        std::unordered_map<int, int> newKeys;
+        for (int key = -1; key >= -int(cmap.bucket_count()); key--) {
+            newKeys.insert({key, key});
+        }
+
+        std::vector<std::thread> threads;
+        for (auto const& subMap : divideMap(newKeys, 4)) {
+            threads.emplace_back([&cmap, subMap]() {
+                for (auto const& pair : subMap) cmap.insert(pair);
+            });
+        }
+        auto const isEven = [](int const& key, int const&) {
+            return key > 0 && key % 2 == 0;
+        };
+        cmap.erase_if(isEven);
+        for (auto& t : threads) t.join();
+
+        for (auto it = map.begin(); it != map.end();) {
+            it = it->first % 2 == 0 ? map.erase(it) : std::next(it);
+        }
+        map.insert(newKeys.begin(), newKeys.end());
+        for (auto const& pair : map) {
+            EXPECT_EQ(cmap.at(pair.first), pair.second);
+        }
+        cmap.erase_if(isEven);
+        EXPECT_EQ(cmap, map);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_ExchangeUnderReaders) {
+    // Readers keep looking up every key while the map is refreshed with
+    // new versions of the data. Every lookup must find the key, with the
+    // value of some version.
+    auto const initial = createRandomMap(100);
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMap<int, int> cmap;
+        for (auto const& pair : initial) cmap.insert({pair.first, 0});
+
+        std::atomic<bool> done = false;
+        std::atomic<size_t> misses = 0;
+        std::vector<std::thread> readers;
+        for (size_t t = 0; t < THREAD_INTENSITY - 1; t++) {
+            readers.emplace_back([&]() {
+                while (!done) {
+                    for (auto const& pair : initial) {
+                        try {
+                            if (cmap.at(pair.first) % 1000 != 0) misses++;
+                        } catch (std::out_of_range const&) {
+                            misses++;
+                        }
+                    }
+                }
+            });
+        }
+        for (int version = 1; version <= 20; version++) {
+            ConcurrentUnorderedMap<int, int> replacement;
+            for (auto const& pair : initial) {
+                replacement.insert({pair.first, version * 1000});
+            }
+            cmap.exchange(replacement);
+        }
+        done = true;
+        for (auto& t : readers) t.join();
+
+        EXPECT_EQ(misses, 0);
+        EXPECT_EQ(cmap.at(initial.begin()->first), 20000);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_ClearReclaims) {
+    // Clearing over and over while readers are in the map must not pile up
+    // retired chains: each is freed once the readers have moved on.
+    auto const map = createRandomMap(10000);
+    ConcurrentUnorderedMap<int, int> cmap;
+    insertMapIntoConcurrentMap(map, cmap);
+    size_t chainBytes;
+    {
+        // Nothing is freed while we're in a guard, so this is what one
+        // filled up chain holds.
+        EpochGuard guard;
+        cmap.clear();
+        chainBytes = cmap.resize_stats().retainedBytes;
+    }
+    ASSERT_GT(chainBytes, 0);
+
+    std::atomic<bool> done = false;
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < THREAD_INTENSITY - 1; t++) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                for (auto const& pair : map) cmap.contains(pair.first);
+            }
+        });
+    }
+    size_t maxRetainedBytes = 0;
+    for (int round = 0; round < 50; round++) {
+        insertMapIntoConcurrentMap(map, cmap);
+        cmap.clear();
+        maxRetainedBytes =
+            std::max(maxRetainedBytes, cmap.resize_stats().retainedBytes);
+    }
+    done = true;
+    for (auto& t : readers) t.join();
+
+    // A reader's guard only lasts one lookup, so at most the last couple
+    // of chains can still be waiting for one.
+    EXPECT_LE(maxRetainedBytes, 3 * chainBytes);
+    cmap.clear();
+    EXPECT_EQ(cmap.resize_stats().retainedBytes, 0);
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_GrowthFactor) {
+    // Resizes with capacities that aren't multiples of COPY_CHUNK_SIZE, so
+    // the last copy batch is a short one.
+    KvsConfig config;
+    config.growthFactor = 1.5;
+    for (size_t i = 0; i < REPEATS / 10; i++) {
+        ConcurrentUnorderedMap<int, int> cmap(37, config);
+        auto const map = createRandomMap(200);
+        threadedMapInsert(cmap, map, THREAD_INTENSITY);
+        EXPECT_EQ(cmap, map);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_Handles) {
+    // Same as Test_DoubleResize, with a Handle per thread.
+    for (size_t i = 0; i < REPEATS / 10; i++) {
+        ConcurrentUnorderedMap<int, int> cmap;
+        auto const startingBucketCount = cmap.bucket_count();
+        auto const map = createRandomMap(startingBucketCount + 1);
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            threads.emplace_back([&]() {
+                auto handle = cmap.handle();
+                for (auto const& pair : map) handle.insert(pair);
+                for (auto const& pair : map) {
+                    EXPECT_EQ(handle.at(pair.first), pair.second);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+
+        EXPECT_EQ(cmap.bucket_count(), startingBucketCount * 4);
+        EXPECT_EQ(cmap, map);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_InlineStringKey) {
+    // Inline keys are published on the heap and then moved into their
+    // slot, so resize while all threads race to insert the same keys.
+    for (size_t i = 0; i < REPEATS / 10; i++) {
+        ConcurrentUnorderedMap<InlineString<23>, int> cmap;
+        auto const startingBucketCount = cmap.bucket_count();
+        auto const map = createRandomMap(startingBucketCount + 1);
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            threads.emplace_back([&]() {
+                for (auto const& pair : map) {
+                    cmap.insert({std::to_string(pair.first), pair.second});
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+
+        EXPECT_EQ(cmap.size(), map.size());
+        for (auto const& pair : map) {
+            EXPECT_EQ(cmap.at(std::to_string(pair.first)), pair.second);
+        }
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_TryInsert) {
+    // Every thread tries to put its own value in the same keys while the
+    // map resizes, exactly one of them gets each key.
+    int const nKeys = 1000;
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMap<int, int> cmap(3);
+        std::vector<std::vector<int>> won(THREAD_INTENSITY);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            threads.emplace_back([&, t]() {
+                for (int key = 0; key < nKeys; key++) {
+                    auto const result = cmap.try_insert({key, t});
+                    if (result.second) won[t].push_back(key);
+                    EXPECT_EQ(cmap.at(key), result.first);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+
+        size_t wins = 0;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            wins += won[t].size();
+            for (auto const key : won[t]) EXPECT_EQ(cmap.at(key), t);
+        }
+        EXPECT_EQ(wins, nKeys);
+        EXPECT_EQ(cmap.size(), nKeys);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_MultiMap) {
+    // Every thread adds its own ids to the same keys while the map resizes,
+    // and erases some of them again.
+    int const nKeys = 100;
+    int const idsPerThread = 20;
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMultiMap<int, int> index;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            threads.emplace_back([&, t]() {
+                for (int id = 0; id < idsPerThread; id++) {
+                    for (int key = 0; key < nKeys; key++) {
+                        index.insert({key, t * idsPerThread + id});
+                    }
+                }
+                for (int key = 0; key < nKeys; key++) {
+                    index.erase(key, t * idsPerThread);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+
+        size_t const idsPerKey = THREAD_INTENSITY * (idsPerThread - 1);
+        EXPECT_EQ(index.size(), nKeys * idsPerKey);
+        for (int key = 0; key < nKeys; key++) {
+            EXPECT_EQ(index.count(key), idsPerKey);
+        }
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_Cuckoo) {
+    // Writers insert, update and erase their own keys while the table grows
+    // from tiny, and readers check they never see a value that wasn't
+    // written.
+    int const keysPerThread = 2000;
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        CuckooUnorderedMap<int, int> cmap(16);
+        std::atomic<bool> done{};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.emplace_back([&]() {
+                int key = 0;
+                while (!done) {
+                    key = (key + 7919) % (THREAD_INTENSITY * keysPerThread);
+                    if (!cmap.contains(key)) continue;
+                    try {
+                        auto const value = cmap.at(key);
+                        EXPECT_TRUE(value == key || value == -key);
+                    } catch (std::out_of_range const&) {
+                        // Erased in between.
+                    }
+                }
+            });
+        }
+        std::vector<std::thread> writers;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            writers.emplace_back([&, t]() {
+                int const first = t * keysPerThread;
+                for (int key = first; key < first + keysPerThread; key++) {
+                    cmap.insert({key, key});
+                }
+                for (int key = first; key < first + keysPerThread; key++) {
+                    if (key % 2 == 0) cmap.insert({key, -key});
+                    if (key % 3 == 0) cmap.erase(key);
+                }
+            });
+        }
+        for (auto& t : writers) t.join();
+        done = true;
+        for (auto& t : readers) t.join();
+
+        std::unordered_map<int, int> map;
+        for (size_t key = 0; key < THREAD_INTENSITY * keysPerThread; key++) {
+            if (key % 3 != 0) map[key] = key % 2 == 0 ? -key : key;
+        }
+        EXPECT_EQ(cmap, map);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_InlineValue) {
+    // Writers keep overwriting the same keys in place while the map resizes
+    // under them. A reader must never see half of one write and half of
+    // another.
+    int const nKeys = 100;
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMap<int, std::array<float, 16>> cmap(3);
+        std::atomic<bool> done{};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.emplace_back([&]() {
+                while (!done) {
+                    for (int key = 0; key < nKeys; key++) {
+                        if (!cmap.contains(key)) continue;
+                        auto const features = cmap.at(key);
+                        EXPECT_EQ(features, record(features[0]));
+                    }
+                }
+            });
+        }
+        std::vector<std::thread> writers;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            writers.emplace_back([&, t]() {
+                for (int n = 0; n < 10; n++) {
+                    for (int key = 0; key < nKeys; key++) {
+                        cmap.insert({key, record(t * nKeys + key)});
+                    }
+                }
+            });
+        }
+        for (auto& t : writers) t.join();
+        done = true;
+        for (auto& t : readers) t.join();
+
+        EXPECT_EQ(cmap.size(), nKeys);
+        for (int key = 0; key < nKeys; key++) {
+            auto const features = cmap.at(key);
+            EXPECT_EQ(features, record(features[0]));
+            EXPECT_EQ(int(features[0]) % nKeys, key);
+        }
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_Add) {
+    // Every thread adds to the same few keys while the map resizes, none of
+    // the adds may get lost, whether the keys end up combined or not.
+    int const nKeys = 4;
+    int const nAdds = 10000;
+    for (size_t const hotKeyCasFailures : {size_t(0), size_t(4)}) {
+        for (size_t i = 0; i < REPEATS / 100; i++) {
+            KvsConfig config;
+            config.hotKeyCasFailures = hotKeyCasFailures;
+            ConcurrentUnorderedMap<int, int> cmap(3, config);
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+                threads.emplace_back([&, t]() {
+                    for (int n = 0; n < nAdds; n++) {
+                        cmap.add(n % nKeys, 1);
+                        // Keeps a resize going now and then.
+                        if (n % 100 == 0) {
+                            cmap.insert({nKeys + int(t) * nAdds + n, 0});
+                        }
+                    }
+                });
+            }
+            for (auto& t : threads) t.join();
+            for (int key = 0; key < nKeys; key++) {
+                EXPECT_EQ(cmap.at(key), int(THREAD_INTENSITY) * nAdds / nKeys);
+            }
+            cmap.merge_deltas();
+            for (int key = 0; key < nKeys; key++) {
+                EXPECT_EQ(cmap.at(key), int(THREAD_INTENSITY) * nAdds / nKeys);
+            }
+        }
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_AddDuringMerges) {
+    // Adds of 1 to a combined key while another thread keeps merging its
+    // deltas: a reader must never see the count go down, as it would if it
+    // summed the key half way through a merge.
+    KvsConfig config;
+    config.hotKeyCasFailures = 0;
+    ConcurrentUnorderedMap<int, int> cmap(8, config);
+    cmap.add(0, 1);
+    int const nAdds = 200000;
+    std::atomic<bool> done{};
+    std::thread adder([&]() {
+        for (int n = 1; n < nAdds; n++) cmap.add(0, 1);
+        done = true;
+    });
+    std::thread merger([&]() {
+        while (!done) cmap.merge_deltas();
+    });
+    int last = 0;
+    while (!done) {
+        auto const count = cmap.at(0);
+        EXPECT_GE(count, last);
+        last = count;
+    }
+    adder.join();
+    merger.join();
+    EXPECT_EQ(cmap.at(0), nAdds);
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_MissFilter) {
+    // Every thread reads back each key it inserts while the map resizes
+    // under it, a key can't be filtered out of the kvs it went into.
+    int const nKeys = 1000;
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        KvsConfig config;
+        config.missFilter = true;
+        ConcurrentUnorderedMap<int, int> cmap(8, config);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            threads.emplace_back([&, t]() {
+                for (int key = t * nKeys; key < int(t + 1) * nKeys; key++) {
+                    cmap.insert({key, key});
+                    EXPECT_EQ(cmap.at(key), key);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        for (int key = 0; key < int(THREAD_INTENSITY) * nKeys; key++) {
+            EXPECT_EQ(cmap.at(key), key);
+        }
+        EXPECT_FALSE(cmap.contains(-1));
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_AtomicBatch) {
+    // Threads move units between a few accounts, each move a batch that
+    // only goes ahead if neither account changed since it was read. Other
+    // threads write pairs of keys together, and readers check they never
+    // see one half of a pair ahead of the other. All while the map resizes.
+    int const nAccounts = 8;
+    int const nPairs = 4;
+    int const pairKeys = 1000;
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMap<int, int> cmap(3);
+        for (int account = 0; account < nAccounts; account++) {
+            cmap.insert({account, 100});
+        }
+        std::atomic<bool> done{};
+        std::vector<std::thread> readers;
+        for (int pair = 0; pair < nPairs; pair++) {
+            readers.emplace_back([&, pair]() {
+                int const first = pairKeys + 2 * pair;
+                while (!done) {
+                    if (!cmap.contains(first)) continue;
+                    auto const older = cmap.at(first);
+                    EXPECT_GE(cmap.at(first + 1), older);
+                }
+            });
+        }
+        std::vector<std::thread> writers;
+        for (int pair = 0; pair < nPairs; pair++) {
+            writers.emplace_back([&, pair]() {
+                int const first = pairKeys + 2 * pair;
+                for (int n = 0; n < 1000; n++) {
+                    cmap.atomic_batch({{BatchOpType::INSERT, first, n},
+                                       {BatchOpType::INSERT, first + 1, n}});
+                    // Filler keys keep the map resizing.
+                    cmap.insert({2 * pairKeys + pair * 1000 + n, n});
+                }
+            });
+        }
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            writers.emplace_back([&, t]() {
+                for (int n = 0; n < 200; n++) {
+                    int const from = (t + n) % nAccounts;
+                    int const to = (t + 3 * n + 1) % nAccounts;
+                    if (from == to) continue;
+                    while (true) {
+                        int const fromValue = cmap.at(from);
+                        int const toValue = cmap.at(to);
+                        if (cmap.atomic_batch(
+                                {{BatchOpType::INSERT, from, fromValue - 1,
+                                  fromValue},
+                                 {BatchOpType::INSERT, to, toValue + 1,
+                                  toValue}})) {
+                            break;
+                        }
+                    }
+                }
+            });
+        }
+        for (auto& t : writers) t.join();
+        done = true;
+        for (auto& t : readers) t.join();
+
+        int total = 0;
+        for (int account = 0; account < nAccounts; account++) {
+            total += cmap.at(account);
+        }
+        EXPECT_EQ(total, nAccounts * 100);
+        for (int pair = 0; pair < nPairs; pair++) {
+            EXPECT_EQ(cmap.at(pairKeys + 2 * pair), 999);
+            EXPECT_EQ(cmap.at(pairKeys + 2 * pair + 1), 999);
+        }
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_AtomicBatchInlineValues) {
+    // Test_AtomicBatch with values stored inline, so batches lock their
+    // slots instead of marking them.
+    int const nAccounts = 8;
+    int const pairKeys = 1000;
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMap<int, std::array<float, 16>> cmap(3);
+        for (int account = 0; account < nAccounts; account++) {
+            cmap.insert({account, record(100)});
+        }
+        std::atomic<bool> done{};
+        std::thread reader([&]() {
+            while (!done) {
+                if (!cmap.contains(pairKeys)) continue;
+                auto const older = cmap.at(pairKeys)[0];
+                EXPECT_GE(cmap.at(pairKeys + 1)[0], older);
+            }
+        });
+        std::vector<std::thread> writers;
+        writers.emplace_back([&]() {
+            for (int n = 0; n < 1000; n++) {
+                auto const value = record(n);
+                cmap.atomic_batch({{BatchOpType::INSERT, pairKeys, value},
+                                   {BatchOpType::INSERT, pairKeys + 1, value}});
+                cmap.insert({2 * pairKeys + n, value});
+            }
+        });
+        for (size_t t = 0; t < THREAD_INTENSITY; t++) {
+            writers.emplace_back([&, t]() {
+                for (int n = 0; n < 200; n++) {
+                    int const from = (t + n) % nAccounts;
+                    int const to = (t + 3 * n + 1) % nAccounts;
+                    if (from == to) continue;
+                    while (true) {
+                        auto const fromValue = cmap.at(from);
+                        auto const toValue = cmap.at(to);
+                        if (cmap.atomic_batch(
+                                {{BatchOpType::INSERT, from,
+                                  record(fromValue[0] - 1), fromValue},
+                                 {BatchOpType::INSERT, to,
+                                  record(toValue[0] + 1), toValue}})) {
+                            break;
+                        }
+                    }
+                }
+            });
+        }
+        for (auto& t : writers) t.join();
+        done = true;
+        reader.join();
+
+        float total = 0;
+        for (int account = 0; account < nAccounts; account++) {
+            total += cmap.at(account)[0];
+        }
+        EXPECT_EQ(total, nAccounts * 100);
+        EXPECT_EQ(cmap.at(pairKeys)[0], 999);
+        EXPECT_EQ(cmap.size(), nAccounts + 2 + 1000);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_ExportDuringInserts) {
+    // Exports run while writers keep the map resizing. They're only weakly
+    // consistent, but must come out sorted and hold nothing that was never
+    // inserted.
+    for (size_t i = 0; i < REPEATS / 100; i++) {
+        ConcurrentUnorderedMap<int, int> cmap(3);
+        std::atomic<bool> done{};
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; t++) {
+            writers.emplace_back([&, t]() {
+                for (int key = t; key < 40000; key += 4) {
+                    cmap.insert({key, -key});
+                }
+            });
+        }
+        std::thread exporter([&]() {
+            while (!done) {
+                auto const entries = cmap.to_sorted_vector(4);
+                EXPECT_TRUE(std::is_sorted(entries.begin(), entries.end()));
+                for (auto const& [key, value] : entries) {
+                    EXPECT_EQ(value, -key);
+                }
+            }
+        });
+        for (auto& t : writers) t.join();
+        done = true;
+        exporter.join();
+        EXPECT_EQ(cmap.to_sorted_vector().size(), 40000);
+    }
+}
+
+TEST(TestConcurrentUnorderedHashMap_MultiThread, Test_SharedMapProcesses) {
+    size_t const nProcesses = 4;
+    auto const name = sharedMapName();
+    auto const map = createRandomMap(10000);
+    // The children write more values than the arena has cells, they only
+    // fit because replaced values are given back.
+    SharedUnorderedMap<int, int> cmap(name, 32768, 0.5);
+    SharedUnorderedMap<int, int>::remove(name);
+
+    // Every child inserts all keys, so they race on claiming the same slots.
+    std::vector<pid_t> children;
+    for (size_t p = 0; p < nProcesses; p++) {
+        pid_t const pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            for (auto const& pair : map) {
+                cmap.insert({pair.first, int(p)});
+            }
+            for (auto const& pair : map) {
+                if (cmap.at(pair.first) >= int(nProcesses)) _exit(1);
+            }
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    for (auto const pid : children) {
+        int status;
+        waitpid(pid, &status, 0);
+        EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    EXPECT_EQ(cmap.size(), map.size());
+    for (auto const& pair : map) EXPECT_LT(cmap.at(pair.first), nProcesses);
+}
+
 int main(int argc, char** argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();